@@ -40,10 +40,21 @@
 #include <algorithm>
 #include <stdexcept>
 #include <ctime>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <exception>
 
 #include "tif.hpp"
 #include "alignment.hpp"
+#include "registration.hpp"
+#include "postprocess.hpp"
+#include "planes.hpp"
+#include "ringbuffer.hpp"
+#include "integration.hpp"
 
+#ifdef _WIN32
 #ifndef NOMINMAX
 #define NOMINMAX//windows min/max definitions conflict with std
 #endif
@@ -52,68 +63,132 @@
 //	#define WIN32_LEAN_AND_MEAN
 //#endif
 #include <windows.h>
+#endif
 #include "NIDAQmx.h"
+#include "waveform.hpp"
+#include "acquisition.hpp"
 // #include "MachineTalkControl.hpp"	// add this to use the computer's audio system, virtual keyboard, and virtual mouse
 
 class ExternalScan {
 private:
-	std::string xPath, yPath;                     //path to analog output channels for scan control
-	std::string etdPath;                          //path to analog input channel for etd
+	std::unique_ptr<AcquisitionDevice> device;    //device to drive scan and collect etd signal
 	uInt64 nDwellSamples;                         //samples per pixel (collection occurs at fastest possible speed)
 	float64 vRangeH, vRangeV;					  //voltage ranges (horizontal and vertical) for scan (scan will go from -vRange -> +vRange in the larger direction)
 	uInt64 width, height;						  //dimensions of the scan
 	float64 delayRatio;							  //delayRatio at the beginning of line for raster scan
 	bool snake;                                   //true/false to snake/raster
-	TaskHandle hInput, hOutput;                   //handles to input and output tasks
-	float64 sampleRate;                           //maximum device sample rate
+	float64 sampleRate;                           //device sample rate
 	uInt64 iRow;                                  //current row being collected
 	//uInt64 iFrame;									// current frame being collected
-	std::vector<int16> buffer;                    //working array to read rows from device buffer
-
-	std::vector<std::vector<std::vector<std::vector<int16> > > > frameImagesRaw;		// working array to hold entire frame, [nLineInt][nRS][nDwellSamples] pages of vector(height x width)
+	RowRing<int16> rowRing;                       //raw rows waiting to be processed (filled by device callback, emptied by worker)
+	size_t ringDepth;                             //number of rows rowRing can hold
+	std::thread worker;                           //thread processing rows from rowRing
+	std::atomic<bool> acquiring;                  //false once the device has finished delivering rows to rowRing
+	std::atomic<bool> processing;                 //false once the worker has stopped taking rows from rowRing (e.g. after an error)
+	std::vector<int16> droppedRow;                //destination for rows read after the worker has stopped
+	std::exception_ptr workerError;               //exception raised while processing rows
+	std::atomic<bool> readFailed;                 //true once a row read has failed (the device callback can't throw)
+	int32 failedRead;                             //result of the first failed read (negative error code or short sample count), set before readFailed
+	uInt64 iRowProcessed;                         //current row being processed (worker only)
+	std::vector<int16*> rowPlanes;                //destination rows in frameImagesRaw for each dwell sample of the row being processed
+
+	PlaneStore<int16> frameImagesRaw;		// working array to hold entire frame, [nLineInt][nRS][nDwellSamples] planes of (height x width_m)
 	std::vector<std::vector<std::vector<uInt16> > > frameImagesD;		// has [nFrameInt]*[nLineInt*nRS*nDwellSamples] pages
-	std::vector<std::vector<uInt16> > frameImagesF;		// has nFrame pages
 	std::vector<uInt16> frameImagesA;						// one page holding the average value
+	std::vector<std::uint32_t> frameSum;						// streaming mode: running sum of every sample of every frame for each pixel (height x width)
+	bool streaming;				// true to sum rows into frameSum as they arrive instead of storing every page
+	bool configured;			// true once the device holds the scan pattern (it is reused for every frame and image)
+	TifWriteQueue writer;		// writes finished images in the background (declared after the images so pending raw writes finish before they are destroyed)
+	std::vector<std::future<void> > rawWrites;	// raw page dumps of the current image, written straight from frameImagesD
 
 
 	uInt64 nRS;			// A parameter affected by raster/snake.  nRS=2 if raster, we have an additional nDwellSamples layers of image in the reverse scan direction
 	uInt64 nLineInt;	// number for line integration
 	uInt64 nFrameInt;	// number for frame integration
-	std::vector<float64> scanData;	// holds the scan data
+	ScanWaveform scanWaveform;	// scan pattern (computed on the fly from a row template)
 
 	float64 vBlack, vWhite;		// voltage corresponding to black and white pixel
 	float64 maxShift;			// maximum pixel shift for fft to correct
+	RegistrationMode registration;	// frame to frame drift correction applied before frames are averaged
+	ShiftProfile rowProfile;	// how row shifts found by the fft correction are applied
+	SubpixelMethod subpixel;	// how the fft correction finds the subpixel shift of each row
+	bool spectralSum;			// sum corrected pages in the frequency domain and round each output pixel once
 	uInt64 width_m;				// the initial width value in the input.  If delay is used, the 'width' is modified.
 
 
-	//@brief: check a DAQmx return code and convert to an exception if needed
-	//@param error: return code to check
-	//@param message (optional): description of action being attempted to include in exception
-	void DAQmxTry(int32 error, std::string message = std::string());
+	//@brief: generate x/y voltages for scan
+	//@return: scan pattern
+	ScanWaveform generateWaveform() const;
 
-	//@brief: generate interleaved x/y voltages for scan
-	//@return: scan data
-	std::vector<float64> generateScanData() const;
-
-	//@brief: check scan parameters, configure DAQmx tasks, and write scan pattern to buffer
+	//@brief: check scan parameters, configure acquisition device, and write scan pattern to buffer
 	void configureScan();
 
-	//@brief: stop and clear configured tasks
+	//@brief: size working buffers for the current parameters (memory is only reallocated if a size changes)
+	void allocateBuffers();
+
+	//@brief: stop and clear configured device
 	void clearScan();
 
-	//@brief: read row of raw data from buffer (large images with many samples may be too large to hold in the device buffer)
+	//@brief: read row of raw data from buffer into rowRing (large images with many samples may be too large to hold in the device buffer)
+	//@return: 0 on success, -1 if the row was dropped (failed reads are recorded in failedRead and reported by execute)
 	int32 readRow();
 
+	//@brief: split a row of raw data into frameImagesRaw
+	//@param raw: interleaved samples for the row
+	void processRow(int16 const * const raw);
+
+	//@brief: add every sample of a row of raw data to frameSum (streaming mode)
+	//@param raw: interleaved samples for the row
+	void accumulateRow(int16 const * const raw);
+
+	//@brief: process rows from rowRing until acquisition is finished and the ring is empty (worker thread)
+	void processRows();
+
 public:
-	static int32 CVICALLBACK EveryNCallback(TaskHandle taskHandle, int32 everyNsamplesEventType, uInt32 nSamples, void *callbackData) {
+	static int32 EveryNCallback(void *callbackData) {
 		return reinterpret_cast<ExternalScan*>(callbackData)->readRow();
 	}
 
+	//@brief: set the number of raw rows that can be buffered between the device callback and processing
+	//@param depth: number of rows (takes effect for the next scan)
+	void setRingDepth(const size_t depth) {ringDepth = std::max<size_t>(depth, 1);}
+
+	//@brief: set how frames are registered to the first frame before they are averaged
+	//@param mode: registration model (takes effect for the next scan)
+	void setFrameRegistration(const RegistrationMode mode) {registration = mode;}
+
+	//@brief: set how the row shifts found by the fft correction are applied
+	//@param profile: uniform (mean shift) or per row (smoothed profile, for line jitter)
+	void setRowShiftProfile(const ShiftProfile profile) {rowProfile = profile;}
+
+	//@brief: set how the fft correction finds the subpixel shift of each row
+	//@param method: kernel walk (exact to the upsampling factor) or a single inverse fft refined by a parabola, gaussian, or local dft
+	void setSubpixelMethod(const SubpixelMethod method) {subpixel = method;}
+
+	//@brief: set how corrected pages are integrated
+	//@param sum: true to add the shifted pages in the frequency domain (one inverse fft per line group, rounded once per output), false to round every corrected page
+	void setSpectralSum(const bool sum) {spectralSum = sum;}
+
+	//@brief: wait for every image queued by execute to be written to disk
+	//@note: rethrows the first write error
+	void waitForWrites() {writer.wait();}
+
+	//@brief: get row ring buffer usage for the most recent frame
+	RingStats ringStats() const {return rowRing.stats();}
+
 	//chenzhe: add width and witdh_i part.  add more inputs.
-	ExternalScan(std::string x, std::string y, std::string e, uInt64 s, float64 a, float64 b, uInt64 w, uInt64 h, bool sn, float64 black, float64 white, uInt64 ls, uInt64 fs, float64 dr) {
-		xPath = x;
-		yPath = y;
-		etdPath = e;
+	//dev: acquisition device to use instead of the NI-DAQmx device at x/y/e (e.g. a SimulatedDevice)
+	ExternalScan(std::string x, std::string y, std::string e, uInt64 s, float64 a, float64 b, uInt64 w, uInt64 h, bool sn, float64 black, float64 white, uInt64 ls, uInt64 fs, float64 dr, std::unique_ptr<AcquisitionDevice> dev = nullptr) {
+		if (dev) {
+			device = std::move(dev);
+		} else {
+#ifdef EXTERNAL_SCAN_NO_DAQMX
+			(void)x; (void)y; (void)e;//channels are only used by the NI-DAQmx device
+			throw std::runtime_error("built without NI-DAQmx, a simulated device must be used");
+#else
+			device.reset(new DAQmxDevice(x, y, e));
+#endif
+		}
 		nDwellSamples = s;
 		vRangeH = a;
 		vRangeV = b;
@@ -125,6 +200,11 @@ public:
 		vWhite = white;
 		nLineInt = ls;
 		nFrameInt = fs;
+		ringDepth = 16;
+		registration = RegistrationMode::None;
+		rowProfile = ShiftProfile::Uniform;
+		subpixel = SubpixelMethod::KernelWalk;
+		spectralSum = false;
 
 		// externalOnOff();	// chenzhe, when constructing, first turn external on
 		if (snake){
@@ -135,11 +215,9 @@ public:
 			width_m = width + 2 * (uInt64)(width * delayRatio/2);	// delayRatio/2, because each side get half of the delay time.
 			nRS = 1;
 		}
-		scanData = generateScanData();
-
-		frameImagesD.assign(nFrameInt, std::vector<std::vector<uInt16> >(nLineInt*nRS*nDwellSamples, std::vector<uInt16>((size_t)width * height)));
-		frameImagesF.assign(nFrameInt, std::vector<uInt16>((size_t)width*height));
-		frameImagesA.assign((size_t)width * height, 0);
+		scanWaveform = generateWaveform();
+		streaming = false;
+		configured = false;
 		// configureScan(); 
 	}
 	~ExternalScan() {
@@ -151,33 +229,7 @@ public:
 	void execute(std::string fileName, bool saveAverageOnly, float64 maxShift, bool correctTF);	// chenzhe, add input variables "correct", "saveAverageOnly", "nFrames", "maxShift", 
 };
 
-void ExternalScan::DAQmxTry(int32 error, std::string message) {
-	//if (!message.empty())	std::cout << message << std::endl; // for debug, can add a display of the 'message'
-
-	if (0 != error) {
-		//get error message
-		int32 buffSize = DAQmxGetExtendedErrorInfo(NULL, 0);
-		if (buffSize < 0) buffSize = 8192;//sometimes the above returns an error code itself
-		std::vector<char> buff(buffSize, 0);
-		DAQmxGetExtendedErrorInfo(buff.data(), (uInt32)buff.size());
-
-		//stop and clear tasks and throw
-		if (0 != hInput) {
-			DAQmxStopTask(hInput);
-			DAQmxClearTask(hInput);
-		}
-		if (0 != hOutput) {
-			DAQmxStopTask(hOutput);
-			DAQmxClearTask(hOutput);
-		}
-		if (message.empty())
-			throw std::runtime_error("NI-DAQmx error " + std::to_string(error) + ":\n" + std::string(buff.data()));
-		else
-			throw std::runtime_error("NI-DAQmx error " + message + " " + std::to_string(error) + ":\n" + std::string(buff.data()));
-	}
-}
-
-std::vector<float64> ExternalScan::generateScanData() const {
+ScanWaveform ExternalScan::generateWaveform() const {
 	//generate uniformly spaced square grid of points from -vRange -> vRange in largest direction
 	std::vector<float64> xData((size_t)width), yData((size_t)height);
 	std::iota(xData.begin(), xData.end(), 0.0);
@@ -201,65 +253,28 @@ std::vector<float64> ExternalScan::generateScanData() const {
 	// We want to be safe
 	// reduce this step further by a factor of 4, so it is even smaller, so 100% delay corresponds to 1V
 	float64 d1 = (xData[1] - xData[0])/4;	
-	// If snake, insert at begin&end.  If raster, only insert at begin.
-	for (int i = 0; i < (width_m - width) / 2; ++i){
-		xData.insert(xData.begin(), xData.front() - d1);
-		if (snake){
-			xData.insert(xData.end(), xData.back() + d1);
-		}
-		else{
-			xData.insert(xData.begin(), xData.front() - d1);
-		}
-	}
+	// If snake, pad begin&end.  If raster, only pad begin.
+	const size_t nPad = (size_t)(width_m - width);
+	const size_t nBegin = snake ? nPad / 2 : nPad;
+	std::vector<float64> xPadded;
+	xPadded.reserve((size_t)width_m);
+	for (size_t i = nBegin; i > 0; --i) xPadded.push_back(xData.front() - d1 * i);
+	xPadded.insert(xPadded.end(), xData.begin(), xData.end());
+	for (size_t i = 1; i <= nPad - nBegin; ++i) xPadded.push_back(xData.back() + d1 * i);
+	xData.swap(xPadded);
 	std::cout << "scan voltage range: " << xData.front() << " volts to " << xData.back() << " volts \n";
 	// std::reverse(yData.begin(), yData.end());	// y should be reversed to get positive image for FEI Teneo. But not necessary for Tescan
 
-	//generate single pass scan, double the data if we always use snake.  If use raster, do not double.
-	std::vector<float64> scan;
-	const uInt64 scanPixels = width_m * height * nRS * nLineInt;
-	scan.reserve(2 * (size_t)scanPixels);
-	if (snake) {
-		for (uInt64 i = 0; i < height; i++) {
-			for (uInt64 j = 0; j < nLineInt; ++j){
-				scan.insert(scan.end(), xData.begin(), xData.end());
-				scan.insert(scan.end(), xData.rbegin(), xData.rend());
-			}
-		}
-		for (uInt64 i = 0; i < height; i++) {
-			for (uInt64 j = 0; j < nLineInt; ++j){
-				scan.insert(scan.end(), (size_t)width_m, yData[(size_t)i]);
-				scan.insert(scan.end(), (size_t)width_m, yData[(size_t)i]);
-			}
-		}
-	}
-	else {
-		for (uInt64 i = 0; i < height; i++) {
-			for (uInt64 j = 0; j < nLineInt; ++j){
-				scan.insert(scan.end(), xData.begin(), xData.end());
-			}
-		}
-		for (uInt64 i = 0; i < height; i++) {
-			for (uInt64 j = 0; j < nLineInt; ++j){
-				scan.insert(scan.end(), (size_t)width_m, yData[(size_t)i]);
-			}
-		}
-	}
+	//the full scan is only computed in chunks as it is written to the device
+	ScanWaveform scan;
+	scan.assign(xData, yData, snake, nLineInt);
 	return scan;
 }
 
 void ExternalScan::configureScan() {
 	float factorT = 1.2;	// just a factor
-	//create tasks and channels
 	clearScan();//clear existing scan if needed
-	DAQmxTry(DAQmxCreateTask("scan generation", &hOutput), "creating output task");
-	DAQmxTry(DAQmxCreateTask("etd reading", &hInput), "creating input task");
-	// chenzhe, modify (-vRange, vRange) use vRange of vRangeV
-	DAQmxTry(DAQmxCreateAOVoltageChan(hOutput, (xPath + "," + yPath).c_str(), "", -(vRangeH>vRangeV ? vRangeH : vRangeV)*factorT, factorT*(vRangeH>vRangeV ? vRangeH : vRangeV), DAQmx_Val_Volts, NULL), "creating output channel");
-	DAQmxTry(DAQmxCreateAIVoltageChan(hInput, etdPath.c_str(), "", DAQmx_Val_Cfg_Default, vBlack, vWhite, DAQmx_Val_Volts, NULL), "creating input channel"); // chenzhe: change "-10.0, 10.0" to "vBlack, vWhite"
-
-	//get the maximum anolog input rate supported by the daq
-	DAQmxTry(DAQmxGetSampClkMaxRate(hInput, &sampleRate), "getting device maximum input frequency");
-	sampleRate = 1000000;	// Note: sometimes reduce the sample rate can affect the error "writing scan to buffer".
+	sampleRate = device->sampleRate();
 	const float64 effectiveDwell = (1000000.0 * nDwellSamples) / sampleRate;
 
 	//check scan rate, the microscope is limited to a 300 ns dwell at 768 x 512
@@ -267,94 +282,197 @@ void ExternalScan::configureScan() {
 	const float64 minDwell = (768.0 / width_m) * (4.0 / ((vRangeH > vRangeV ? vRangeH : vRangeV)*factorT));	//minimum dwell time in us.  vRangeH correspond to the lineScan direction, so vRangeV shouldn't affect this.
 	if (effectiveDwell < minDwell) throw std::runtime_error("Dwell time too short - dwell must be at least " + std::to_string(minDwell) + " us for " + std::to_string(width) + " pixel scan lines");
 
-	//configure timing
-	const uInt64 scanPoints = width_m * height * nRS * nLineInt;
-	DAQmxTry(DAQmxCfgSampClkTiming(hOutput, "", sampleRate / nDwellSamples, DAQmx_Val_Rising, DAQmx_Val_FiniteSamps, scanPoints), "configuring output timing");
-
-	//configure device buffer / data transfer
-	const uInt64 rowDataPoints = width_m * nDwellSamples * nRS * nLineInt;
-	uInt64 bufferSize = 4 * rowDataPoints;//allocate buffer big enough to hold 4 rows of data
-	DAQmxTry(DAQmxSetBufInputBufSize(hInput, (uInt32)bufferSize), "set buffer size");
-	DAQmxTry(DAQmxCfgSampClkTiming(hInput, "", sampleRate, DAQmx_Val_Rising, DAQmx_Val_ContSamps, bufferSize), "configuring input timing");
-	DAQmxRegisterEveryNSamplesEvent(hInput, DAQmx_Val_Acquired_Into_Buffer, (uInt32)(width_m * nDwellSamples * nRS * nLineInt), 0, ExternalScan::EveryNCallback, reinterpret_cast<void*>(this));
-
-	//configure start triggering
-	std::string trigName = "/" + xPath.substr(0, xPath.find('/')) + "/ai/StartTrigger";//use output trigger to start input
-	DAQmxTry(DAQmxCfgDigEdgeStartTrig(hOutput, trigName.c_str(), DAQmx_Val_Rising), "setting start trigger");
-
-	//write scan data to device buffer
-	int32 written;
-	DAQmxTry(DAQmxWriteAnalogF64(hOutput, (int32)scanPoints, FALSE, DAQmx_Val_WaitInfinitely, DAQmx_Val_GroupByChannel, scanData.data(), &written, NULL), "writing scan to buffer");
-	if (scanPoints != written) throw std::runtime_error("failed to write all scan data to buffer");
-
-	//allocate arrays to hold single row of data points and entire image
-	buffer.assign((size_t)rowDataPoints, 0);
-	frameImagesRaw.assign(nLineInt, std::vector<std::vector<std::vector<int16> > >(nRS, std::vector<std::vector<int16> >(nDwellSamples, std::vector<int16>((size_t)width_m * height))));	//hold each frame as one block of memory, but expand one line into 2 lines
+	//configure device
+	AcquisitionConfig config;
+	config.vOutput = factorT*(vRangeH>vRangeV ? vRangeH : vRangeV);	// chenzhe, modify (-vRange, vRange) use vRange of vRangeV
+	config.vBlack = vBlack;	// chenzhe: change "-10.0, 10.0" to "vBlack, vWhite"
+	config.vWhite = vWhite;
+	config.dwellSamples = nDwellSamples;
+	config.scanPoints = scanWaveform.points();
+	config.rowSamples = width_m * nDwellSamples * nRS * nLineInt;
+	config.bufferSamples = 4 * config.rowSamples;//allocate buffer big enough to hold 4 rows of data
+	device->configure(config, scanWaveform, ExternalScan::EveryNCallback, reinterpret_cast<void*>(this));
+	configured = true;
+}
+
+void ExternalScan::allocateBuffers() {
+	//allocate arrays to hold rows of data points and entire image
+	rowRing.assign(ringDepth, (size_t)(width_m * nDwellSamples * nRS * nLineInt));
+	droppedRow.resize(rowRing.rowLength());
+	rowPlanes.resize((size_t)nDwellSamples);
+	if (streaming) frameImagesRaw.assign(0, 0, 0);	// rows are summed as they arrive, no need to hold the frame
+	else frameImagesRaw.assign((size_t)(nLineInt * nRS * nDwellSamples), (size_t)height, (size_t)width_m);	//hold each frame as one block of memory, but expand one line into 2 lines
 }
 
 void ExternalScan::clearScan() {
-	if (NULL != hInput) {
-		DAQmxStopTask(hInput);
-		DAQmxClearTask(hInput);
-		hInput = NULL;
-		// std::cout << "clear input task while destructing" << std::endl;	// can add a message for debug
-	}
-	if (NULL != hOutput) {
-		DAQmxStopTask(hOutput);
-		DAQmxClearTask(hOutput);
-		hOutput = NULL;
-		// std::cout << "clear output task while destructing" << std::endl;	// can add a message for debug
-	}
+	device->clear();
+	configured = false;
 }
 
-// Whether raster or snake, after readrow, the image is positive.  No backward lines.
 int32 ExternalScan::readRow() {
-	int32 read;
-	DAQmxTry(DAQmxReadBinaryI16(hInput, (int32)buffer.size(), DAQmx_Val_WaitInfinitely, DAQmx_Val_GroupByChannel, buffer.data(), (uInt32)buffer.size(), &read, NULL), "reading data from buffer");
+	//only copy raw samples here so the device buffer is emptied as quickly as possible
+	int16* slot = rowRing.acquireWrite();
+	while (NULL == slot) {//processing has fallen behind, wait for a free slot (the device buffer holds samples in the meantime)
+		if (!processing.load()) {//the worker failed and will never free a slot, drain the row so the device can finish and report the error
+			device->read(droppedRow.data(), (uInt32)droppedRow.size());
+			return -1;
+		}
+		std::this_thread::yield();
+		slot = rowRing.acquireWrite();
+	}
+	int32 read = device->read(slot, (uInt32)rowRing.rowLength());
 	if (iRow >= height) return 0;	//input is continuous so samples will be collected after the scan is complete
-	std::cout << "\rcompleted row " << (iRow + 1) << "/" << height;
-	if (buffer.size() != read) throw std::runtime_error("failed to read all scan data from buffer");
+	if (read < 0 || rowRing.rowLength() != size_t(read)) {
+		if (!readFailed.load()) {//keep the first failure
+			failedRead = read;
+			readFailed.store(true);
+		}
+		return -1;
+	}
+	rowRing.commitWrite();
+	++iRow;
+	return 0;
+}
+
+void ExternalScan::processRows() {
+	try {
+		while (true) {
+			int16 const * const raw = rowRing.acquireRead();
+			if (NULL == raw) {
+				if (!acquiring.load() && NULL == rowRing.acquireRead()) return;//all rows have been delivered and processed
+				std::this_thread::yield();
+				continue;
+			}
+			processRow(raw);
+			rowRing.releaseRead();
+		}
+	} catch (...) {
+		workerError = std::current_exception();
+	}
+	processing.store(false);
+}
 
+// Whether raster or snake, after processRow, the image is positive.  No backward lines.
+void ExternalScan::processRow(int16 const * const raw) {
+	if (iRowProcessed >= height) return;
+	std::cout << "\rcompleted row " << (iRowProcessed + 1) << "/" << height;
+	if (streaming) {
+		accumulateRow(raw);
+		++iRowProcessed;
+		return;
+	}
+
+	// split each pass of the row into its dwell sample planes, the buffer is ordered [nLineInt][nRS][width_m][nDwellSamples]
 	for (uInt64 iLineInt = 0; iLineInt < nLineInt; ++iLineInt){
 		for (uInt64 iRS = 0; iRS < nRS; ++iRS){
+			const size_t iPass = (size_t)(iLineInt*nRS + iRS);
+			for (size_t iDwellSamples = 0; iDwellSamples < nDwellSamples; iDwellSamples++) rowPlanes[iDwellSamples] = frameImagesRaw.row(iPass*(size_t)nDwellSamples + iDwellSamples, (size_t)iRowProcessed);
 			if (snake && (1 == iRS)) {
-				const uInt64 rowOffset = width_m * iRow + width_m - 1;	//offset of row end
-				for (uInt64 iDwellSamples = 0; iDwellSamples < nDwellSamples; iDwellSamples++)
-					for (uInt64 iCol = 0; iCol < width_m; iCol++)
-						frameImagesRaw[iLineInt][iRS][iDwellSamples][(size_t)(rowOffset - iCol)] = buffer[(size_t)(iLineInt*nRS*nDwellSamples*width_m + iRS*nDwellSamples*width_m + nDwellSamples*iCol + iDwellSamples)];
+				// backward pass is reversed in place, so keep it in cache instead of streaming
+				deinterleave(raw + iPass*nDwellSamples*width_m, rowPlanes.data(), (size_t)nDwellSamples, (size_t)width_m, false);
+				for (size_t iDwellSamples = 0; iDwellSamples < nDwellSamples; iDwellSamples++) std::reverse(rowPlanes[iDwellSamples], rowPlanes[iDwellSamples] + width_m);
 			}
 			else {
-				const uInt64 rowOffset = width_m * iRow;		//offset of row start
-				for (uInt64 iDwellSamples = 0; iDwellSamples < nDwellSamples; iDwellSamples++) {
-					for (uInt64 iCol = 0; iCol < width_m; iCol++) {
-						frameImagesRaw[iLineInt][iRS][iDwellSamples][(size_t)(rowOffset + iCol)] = buffer[(size_t)(iLineInt*nRS*nDwellSamples*width_m + iRS*nDwellSamples*width_m + nDwellSamples*iCol + iDwellSamples)];
-					}
-				}
+				deinterleave(raw + iPass*nDwellSamples*width_m, rowPlanes.data(), (size_t)nDwellSamples, (size_t)width_m, true);
 			}
 		}
 	}
 
-	++iRow;
-	return 0;
+	++iRowProcessed;
+}
+
+void ExternalScan::accumulateRow(int16 const * const raw) {
+	// the delay region is dropped: snake keeps the center of the line, raster keeps the end
+	const size_t offset = (size_t)(snake ? (width_m - width) / 2 : width_m - width);
+	const std::int64_t dwellOffset = std::int64_t(nDwellSamples) * 32768;	// raw samples are offset from pixel values by 32768 (64 bit since int32 is 32 bits on windows)
+	std::uint32_t * const sum = frameSum.data() + (size_t)(iRowProcessed * width);
+	for (uInt64 iLineInt = 0; iLineInt < nLineInt; ++iLineInt){
+		for (uInt64 iRS = 0; iRS < nRS; ++iRS){
+			int16 const * const pass = raw + (size_t)((iLineInt*nRS + iRS)*nDwellSamples*width_m);
+			const bool backward = snake && (1 == iRS);
+			for (size_t iCol = 0; iCol < width; iCol++) {
+				// backward passes are reversed here instead of being flipped in place
+				int16 const * const pixel = pass + (backward ? width_m - 1 - offset - iCol : offset + iCol) * nDwellSamples;
+				std::int64_t v = dwellOffset;
+				for (size_t iDwellSamples = 0; iDwellSamples < nDwellSamples; iDwellSamples++) v += pixel[iDwellSamples];
+				sum[iCol] += std::uint32_t(v);
+			}
+		}
+	}
 }
 
 void ExternalScan::execute(std::string fileName, bool saveAverageOnly, float64 maxShift, bool correctTF) {
-	for (int iFrameInt = 0; iFrameInt < nFrameInt; ++iFrameInt){
-		configureScan();
-		//execute scan
+	// when neither the individual pages nor the shift correction are needed every sample can be summed as it arrives, so only one page is held
+	const uInt64 samplesPerPixel = nFrameInt * nLineInt * nRS * nDwellSamples;
+	const bool registering = RegistrationMode::None != registration && nFrameInt > 1;
+	for (std::future<void>& f : rawWrites) f.wait();	// a previous image that failed may have left raw dumps reading frameImagesD
+	rawWrites.clear();
+	streaming = saveAverageOnly && !correctTF && !registering && samplesPerPixel <= 65537;	// sum of up to 65537 16 bit samples fits in 32 bits
+	if (streaming) {
+		frameSum.assign((size_t)width * height, 0);
+		std::vector<std::vector<std::vector<uInt16> > >().swap(frameImagesD);
+	} else {
+		std::vector<std::uint32_t>().swap(frameSum);
+		// pages are handed back after integration, so they are only reallocated if the image size changes (or a previous image failed part way)
+		frameImagesD.resize((size_t)nFrameInt);
+		for (std::vector<std::vector<uInt16> >& pages : frameImagesD) {
+			pages.resize((size_t)(nLineInt*nRS*nDwellSamples));
+			for (std::vector<uInt16>& page : pages) page.resize((size_t)(width * height));
+		}
+	}
+	frameImagesA.assign((size_t)width * height, 0);
+
+	// the device is configured once and the scan is replayed for each frame (and subsequent images)
+	if (!configured) configureScan();
+	allocateBuffers();
+
+	for (uInt64 iFrameInt = 0; iFrameInt < nFrameInt; ++iFrameInt){
+		//start processing thread and execute scan
 		iRow = 0;
-		DAQmxTry(DAQmxStartTask(hOutput), "starting output task");
-		DAQmxTry(DAQmxStartTask(hInput), "starting input task");
+		rowRing.reset();
+		iRowProcessed = 0;
+		workerError = NULL;
+		readFailed.store(false);
+		acquiring.store(true);
+		processing.store(true);
+		worker = std::thread(&ExternalScan::processRows, this);
+		const std::chrono::steady_clock::time_point scanStart = std::chrono::steady_clock::now();
+		try {
+			device->start();
+		} catch (...) {
+			acquiring.store(false);
+			worker.join();
+			throw;
+		}
 
 		//wait for scan to complete
-		float64 scanTime = float64(width_m * height * nDwellSamples * nRS * nLineInt) / sampleRate + 5.0;//allow an extra 5s
+		const uInt64 scanSamples = width_m * height * nDwellSamples * nRS * nLineInt;
+		float64 scanTime = float64(scanSamples) / sampleRate + 5.0;//allow an extra 5s
 		std::cout << "imaging (expected duration ~" << scanTime - 5.0 << "s)\n";
-		//DAQmxTry(DAQmxWaitUntilTaskDone(hOutput, scanTime), "waiting for output task");
-		DAQmxWaitUntilTaskDone(hOutput, DAQmx_Val_WaitInfinitely);	// just wait.  dUsing DAQmxTry is not good, maybe returns too early.
-		//Sleep((DWORD)(1 + (1000 * nDwellSamples) / sampleRate)); //give the input task enough time to be sure that it is finished.
+		try {
+			device->waitUntilDone();
+			//Sleep((DWORD)(1 + (1000 * nDwellSamples) / sampleRate)); //give the input task enough time to be sure that it is finished.
+			device->stop();
+			if (readFailed.load()) {
+				if (failedRead < 0) throw std::runtime_error("failed to read all scan data from buffer (error " + std::to_string(failedRead) + ")");
+				throw std::runtime_error("failed to read all scan data from buffer (" + std::to_string(failedRead) + " of " + std::to_string(rowRing.rowLength()) + " samples)");
+			}
+		} catch (...) {
+			acquiring.store(false);
+			worker.join();
+			throw;
+		}
 
-		DAQmxTry(DAQmxStopTask(hInput), "stopping input task");
-		std::cout << '\n';
+		//let the worker finish any rows still in the ring
+		acquiring.store(false);
+		worker.join();
+		if (NULL != workerError) std::rethrow_exception(workerError);
+		if (iRowProcessed != height) std::cout << "\nwarning: only " << iRowProcessed << " of " << height << " rows were acquired";
+		const float64 elapsed = std::chrono::duration<float64>(std::chrono::steady_clock::now() - scanStart).count();
+		const RingStats stats = rowRing.stats();
+		std::cout << "\nacquired " << scanSamples << " samples in " << elapsed << "s (" << scanSamples / elapsed / 1000000.0 << " MS/s)\n";
+		std::cout << "row ring: depth " << stats.depth << ", high water " << stats.highWater << ", full " << stats.stalls << " times\n";
+		if (streaming) continue;	// rows were already added to frameSum
 
 		// Correct image data range to 0-65535 value range
 		for (size_t iLineInt = 0; iLineInt < nLineInt; ++iLineInt){
@@ -373,8 +491,8 @@ void ExternalScan::execute(std::string fileName, bool saveAverageOnly, float64 m
 						// Because sometimes we use a dealy, we need to process the data row-by-row instead of just copying the whole directly:
 						// std::transform(frameImagesRaw[i].begin(), frameImagesRaw[i].end(), frameImagesDL[iFrameInt].begin(), [](const int16& a){return uInt16(a) + 32768; });
 						for (size_t j = 0; j < height; ++j){
-							std::transform(frameImagesRaw[iLineInt][iRS][iDS].begin() + j*width_m + (width_m - width) / 2,
-								frameImagesRaw[iLineInt][iRS][iDS].begin() + j*width_m + (width_m + width) / 2,
+							int16 const * const rowRaw = frameImagesRaw.row(iLineInt*nRS*nDwellSamples + iRS*nDwellSamples + iDS, j);
+							std::transform(rowRaw + (width_m - width) / 2, rowRaw + (width_m + width) / 2,
 								frameImagesD[iFrameInt][ind].begin() + j * width, [](const int16& a){return uInt16(a) + 32768; });
 						}
 
@@ -383,80 +501,60 @@ void ExternalScan::execute(std::string fileName, bool saveAverageOnly, float64 m
 						size_t ind = iLineInt*nRS*nDwellSamples + iRS*nDwellSamples + iDS;
 						// This is for raster, i.e., not backward scan
 						for (size_t j = 0; j < height; ++j){
-							std::transform(frameImagesRaw[iLineInt][iRS][iDS].begin() + j*width_m + width_m - width, frameImagesRaw[iLineInt][iRS][iDS].begin() + j*width_m + width_m,
+							int16 const * const rowRaw = frameImagesRaw.row(ind, j);
+							std::transform(rowRaw + width_m - width, rowRaw + width_m,
 								frameImagesD[iFrameInt][ind].begin() + j * width, [](const int16& a){return uInt16(a) + 32768; });
 						}
 					}
 				}
 			}
 		}
-	}
-
-	for (size_t iFrameInt = 0; iFrameInt < nFrameInt; ++iFrameInt){
-		// need to apply average between these lineInts.  Backward scan already reversed and repositioned, so it's the same line integration.
-		std::vector< std::vector<uInt16> > frameImagesL(nLineInt, std::vector<uInt16>((size_t)width * height));	// temp for all the lineInt images under this frame
-
-		for (size_t iLineInt = 0; iLineInt < nLineInt; ++iLineInt){
-			// copy each LineInt to a temp vector (nRS = either 1 or 2,)
-			std::vector<std::vector<uInt16> > tempV(nRS*nDwellSamples, std::vector<uInt16>((size_t)width*height));
-			std::vector<std::vector<uInt16> >::iterator it = frameImagesD[iFrameInt].begin();
-			std::copy(it + iLineInt*nRS*nDwellSamples, it + iLineInt*nRS*nDwellSamples + nRS*nDwellSamples, tempV.begin());
-
-			if (!saveAverageOnly) {
-				std::string fileNameRS = fileName;
-				fileNameRS.insert(fileNameRS.find("."), "_Frame_");
-				fileNameRS.insert(fileNameRS.find("."), std::to_string(iFrameInt));
-				fileNameRS.insert(fileNameRS.find("."), "_Line_");
-				fileNameRS.insert(fileNameRS.find("."), std::to_string(iLineInt));
-				fileNameRS.insert(fileNameRS.find("."), "_RSs_noFFT");
-				Tif::Write(tempV, (uInt32)width, (uInt32)height, fileNameRS);
-			}
-
-			// apply shift correction
-			if (correctTF){
-				try{
-					std::vector<float> shifts = correlateRows<float>(tempV, height, width, FALSE, maxShift);	// Backward scan reversed, so this is always raster.
-				}
-				catch (std::exception &e){
-				}
-			}
-
-			// average and assign to frameImagesL,
-			for (int iPixel = 0; iPixel < (size_t)(width * height); ++iPixel){
-				for (uInt64 ii = 0; ii < nRS*nDwellSamples; ++ii){
-					frameImagesL[iLineInt][iPixel] += tempV[ii][iPixel] / (nRS*nDwellSamples);
-				}
-			}
-		}
-
-		for (int iPixel = 0; iPixel < (size_t)(width * height); ++iPixel){
-			for (uInt64 iLineInt = 0; iLineInt < nLineInt; ++iLineInt){
-				frameImagesF[iFrameInt][iPixel] += frameImagesL[iLineInt][iPixel] / nLineInt;
-			}
-		}
 
+		// dump the raw pages of this frame while the next one is acquired (streamed as BigTIFF so large stacks can't overflow 32 bit offsets)
+		// the pages are read in place, so the dumps must finish before post processing moves them out of frameImagesD
 		if (!saveAverageOnly) {
-			std::string fileNameL = fileName;
-			fileNameL.insert(fileNameL.find("."), "_LinesInFrame_");
-			fileNameL.insert(fileNameL.find("."), std::to_string(iFrameInt));
-			Tif::Write(frameImagesL, (uInt32)width, (uInt32)height, fileNameL);
+			for (size_t iLineInt = 0; iLineInt < nLineInt; ++iLineInt){
+				const std::string fileNameRS = rawStackName(fileName, iFrameInt, iLineInt);
+				std::vector<uInt16> const * const pages = frameImagesD[iFrameInt].data() + iLineInt*nRS*nDwellSamples;
+				const size_t nPages = (size_t)(nRS*nDwellSamples);
+				const std::uint32_t w = (std::uint32_t)width, h = (std::uint32_t)height;
+				rawWrites.push_back(writer.submit([pages, nPages, w, h, fileNameRS]{
+					TifWriter raw(fileNameRS, true, Tif::options());
+					for (size_t iPage = 0; iPage < nPages; ++iPage) raw.append(pages[iPage], w, h);
+					raw.close();
+				}, 0));
+			}
 		}
 	}
-
-
-	// average frameimagesP into frameImagesA
-	for (int iPixel = 0; iPixel < (size_t)(width * height); ++iPixel){
-		for (uInt64 iFrameInt = 0; iFrameInt < nFrameInt; ++iFrameInt){
-			frameImagesA[iPixel] += frameImagesF[iFrameInt][iPixel] / nFrameInt;
-		}
+	for (std::future<void>& f : rawWrites) f.get();
+	rawWrites.clear();
+
+	if (streaming) {
+		// rounded mean of every sample collected for each pixel
+		RoundedMean((uInt32)samplesPerPixel)(frameSum.data(), frameImagesA.data(), frameSum.size());
+		writer.write(std::move(frameImagesA), (uInt32)width, (uInt32)height, fileName);
+		return;
 	}
 
-	std::string fileNameS = fileName;	//make a new file name for the stacked image
-	fileNameS.insert(fileNameS.find("."), "_Frames");
-
-	if (!saveAverageOnly) Tif::Write(frameImagesF, (uInt32)width, (uInt32)height, fileNameS);
-	Tif::Write(frameImagesA, (uInt32)width, (uInt32)height, fileName);
-
+	// align and integrate the pages, they are swapped out of frameImagesD one line group at a time and swapped back once integrated
+	IntegrationParams params;
+	params.width = (std::uint32_t)width;
+	params.height = (std::uint32_t)height;
+	params.nFrames = (size_t)nFrameInt;
+	params.nLines = (size_t)nLineInt;
+	params.pagesPerLine = (size_t)(nRS*nDwellSamples);
+	params.saveAverageOnly = saveAverageOnly;
+	params.correct = correctTF;
+	params.maxShift = maxShift;
+	params.profile = rowProfile;
+	params.subpixel = subpixel;
+	params.registration = registration;
+	params.spectralSum = spectralSum;
+	auto swapPages = [&](const size_t iFrameInt, const size_t iLineInt, std::vector<std::vector<uInt16> >& pages) {
+		std::vector<std::vector<uInt16> >::iterator it = frameImagesD[iFrameInt].begin() + iLineInt * pages.size();
+		std::swap_ranges(it, it + pages.size(), pages.begin());
+	};
+	integrateImage(params, swapPages, writer, fileName, swapPages);
 }
 
 #endif
\ No newline at end of file
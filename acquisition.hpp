@@ -0,0 +1,530 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                                 *
+ * Copyright (c) 2017, Reagents of the University of California                    *
+ * All rights reserved.                                                            *
+ *                                                                                 *
+ * Redistribution and use in source and binary forms, with or without              *
+ * modification, are permitted provided that the following conditions are met:     *
+ *                                                                                 *
+ * 1. Redistributions of source code must retain the above copyright notice, this  *
+ *    list of conditions and the following disclaimer.                             *
+ *                                                                                 *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,    *
+ *    this list of conditions and the following disclaimer in the documentation    *
+ *    and/or other materials provided with the distribution.                       *
+ *                                                                                 *
+ * 3. Neither the name of the copyright holder nor the names of its                *
+ *    contributors may be used to endorse or promote products derived from         *
+ *    this software without specific prior written permission.                     *
+ *                                                                                 *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"     *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE  *
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE    *
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL      *
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR      *
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER      *
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,   *
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE   *
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.            *
+ *                                                                                 *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef _acquisition_h_
+#define _acquisition_h_
+
+#include <string>
+#include <vector>
+#include <cmath>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <atomic>
+
+#include "NIDAQmx.h"//only needed for types when built without NI-DAQmx (EXTERNAL_SCAN_NO_DAQMX)
+#include "waveform.hpp"
+
+//@brief: parameters shared by all acquisition devices for a single scan
+struct AcquisitionConfig {
+	float64 vOutput;        //output (scan) channels are configured for -vOutput -> +vOutput
+	float64 vBlack, vWhite; //input (etd) voltage range
+	uInt64 dwellSamples;    //input samples per output sample
+	uInt64 scanPoints;      //output samples per channel
+	uInt64 rowSamples;      //input samples per row (the row callback is raised every rowSamples)
+	uInt64 bufferSamples;   //size of the input buffer in samples
+};
+
+//@brief: abstract interface to the hardware that drives the scan coils and samples the detector
+class AcquisitionDevice {
+public:
+	typedef int32 (*RowCallback)(void* callbackData);
+
+	virtual ~AcquisitionDevice() {}
+
+	//@brief: get the input sample rate used for scans
+	//@return: samples per second
+	virtual float64 sampleRate() const = 0;
+
+	//@brief: configure input/output and write (the start of) the scan pattern to buffer
+	//@param config: scan parameters
+	//@param waveform: scan pattern (config.scanPoints points), must remain valid until the device is cleared
+	//@param callback: function to call every config.rowSamples acquired input samples
+	//@param callbackData: argument to pass to callback
+	virtual void configure(const AcquisitionConfig& config, const ScanWaveform& waveform, RowCallback callback, void* callbackData) = 0;
+
+	//@brief: start output and input (input begins sampling with the first output point)
+	//@note: start may be called again after stop to repeat the configured scan without reconfiguring
+	virtual void start() = 0;
+
+	//@brief: block until the entire scan pattern has been output
+	virtual void waitUntilDone() = 0;
+
+	//@brief: stop output and input
+	virtual void stop() = 0;
+
+	//@brief: stop and release configured resources
+	virtual void clear() = 0;
+
+	//@brief: read raw samples from the input buffer (blocks until count samples are available)
+	//@param data: location to write samples
+	//@param count: number of samples to read
+	//@return: number of samples read (fewer than count if the scan ended first) or a negative error code
+	//@note: read is called from the row callback so errors are returned instead of thrown
+	virtual int32 read(int16* data, const uInt32 count) = 0;
+};
+
+#ifndef EXTERNAL_SCAN_NO_DAQMX
+//@brief: acquisition with an NI-DAQmx device (tested with NI USB-6251)
+class DAQmxDevice : public AcquisitionDevice {
+private:
+	std::string xPath, yPath;  //path to analog output channels for scan control
+	std::string etdPath;       //path to analog input channel for etd
+	TaskHandle hInput, hOutput;//handles to input and output tasks
+	RowCallback callback;      //function to call when a row has been acquired
+	void* callbackData;        //argument for callback
+
+	ScanWaveform const * waveform;//scan pattern
+	DacScaling xScale, yScale;    //voltage -> raw code conversion for output channels
+	std::vector<int16> codes;     //working buffer for a chunk of raw x codes followed by y codes
+	uInt64 scanPoints;            //points per channel in scan
+	uInt64 pointsWritten;         //points per channel written to the output buffer since the task was started
+	bool regenerate;              //true if the entire scan is held in the output buffer, false if it is streamed in chunks
+	std::atomic<int32> outputError;//error raised while streaming the scan
+
+	static const uInt64 OutputChunk = 65536;     //points per channel written at once when streaming the scan
+	static const uInt64 OutputBufferChunks = 4;  //size of the output buffer in chunks when streaming (scans that fit are written once)
+
+	static int32 CVICALLBACK EveryNCallback(TaskHandle taskHandle, int32 everyNsamplesEventType, uInt32 nSamples, void *data) {
+		DAQmxDevice* device = reinterpret_cast<DAQmxDevice*>(data);
+		return device->callback(device->callbackData);
+	}
+
+	//@brief: refill the output buffer each time a chunk has been transferred to the device
+	static int32 CVICALLBACK OutputCallback(TaskHandle taskHandle, int32 everyNsamplesEventType, uInt32 nSamples, void *data) {
+		DAQmxDevice* device = reinterpret_cast<DAQmxDevice*>(data);
+		if (0 == device->outputError) device->outputError = device->writeAhead(device->pointsWritten + OutputChunk);
+		return 0;
+	}
+
+	//@brief: get the conversion from volts to raw codes for an output channel
+	//@param channel: name of channel
+	//@return: scaling
+	DacScaling scaling(const std::string& channel);
+
+	//@brief: write raw codes for the next chunks of the scan to the output buffer
+	//@param limit: write until this many points (or the entire scan) have been written
+	//@return: DAQmx error code (0 on success)
+	int32 writeAhead(uInt64 limit);
+
+	//@brief: check a DAQmx return code and convert to an exception if needed
+	//@param error: return code to check
+	//@param message (optional): description of action being attempted to include in exception
+	void DAQmxTry(int32 error, std::string message = std::string());
+
+public:
+	DAQmxDevice(std::string x, std::string y, std::string e) : xPath(x), yPath(y), etdPath(e), hInput(NULL), hOutput(NULL), callback(NULL), callbackData(NULL), waveform(NULL), scanPoints(0), pointsWritten(0), regenerate(true), outputError(0) {}
+	~DAQmxDevice() {clear();}
+
+	float64 sampleRate() const {return 1000000;}// Note: sometimes reduce the sample rate can affect the error "writing scan to buffer".
+	void configure(const AcquisitionConfig& config, const ScanWaveform& scan, RowCallback cb, void* cbData);
+	void start();
+	void waitUntilDone();
+	void stop();
+	void clear();
+	int32 read(int16* data, const uInt32 count);
+};
+
+const uInt64 DAQmxDevice::OutputChunk;
+const uInt64 DAQmxDevice::OutputBufferChunks;
+
+void DAQmxDevice::DAQmxTry(int32 error, std::string message) {
+	//if (!message.empty())	std::cout << message << std::endl; // for debug, can add a display of the 'message'
+
+	if (0 != error) {
+		//get error message
+		int32 buffSize = DAQmxGetExtendedErrorInfo(NULL, 0);
+		if (buffSize < 0) buffSize = 8192;//sometimes the above returns an error code itself
+		std::vector<char> buff(buffSize, 0);
+		DAQmxGetExtendedErrorInfo(buff.data(), (uInt32)buff.size());
+
+		//stop and clear tasks and throw
+		clear();
+		if (message.empty())
+			throw std::runtime_error("NI-DAQmx error " + std::to_string(error) + ":\n" + std::string(buff.data()));
+		else
+			throw std::runtime_error("NI-DAQmx error " + message + " " + std::to_string(error) + ":\n" + std::string(buff.data()));
+	}
+}
+
+DacScaling DAQmxDevice::scaling(const std::string& channel) {
+	const int32 count = DAQmxGetAODevScalingCoeff(hOutput, channel.c_str(), NULL, 0);//returns required size
+	if (count < 0) DAQmxTry(count, "getting DAC scaling for " + channel);
+	if (0 == count) throw std::runtime_error("no DAC scaling coefficients for " + channel);
+	std::vector<float64> coeffs((size_t)count);
+	DAQmxTry(DAQmxGetAODevScalingCoeff(hOutput, channel.c_str(), coeffs.data(), (uInt32)count), "getting DAC scaling for " + channel);
+	return DacScaling(coeffs);
+}
+
+int32 DAQmxDevice::writeAhead(uInt64 limit) {
+	limit = std::min(limit, scanPoints);
+	while (pointsWritten < limit) {
+		const uInt64 count = std::min(OutputChunk, limit - pointsWritten);
+		waveform->fill(pointsWritten, count, codes.data(), codes.data() + count, xScale, yScale);
+		int32 written = 0;
+		const int32 error = DAQmxWriteBinaryI16(hOutput, (int32)count, FALSE, 10.0, DAQmx_Val_GroupByChannel, codes.data(), &written, NULL);
+		if (0 != error) return error;
+		pointsWritten += written;
+	}
+	return 0;
+}
+
+void DAQmxDevice::configure(const AcquisitionConfig& config, const ScanWaveform& scan, RowCallback cb, void* cbData) {
+	//create tasks and channels
+	clear();//clear existing scan if needed
+	callback = cb;
+	callbackData = cbData;
+	waveform = &scan;
+	scanPoints = config.scanPoints;
+	DAQmxTry(DAQmxCreateTask("scan generation", &hOutput), "creating output task");
+	DAQmxTry(DAQmxCreateTask("etd reading", &hInput), "creating input task");
+	DAQmxTry(DAQmxCreateAOVoltageChan(hOutput, (xPath + "," + yPath).c_str(), "", -config.vOutput, config.vOutput, DAQmx_Val_Volts, NULL), "creating output channel");
+	DAQmxTry(DAQmxCreateAIVoltageChan(hInput, etdPath.c_str(), "", DAQmx_Val_Cfg_Default, config.vBlack, config.vWhite, DAQmx_Val_Volts, NULL), "creating input channel");
+
+	//make sure the device can sample at the requested rate
+	float64 maxRate;
+	DAQmxTry(DAQmxGetSampClkMaxRate(hInput, &maxRate), "getting device maximum input frequency");
+	if (sampleRate() > maxRate) throw std::runtime_error("sample rate " + std::to_string(sampleRate()) + " exceeds device maximum " + std::to_string(maxRate));
+
+	//configure timing
+	DAQmxTry(DAQmxCfgSampClkTiming(hOutput, "", sampleRate() / config.dwellSamples, DAQmx_Val_Rising, DAQmx_Val_FiniteSamps, config.scanPoints), "configuring output timing");
+
+	//configure device buffer / data transfer
+	DAQmxTry(DAQmxSetBufInputBufSize(hInput, (uInt32)config.bufferSamples), "set buffer size");
+	DAQmxTry(DAQmxCfgSampClkTiming(hInput, "", sampleRate(), DAQmx_Val_Rising, DAQmx_Val_ContSamps, config.bufferSamples), "configuring input timing");
+	DAQmxRegisterEveryNSamplesEvent(hInput, DAQmx_Val_Acquired_Into_Buffer, (uInt32)config.rowSamples, 0, DAQmxDevice::EveryNCallback, reinterpret_cast<void*>(this));
+
+	//configure start triggering
+	std::string trigName = "/" + xPath.substr(0, xPath.find('/')) + "/ai/StartTrigger";//use output trigger to start input
+	DAQmxTry(DAQmxCfgDigEdgeStartTrig(hOutput, trigName.c_str(), DAQmx_Val_Rising), "setting start trigger");
+
+	//scan is written as raw DAC codes (a quarter of the host memory and bus traffic of float64 voltages)
+	xScale = scaling(xPath);
+	yScale = scaling(yPath);
+	codes.resize(2 * (size_t)std::min(OutputChunk, scanPoints));
+
+	//small scans are written once with regeneration allowed so each restart of the task replays the scan without rewriting it
+	//larger scans are streamed through a small output buffer, refilled from the waveform every time a chunk is transferred
+	regenerate = scanPoints <= OutputChunk * OutputBufferChunks;
+	pointsWritten = 0;
+	outputError = 0;
+	if (regenerate) {
+		DAQmxTry(DAQmxSetWriteRegenMode(hOutput, DAQmx_Val_AllowRegen), "allowing regeneration");
+		DAQmxTry(writeAhead(scanPoints), "writing scan to buffer");
+	} else {
+		DAQmxTry(DAQmxSetWriteRegenMode(hOutput, DAQmx_Val_DoNotAllowRegen), "disallowing regeneration");
+		DAQmxTry(DAQmxCfgOutputBuffer(hOutput, (uInt32)(OutputChunk * OutputBufferChunks)), "setting output buffer size");
+		DAQmxTry(DAQmxRegisterEveryNSamplesEvent(hOutput, DAQmx_Val_Transferred_From_Buffer, (uInt32)OutputChunk, 0, DAQmxDevice::OutputCallback, reinterpret_cast<void*>(this)), "registering output callback");
+	}
+
+	//commit tasks so that resources stay reserved between frames (stopping a committed task returns it to the committed state)
+	DAQmxTry(DAQmxTaskControl(hOutput, DAQmx_Val_Task_Commit), "committing output task");
+	DAQmxTry(DAQmxTaskControl(hInput, DAQmx_Val_Task_Commit), "committing input task");
+}
+
+void DAQmxDevice::start() {
+	if (!regenerate) {
+		//fill the output buffer with the start of the scan (the rest is written from OutputCallback)
+		pointsWritten = 0;
+		outputError = 0;
+		DAQmxTry(writeAhead(OutputChunk * OutputBufferChunks), "writing scan to buffer");
+	}
+	DAQmxTry(DAQmxStartTask(hOutput), "starting output task");
+	DAQmxTry(DAQmxStartTask(hInput), "starting input task");
+}
+
+void DAQmxDevice::waitUntilDone() {
+	//DAQmxTry(DAQmxWaitUntilTaskDone(hOutput, scanTime), "waiting for output task");
+	DAQmxWaitUntilTaskDone(hOutput, DAQmx_Val_WaitInfinitely);	// just wait.  dUsing DAQmxTry is not good, maybe returns too early.
+	DAQmxTry(outputError, "streaming scan to buffer");
+}
+
+void DAQmxDevice::stop() {
+	DAQmxTry(DAQmxStopTask(hInput), "stopping input task");
+	DAQmxTry(DAQmxStopTask(hOutput), "stopping output task");
+}
+
+void DAQmxDevice::clear() {
+	if (NULL != hInput) {
+		DAQmxStopTask(hInput);
+		DAQmxClearTask(hInput);
+		hInput = NULL;
+	}
+	if (NULL != hOutput) {
+		DAQmxStopTask(hOutput);
+		DAQmxClearTask(hOutput);
+		hOutput = NULL;
+	}
+}
+
+int32 DAQmxDevice::read(int16* data, const uInt32 count) {
+	int32 read = 0;
+	const int32 error = DAQmxReadBinaryI16(hInput, (int32)count, DAQmx_Val_WaitInfinitely, DAQmx_Val_GroupByChannel, data, count, &read, NULL);
+	return error < 0 ? error : read;//positive codes are warnings
+}
+#endif//EXTERNAL_SCAN_NO_DAQMX
+
+//@brief: parameters for a simulated acquisition
+struct SimulationParameters {
+	float64 sampleRate; //input sample rate in Hz
+	float64 coilLag;    //time constant of the (first order) scan coil response in us
+	float64 driftX;     //horizontal beam drift in V/s
+	float64 driftY;     //vertical beam drift in V/s
+	float64 noise;      //standard deviation of detector noise in counts
+	bool realTime;      //pace sample generation to sampleRate and fail on input buffer overflow like the hardware (otherwise generate as fast as samples are read)
+
+	SimulationParameters() : sampleRate(1000000), coilLag(2.0), driftX(0), driftY(0), noise(64), realTime(false) {}
+};
+
+//@brief: acquisition device that synthesizes etd samples by following the scan pattern over a reference image
+class SimulatedDevice : public AcquisitionDevice {
+private:
+	std::vector<uInt16> reference;      //reference image
+	uInt64 refWidth, refHeight;         //dimensions of reference image (the reference spans the full output voltage range)
+	SimulationParameters params;        //simulation parameters
+	AcquisitionConfig config;           //current scan parameters
+	ScanWaveform const * scan;          //current scan pattern
+	RowCallback callback;               //function to call when a row has been acquired
+	void* callbackData;                 //argument for callback
+
+	std::vector<int16> buffer;          //circular input buffer
+	uInt64 acquired, consumed, notified;//number of samples written to buffer / read from buffer / covered by callbacks
+	bool generating, running;           //true while the scan is being output / the device is started
+	std::string error;                  //error raised by generation thread (or the row callback)
+	std::mutex mut;
+	std::condition_variable cv;
+	std::thread generator, events;
+
+	//@brief: synthesize samples for the entire scan and write them to the input buffer
+	void generate();
+
+	//@brief: raise the row callback every time a row of samples is available
+	void raiseEvents();
+
+	//@brief: sample the reference image with bilinear interpolation
+	//@param x: horizontal position in volts
+	//@param y: vertical position in volts
+	//@return: detector signal in counts
+	float64 sample(float64 x, float64 y) const;
+
+public:
+	SimulatedDevice(std::vector<uInt16> ref, const uInt64 w, const uInt64 h, SimulationParameters p = SimulationParameters()) : reference(ref), refWidth(w), refHeight(h), params(p), scan(NULL), callback(NULL), callbackData(NULL), acquired(0), consumed(0), notified(0), generating(false), running(false) {
+		if (reference.size() != w * h) throw std::runtime_error("reference image size doesn't match dimensions");
+	}
+	~SimulatedDevice() {clear();}
+
+	//@brief: build a speckle like reference image (smoothed random noise)
+	//@param w: width of image
+	//@param h: height of image
+	//@param speckle: approximate speckle size in pixels
+	//@return: reference image
+	static std::vector<uInt16> SyntheticReference(const uInt64 w, const uInt64 h, const uInt64 speckle = 4);
+
+	float64 sampleRate() const {return params.sampleRate;}
+	void configure(const AcquisitionConfig& c, const ScanWaveform& s, RowCallback cb, void* cbData);
+	void start();
+	void waitUntilDone();
+	void stop();
+	void clear();
+	int32 read(int16* data, const uInt32 count);
+};
+
+std::vector<uInt16> SimulatedDevice::SyntheticReference(const uInt64 w, const uInt64 h, const uInt64 speckle) {
+	//random values on a coarse grid
+	const uInt64 cw = w / speckle + 2, ch = h / speckle + 2;
+	std::mt19937 gen(0);
+	std::uniform_real_distribution<float64> dist(0.0, 1.0);
+	std::vector<float64> coarse((size_t)(cw * ch));
+	for (float64& v : coarse) v = dist(gen);
+
+	//bilinear upsampling gives smooth speckles
+	std::vector<uInt16> image((size_t)(w * h));
+	for (uInt64 j = 0; j < h; j++) {
+		const float64 y = float64(j) / speckle;
+		const uInt64 y0 = (uInt64)y;
+		const float64 fy = y - y0;
+		for (uInt64 i = 0; i < w; i++) {
+			const float64 x = float64(i) / speckle;
+			const uInt64 x0 = (uInt64)x;
+			const float64 fx = x - x0;
+			const float64 v = (coarse[(size_t)(y0 * cw + x0)] * (1.0 - fx) + coarse[(size_t)(y0 * cw + x0 + 1)] * fx) * (1.0 - fy)
+			                + (coarse[(size_t)((y0 + 1) * cw + x0)] * (1.0 - fx) + coarse[(size_t)((y0 + 1) * cw + x0 + 1)] * fx) * fy;
+			image[(size_t)(j * w + i)] = (uInt16)(8192 + v * 49152);
+		}
+	}
+	return image;
+}
+
+float64 SimulatedDevice::sample(float64 x, float64 y) const {
+	//convert from volts to fractional pixels, clamping to the reference
+	x = (x + config.vOutput) / (2.0 * config.vOutput) * (refWidth - 1);
+	y = (y + config.vOutput) / (2.0 * config.vOutput) * (refHeight - 1);
+	x = std::max(0.0, std::min(float64(refWidth - 1), x));
+	y = std::max(0.0, std::min(float64(refHeight - 1), y));
+	const uInt64 x0 = std::min((uInt64)x, refWidth - 2), y0 = std::min((uInt64)y, refHeight - 2);
+	const float64 fx = x - x0, fy = y - y0;
+	uInt16 const * const p = reference.data() + (size_t)(y0 * refWidth + x0);
+	return (p[0] * (1.0 - fx) + p[1] * fx) * (1.0 - fy) + (p[refWidth] * (1.0 - fx) + p[refWidth + 1] * fx) * fy;
+}
+
+void SimulatedDevice::configure(const AcquisitionConfig& c, const ScanWaveform& s, RowCallback cb, void* cbData) {
+	clear();
+	if (refWidth < 2 || refHeight < 2) throw std::runtime_error("reference image must be at least 2x2");
+	if (s.points() != c.scanPoints) throw std::runtime_error("scan waveform length doesn't match configuration");
+	config = c;
+	scan = &s;
+	callback = cb;
+	callbackData = cbData;
+	buffer.assign((size_t)config.bufferSamples, 0);
+}
+
+void SimulatedDevice::generate() {
+	std::mt19937 gen(1);
+	std::normal_distribution<float64> noise(0.0, params.noise > 0 ? params.noise : 1.0);
+	const float64 response = 1.0 - std::exp(-1.0 / (params.sampleRate * params.coilLag * 1e-6));//fraction of the remaining distance covered by the coils each sample
+	const uInt64 chunk = std::max<uInt64>(1, std::min(config.rowSamples, config.bufferSamples / 2));//samples to generate between buffer updates
+	std::vector<int16> samples((size_t)chunk);
+	const std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+
+	float64 x = scan->x(0), y = scan->y(0);//coils start at the first point
+	const uInt64 total = config.scanPoints * config.dwellSamples;
+	for (uInt64 iSample = 0; iSample < total; ) {
+		//synthesize a chunk of samples
+		const uInt64 count = std::min(chunk, total - iSample);
+		for (uInt64 i = 0; i < count; i++) {
+			const uInt64 iPoint = (iSample + i) / config.dwellSamples;
+			const float64 t = float64(iSample + i) / params.sampleRate;
+			x += (scan->x(iPoint) - x) * response;
+			y += (scan->y(iPoint) - y) * response;
+			float64 v = sample(x + params.driftX * t, y + params.driftY * t);
+			if (params.noise > 0) v += noise(gen);
+			samples[(size_t)i] = (int16)(std::max(0.0, std::min(65535.0, std::round(v))) - 32768);//raw binary codes are offset from pixel values
+		}
+
+		if (params.realTime) std::this_thread::sleep_until(t0 + std::chrono::duration<float64>(float64(iSample + count) / params.sampleRate));
+
+		//copy to the input buffer
+		std::unique_lock<std::mutex> lock(mut);
+		if (params.realTime) {
+			if (acquired + count - consumed > config.bufferSamples) {
+				error = "simulated DAQ error -200279: input buffer overflow (samples were not read fast enough)";
+				generating = false;
+				cv.notify_all();
+				return;
+			}
+		} else {
+			cv.wait(lock, [&]{return !running || acquired + count - consumed <= config.bufferSamples;});
+		}
+		if (!running) break;
+		for (uInt64 i = 0; i < count; i++) buffer[(size_t)((acquired + i) % config.bufferSamples)] = samples[(size_t)i];
+		acquired += count;
+		iSample += count;
+		cv.notify_all();
+	}
+	std::lock_guard<std::mutex> lock(mut);
+	generating = false;
+	cv.notify_all();
+}
+
+void SimulatedDevice::raiseEvents() {
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(mut);
+			cv.wait(lock, [&]{return !running || !error.empty() || acquired >= notified + config.rowSamples || (!generating && acquired < notified + config.rowSamples);});
+			if (!running || !error.empty() || acquired < notified + config.rowSamples) {
+				notified = acquired;//no more complete rows
+				cv.notify_all();
+				return;
+			}
+			notified += config.rowSamples;
+		}
+		try {
+			callback(callbackData);
+		} catch (std::exception& e) {//exceptions can't leave this thread, hand them to waitUntilDone
+			std::lock_guard<std::mutex> lock(mut);
+			if (error.empty()) error = std::string("row callback failed: ") + e.what();
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(mut);
+			if (error.empty()) error = "row callback failed";
+		}
+		cv.notify_all();
+	}
+}
+
+void SimulatedDevice::start() {
+	stop();
+	acquired = consumed = notified = 0;
+	error.clear();
+	generating = running = true;
+	generator = std::thread(&SimulatedDevice::generate, this);
+	events = std::thread(&SimulatedDevice::raiseEvents, this);
+}
+
+void SimulatedDevice::waitUntilDone() {
+	//the output is done once every sample has been generated and the corresponding callbacks have returned
+	if (events.joinable()) events.join();
+	std::lock_guard<std::mutex> lock(mut);
+	if (!error.empty()) throw std::runtime_error(error);
+}
+
+void SimulatedDevice::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mut);
+		running = false;
+		cv.notify_all();
+	}
+	if (events.joinable()) events.join();
+	if (generator.joinable()) generator.join();
+}
+
+void SimulatedDevice::clear() {
+	stop();
+	scan = NULL;
+	buffer.clear();
+}
+
+int32 SimulatedDevice::read(int16* data, const uInt32 count) {
+	std::unique_lock<std::mutex> lock(mut);
+	cv.wait(lock, [&]{return !running || !error.empty() || acquired - consumed >= count || (!generating && acquired - consumed < count);});
+	if (!error.empty()) return -1;//the message is reported by waitUntilDone
+	const uInt64 available = std::min<uInt64>(count, acquired - consumed);
+	for (uInt64 i = 0; i < available; i++) data[i] = buffer[(size_t)((consumed + i) % config.bufferSamples)];
+	consumed += available;
+	cv.notify_all();
+	return (int32)available;
+}
+
+#endif//_acquisition_h_
@@ -1,3 +1,6 @@
+#ifndef _alignment_h_
+#define _alignment_h_
+
 #include <complex>
 #include <cmath>
 #include <cstdint>
@@ -10,89 +13,684 @@
 #include <limits>
 #include <thread>
 #include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <string>
+#include <cctype>
 
 #include <fftw3.h>
 
+#include "threadpool.hpp"
+#include "simd.hpp"
+
+//@brief: planner options shared by all precisions
+struct FFTWPlanner {
+	//@brief: get the lock that must be held for every call into fftw other than plan execution and allocation (the planner isn't thread safe)
+	static std::mutex& mutex() {
+		static std::mutex mut;
+		return mut;
+	}
+
+	//@brief: planning effort used for new plans (FFTW_ESTIMATE, FFTW_MEASURE, FFTW_PATIENT, or FFTW_EXHAUSTIVE)
+	static unsigned int& effort() {
+		static unsigned int flag = FFTW_MEASURE;
+		return flag;
+	}
+
+	//@brief: convert a planning effort name to flag
+	//@param name: estimate, measure, patient, or exhaustive (case insensitive)
+	//@return: planner flag
+	static unsigned int parseEffort(std::string name) {
+		std::transform(name.begin(), name.end(), name.begin(), [](char c){return (char)std::tolower(c);});
+		if("estimate"   == name) return FFTW_ESTIMATE;
+		if("measure"    == name) return FFTW_MEASURE;
+		if("patient"    == name) return FFTW_PATIENT;
+		if("exhaustive" == name) return FFTW_EXHAUSTIVE;
+		throw std::runtime_error("unknown fft planning effort '" + name + "' (must be estimate, measure, patient, or exhaustive)");
+	}
+};
+
+template <typename Real> struct FFTW;
+
+//@brief: persistence of fftw wisdom (accumulated plan timings) for a single precision
+//@note: when a file is set it is imported before the first plan is created and rewritten after every new plan so later runs can skip measuring
+//       load and save must be called with FFTWPlanner::mutex() held
+template <typename Real>
+struct FFTWWisdom {
+	//@brief: get the wisdom file (empty to disable persistence)
+	static std::string& file() {
+		static std::string path;
+		return path;
+	}
+
+	//@brief: import wisdom from file() if it hasn't been imported yet (missing files are ignored)
+	static void load() {
+		static std::string loaded;
+		if(file().empty() || loaded == file()) return;
+		std::ifstream is(file());
+		if(is.good()) {
+			is.close();
+			if(!FFTW<Real>::importWisdom(file())) std::cout << "warning: couldn't import fft wisdom from " << file() << '\n';
+		}
+		loaded = file();
+	}
+
+	//@brief: write all accumulated wisdom to file()
+	static void save() {
+		if(file().empty()) return;
+		if(!FFTW<Real>::exportWisdom(file())) std::cout << "warning: couldn't export fft wisdom to " << file() << '\n';
+	}
+};
+
+//@brief: get the distance (in complex elements) between rows of the batched row ffts used for alignment
+inline int alignmentFftDist(const int cols) {return (cols + 2) / 1;}//odd size offsets can cause fftw to crash or prevent use of SIMD instructions
+
 //helper class to wrap fft in template
+//each plan transforms count rows of n real values at once (rows are contiguous, row i of the fft starts at i * fftDist)
+//the rank/dims constructor transforms count row major arrays of dims[0] x ... x dims[rank-1] values instead (e.g. whole images)
+//all arrays passed to forward/inverse must come from fftw's allocator (FFTWBuffer) since plans may use SIMD instructions that require alignment
+//plans are created and destroyed under FFTWPlanner::mutex(), forward/inverse may be called from any number of threads at once
 template <typename Real>
 struct FFTW {static_assert(std::is_same<Real, float>::value || std::is_same<Real, double>::value || std::is_same<Real, long double>::value, "Real must be float, double, or long double");};
 
 template<>
 struct FFTW<float> {
 	fftwf_plan pFor, pInv;
-	FFTW(const int n, const unsigned int flag = FFTW_MEASURE) {//can use FFTW_ESTIMATE for small numbers of ffts
-		std::vector<float> testSig(n);
-		std::vector<fftwf_complex> testFft(n);
-		pFor = fftwf_plan_dft_r2c_1d(n, testSig.data(), testFft.data(), flag);
-		pInv = fftwf_plan_dft_c2r_1d(n, testFft.data(), testSig.data(), flag);
+	FFTW(const int n, const int count = 1, const int fftDist = 0, const unsigned int flag = FFTWPlanner::effort()) : FFTW(1, &n, count, fftDist, flag) {}//can use FFTW_ESTIMATE for small numbers of ffts
+	FFTW(const int rank, int const * const dims, const int count, const int fftDist, const unsigned int flag) {
+		std::lock_guard<std::mutex> lock(FFTWPlanner::mutex());
+		FFTWWisdom<float>::load();
+		const int n = std::accumulate(dims, dims + rank, 1, std::multiplies<int>());
+		const int dist = fftDist > 0 ? fftDist : n / dims[rank - 1] * (dims[rank - 1] / 2 + 1);
+		float* testSig = (float*)fftwf_malloc(sizeof(float) * n * count);
+		fftwf_complex* testFft = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * dist * count);
+		pFor = fftwf_plan_many_dft_r2c(rank, dims, count, testSig, NULL, 1, n, testFft, NULL, 1, dist, flag);
+		pInv = fftwf_plan_many_dft_c2r(rank, dims, count, testFft, NULL, 1, dist, testSig, NULL, 1, n, flag);
+		fftwf_free(testSig);
+		fftwf_free(testFft);
+		if(NULL == pFor || NULL == pInv) throw std::runtime_error("failed to create fft plans");
+		FFTWWisdom<float>::save();
 	}
+	FFTW(const FFTW&) = delete;
+	FFTW& operator=(const FFTW&) = delete;
 	~FFTW() {
+		std::lock_guard<std::mutex> lock(FFTWPlanner::mutex());
 		fftwf_destroy_plan(pFor);
 		fftwf_destroy_plan(pInv);
 	}
 	void forward(float* data, std::complex<float>* fft) const {fftwf_execute_dft_r2c(pFor, data               , (fftwf_complex*)fft);}
-	void inverse(float* data, std::complex<float>* fft) const {fftwf_execute_dft_c2r(pInv, (fftwf_complex*)fft, data               );}
+	void inverse(float* data, std::complex<float>* fft) const {fftwf_execute_dft_c2r(pInv, (fftwf_complex*)fft, data               );}//destroys fft
+	static void* allocate(const size_t bytes) {return fftwf_malloc(bytes);}
+	static void release(void* p) {fftwf_free(p);}
+	static bool importWisdom(const std::string& file) {return 0 != fftwf_import_wisdom_from_filename(file.c_str());}
+	static bool exportWisdom(const std::string& file) {return 0 != fftwf_export_wisdom_to_filename(file.c_str());}
 };
 
 template<>
 struct FFTW<double> {
 	fftw_plan pFor, pInv;
-	FFTW(const int n, const unsigned int flag = FFTW_MEASURE) {
-		std::vector<double> testSig(n);
-		std::vector<fftw_complex> testFFt(n);
-		pFor = fftw_plan_dft_r2c_1d(n, testSig.data(), testFFt.data(), flag);
-		pInv = fftw_plan_dft_c2r_1d(n, testFFt.data(), testSig.data(), flag);
+	FFTW(const int n, const int count = 1, const int fftDist = 0, const unsigned int flag = FFTWPlanner::effort()) : FFTW(1, &n, count, fftDist, flag) {}
+	FFTW(const int rank, int const * const dims, const int count, const int fftDist, const unsigned int flag) {
+		std::lock_guard<std::mutex> lock(FFTWPlanner::mutex());
+		FFTWWisdom<double>::load();
+		const int n = std::accumulate(dims, dims + rank, 1, std::multiplies<int>());
+		const int dist = fftDist > 0 ? fftDist : n / dims[rank - 1] * (dims[rank - 1] / 2 + 1);
+		double* testSig = (double*)fftw_malloc(sizeof(double) * n * count);
+		fftw_complex* testFft = (fftw_complex*)fftw_malloc(sizeof(fftw_complex) * dist * count);
+		pFor = fftw_plan_many_dft_r2c(rank, dims, count, testSig, NULL, 1, n, testFft, NULL, 1, dist, flag);
+		pInv = fftw_plan_many_dft_c2r(rank, dims, count, testFft, NULL, 1, dist, testSig, NULL, 1, n, flag);
+		fftw_free(testSig);
+		fftw_free(testFft);
+		if(NULL == pFor || NULL == pInv) throw std::runtime_error("failed to create fft plans");
+		FFTWWisdom<double>::save();
 	}
+	FFTW(const FFTW&) = delete;
+	FFTW& operator=(const FFTW&) = delete;
 	~FFTW() {
+		std::lock_guard<std::mutex> lock(FFTWPlanner::mutex());
 		fftw_destroy_plan(pFor);
 		fftw_destroy_plan(pInv);
 	}
 	void forward(double* data, std::complex<double>* fft) const {fftw_execute_dft_r2c(pFor, data              , (fftw_complex*)fft);}
-	void inverse(double* data, std::complex<double>* fft) const {fftw_execute_dft_c2r(pInv, (fftw_complex*)fft, data              );}
+	void inverse(double* data, std::complex<double>* fft) const {fftw_execute_dft_c2r(pInv, (fftw_complex*)fft, data              );}//destroys fft
+	static void* allocate(const size_t bytes) {return fftw_malloc(bytes);}
+	static void release(void* p) {fftw_free(p);}
+	static bool importWisdom(const std::string& file) {return 0 != fftw_import_wisdom_from_filename(file.c_str());}
+	static bool exportWisdom(const std::string& file) {return 0 != fftw_export_wisdom_to_filename(file.c_str());}
 };
 
 template<>
 struct FFTW<long double> {
 	fftwl_plan pFor, pInv;
-	FFTW(const int n, const unsigned int flag = FFTW_MEASURE) {
-		std::vector<long double> testSig(n);
-		std::vector<fftwl_complex> testFft(n);
-		pFor = fftwl_plan_dft_r2c_1d(n, testSig.data(), testFft.data(), flag);
-		pInv = fftwl_plan_dft_c2r_1d(n, testFft.data(), testSig.data(), flag);
+	FFTW(const int n, const int count = 1, const int fftDist = 0, const unsigned int flag = FFTWPlanner::effort()) : FFTW(1, &n, count, fftDist, flag) {}
+	FFTW(const int rank, int const * const dims, const int count, const int fftDist, const unsigned int flag) {
+		std::lock_guard<std::mutex> lock(FFTWPlanner::mutex());
+		FFTWWisdom<long double>::load();
+		const int n = std::accumulate(dims, dims + rank, 1, std::multiplies<int>());
+		const int dist = fftDist > 0 ? fftDist : n / dims[rank - 1] * (dims[rank - 1] / 2 + 1);
+		long double* testSig = (long double*)fftwl_malloc(sizeof(long double) * n * count);
+		fftwl_complex* testFft = (fftwl_complex*)fftwl_malloc(sizeof(fftwl_complex) * dist * count);
+		pFor = fftwl_plan_many_dft_r2c(rank, dims, count, testSig, NULL, 1, n, testFft, NULL, 1, dist, flag);
+		pInv = fftwl_plan_many_dft_c2r(rank, dims, count, testFft, NULL, 1, dist, testSig, NULL, 1, n, flag);
+		fftwl_free(testSig);
+		fftwl_free(testFft);
+		if(NULL == pFor || NULL == pInv) throw std::runtime_error("failed to create fft plans");
+		FFTWWisdom<long double>::save();
 	}
+	FFTW(const FFTW&) = delete;
+	FFTW& operator=(const FFTW&) = delete;
 	~FFTW() {
+		std::lock_guard<std::mutex> lock(FFTWPlanner::mutex());
 		fftwl_destroy_plan(pFor);
 		fftwl_destroy_plan(pInv);
 	}
 	void forward(long double* data, std::complex<long double>* fft) const {fftwl_execute_dft_r2c(pFor, data               , (fftwl_complex*)fft);}
-	void inverse(long double* data, std::complex<long double>* fft) const {fftwl_execute_dft_c2r(pInv, (fftwl_complex*)fft, data               );}
+	void inverse(long double* data, std::complex<long double>* fft) const {fftwl_execute_dft_c2r(pInv, (fftwl_complex*)fft, data               );}//destroys fft
+	static void* allocate(const size_t bytes) {return fftwl_malloc(bytes);}
+	static void release(void* p) {fftwl_free(p);}
+	static bool importWisdom(const std::string& file) {return 0 != fftwl_import_wisdom_from_filename(file.c_str());}
+	static bool exportWisdom(const std::string& file) {return 0 != fftwl_export_wisdom_to_filename(file.c_str());}
 };
 
-//@brief: compute the upsampled fft value for a single subpixel
-//@param kernel: upsampling kernel for subpixel
-//@param xCorr: fft of cross correlation
-//@return: upsampled fft value
+//@brief: process wide cache of fft plans so every alignment call and thread shares a single set of plans per transform
 template <typename Real>
-inline Real upsampledValue(const std::vector< std::complex<Real> > & k, const std::vector< std::complex<Real> >& xCorr) {
-	//abs(dot(2 conjugate symmetric values)) -> all complex components cancel (center complex component doesn't but it is vanishingly small compared to real part for relevant sizes)
-	//to be fully rigourous could check for even length half cross correlations and handle)
-	return std::inner_product(xCorr.begin()+1, xCorr.end(), k.begin()+1, Real(0), std::plus<Real>(), [](const std::complex<Real>& a, const std::complex<Real>& b){
-		return a.real() * b.real() - a.imag() * b.imag();//only accumulate the real part since the imaginary part will cancel out from conjugate symmetry
-	}) * Real(2) + xCorr.front().real();//multiply by 2 to account for symmetry and add first entry (k[0] is always 1)
+class FFTWPlans {
+	typedef std::tuple<std::vector<int>, int, int, unsigned int> Key;//transform dimensions, batch count, distance between ffts, planner flags
+
+public:
+	//@brief: get plans for a batch of real ffts (see FFTW), creating them on first use
+	//@param n: transform size
+	//@param count: number of transforms per execution
+	//@param fftDist: distance between fft rows in complex elements (0 for n / 2 + 1)
+	//@param flag: planner flags
+	//@return: plans (valid until exit)
+	//@note: lookups after the first from a thread don't take a lock
+	static const FFTW<Real>& Get(const int n, const int count = 1, const int fftDist = 0, const unsigned int flag = FFTWPlanner::effort()) {
+		return Get(Key(std::vector<int>(1, n), count, fftDist > 0 ? fftDist : n / 2 + 1, flag));
+	}
+
+	//@brief: get plans for a single 2d real fft (rows x cols, row major), creating them on first use
+	//@param rows: image height
+	//@param cols: image width
+	//@param flag: planner flags
+	//@return: plans (valid until exit), the transform is rows x (cols / 2 + 1)
+	static const FFTW<Real>& Get2D(const int rows, const int cols, const unsigned int flag = FFTWPlanner::effort()) {
+		std::vector<int> dims(2);
+		dims[0] = rows;
+		dims[1] = cols;
+		return Get(Key(dims, 1, rows * (cols / 2 + 1), flag));
+	}
+
+private:
+	//@brief: get plans from this thread's index, falling back to the shared cache
+	static const FFTW<Real>& Get(const Key& key) {
+		thread_local std::map<Key, FFTW<Real> const *> local;
+		FFTW<Real> const *& plans = local[key];
+		if(NULL == plans) plans = &Shared(key);
+		return *plans;
+	}
+
+	//@brief: get plans from the shared cache, creating them if needed
+	static const FFTW<Real>& Shared(const Key& key) {
+		FFTWPlanner::mutex();//construct the planner lock first so it outlives the cached plans at exit
+		static std::mutex mut;
+		static std::map<Key, std::unique_ptr<const FFTW<Real> > > cache;
+		std::lock_guard<std::mutex> lock(mut);
+		std::unique_ptr<const FFTW<Real> >& plans = cache[key];
+		if(!plans) plans.reset(new FFTW<Real>((int)std::get<0>(key).size(), std::get<0>(key).data(), std::get<1>(key), std::get<2>(key), std::get<3>(key)));
+		return *plans;
+	}
+};
+
+//@brief: array allocated with fftw's (SIMD aligned) allocator, contents are uninitialized
+template <typename T, typename Real>
+class FFTWBuffer {
+	T* ptr;      //data
+	size_t count;//number of elements
+
+	FFTWBuffer(const FFTWBuffer&);//not copyable
+	FFTWBuffer& operator=(const FFTWBuffer&);
+
+public:
+	explicit FFTWBuffer(const size_t n = 0) : ptr(NULL), count(0) {allocate(n);}
+	~FFTWBuffer() {FFTW<Real>::release(ptr);}
+
+	//@brief: resize the buffer, memory is only reallocated if the size changes
+	//@param n: number of elements
+	void allocate(const size_t n) {
+		if(n == count) return;
+		FFTW<Real>::release(ptr);
+		ptr = NULL;
+		count = 0;
+		if(n > 0) {
+			ptr = reinterpret_cast<T*>(FFTW<Real>::allocate(sizeof(T) * n));
+			if(NULL == ptr) throw std::runtime_error("failed to allocate fft buffer");
+			count = n;
+		}
+	}
+
+	T* data() {return ptr;}
+	T const * data() const {return ptr;}
+	size_t size() const {return count;}
+	T& operator[](const size_t i) {return ptr[i];}
+	const T& operator[](const size_t i) const {return ptr[i];}
+	T* begin() {return ptr;}
+	T* end() {return ptr + count;}
+	T const * begin() const {return ptr;}
+	T const * end() const {return ptr + count;}
+};
+
+//@brief: method used to find the sub pixel shift of each row
+enum class SubpixelMethod {
+	KernelWalk,//walk the upsampled cross correlation one subpixel at a time from the previous row's shift (exact to 1/upsampleFactor, cost grows with shift change)
+	Parabolic, //integer peak of the inverse fft of the cross power spectrum refined with a parabola through the peak and its neighbors
+	Gaussian,  //integer peak refined with a gaussian (parabola through log values) through the peak and its neighbors
+	LocalDft   //integer peak refined by evaluating the upsampled cross correlation over +/-0.75 pixels (Guizar-Sicairos)
+};
+
+//@brief: convert a command line index to a sub pixel method
+//@param index: 0 = kernel walk, 1 = parabolic, 2 = gaussian, 3 = local dft
+//@return: sub pixel method
+inline SubpixelMethod subpixelMethod(const size_t index) {
+	switch(index) {
+		case 0: return SubpixelMethod::KernelWalk;
+		case 1: return SubpixelMethod::Parabolic;
+		case 2: return SubpixelMethod::Gaussian;
+		case 3: return SubpixelMethod::LocalDft;
+	}
+	throw std::runtime_error("subpixel method must be 0, 1, 2, or 3");
 }
 
+//@brief: how row shifts are applied to a frame
+enum class ShiftProfile {
+	Uniform,//the mean row shift is applied to every row
+	PerRow  //a smoothed profile of the row shifts is applied (for line jitter and forward / backward offsets that vary from row to row)
+};
+
+//@brief: savitzky-golay filter (fit a polynomial to the points near each point of a profile and replace the point with the fit value)
+//@note: the fit value is a fixed weighted sum of the window, so the weights are computed once per profile length / width / order
+//       (one set shared by every interior point plus one per point near the ends) and each profile only costs a dot product per point
+class SavitzkyGolay {
+	int n, halfWidth, order;     //profile length, neighbors on each side, and polynomial order the weights were computed for
+	std::vector<double> interior;//weights of a full window (2 * halfWidth + 1)
+	std::vector<double> edge;    //weights of each truncated window near the ends (in point order)
+
+	//@brief: compute the weights that give the constant term of a least squares polynomial fit
+	//@param left: points before the fit point
+	//@param right: points after the fit point
+	//@param w: location to write weights (left + right + 1)
+	void fitWeights(const int left, const int right, double * const w) const {
+		//normal equations for a polynomial in x = j - i (so the value at i is the constant term) with the first unit vector as right hand side
+		//the constant term for values v is e0^T (A^T A)^-1 A^T v = (A c)^T v where (A^T A) c = e0 (A^T A is symmetric)
+		const int m = std::min(order, left + right) + 1;//number of coefficients (reduced near the ends if there are too few points)
+		std::vector<double> a((size_t)m * (m + 1), 0.0);
+		for(int x = -left; x <= right; x++) {
+			double pr = 1.0;
+			for(int r = 0; r < m; r++) {
+				double pc = 1.0;
+				for(int c = 0; c < m; c++) {
+					a[r * (m + 1) + c] += pr * pc;
+					pc *= x;
+				}
+				pr *= x;
+			}
+		}
+		a[m] = 1.0;
+
+		//solve with gaussian elimination (partial pivoting) and back substitution
+		for(int c = 0; c < m; c++) {
+			int piv = c;
+			for(int r = c + 1; r < m; r++) if(std::fabs(a[r * (m + 1) + c]) > std::fabs(a[piv * (m + 1) + c])) piv = r;
+			for(int k = 0; k <= m; k++) std::swap(a[c * (m + 1) + k], a[piv * (m + 1) + k]);
+			if(0.0 == a[c * (m + 1) + c]) break;//singular (can't happen for distinct x with m <= points)
+			for(int r = c + 1; r < m; r++) {
+				const double f = a[r * (m + 1) + c] / a[c * (m + 1) + c];
+				for(int k = c; k <= m; k++) a[r * (m + 1) + k] -= f * a[c * (m + 1) + k];
+			}
+		}
+		std::vector<double> coef(m, 0.0);
+		for(int r = m - 1; r >= 0; r--) {
+			double sum = a[r * (m + 1) + m];
+			for(int k = r + 1; k < m; k++) sum -= a[r * (m + 1) + k] * coef[k];
+			coef[r] = 0.0 == a[r * (m + 1) + r] ? 0.0 : sum / a[r * (m + 1) + r];
+		}
+
+		//weight of each point is the polynomial with coefficients c evaluated at its offset
+		for(int x = -left; x <= right; x++) {
+			double sum = 0.0;
+			for(int k = m - 1; k >= 0; k--) sum = sum * x + coef[k];
+			w[x + left] = sum;
+		}
+	}
+
+public:
+	SavitzkyGolay() : n(-1), halfWidth(-1), order(-1) {}
+
+	//@brief: compute weights (only if a parameter changed)
+	//@param count: length of the profiles that will be smoothed
+	//@param half: number of neighbors on each side used for each fit (fewer are used near the ends)
+	//@param fitOrder: order of the fit polynomial (reduced near the ends if there are too few points)
+	void assign(const int count, const int half, const int fitOrder) {
+		if(count == n && half == halfWidth && fitOrder == order) return;
+		n = count;
+		halfWidth = half;
+		order = fitOrder;
+		interior.resize(2 * halfWidth + 1);
+		fitWeights(halfWidth, halfWidth, interior.data());
+		edge.clear();
+		for(int i = 0; i < n; i++) {
+			const int lo = std::max(0, i - halfWidth), hi = std::min(n - 1, i + halfWidth);
+			if(i - lo == halfWidth && hi - i == halfWidth) continue;
+			edge.resize(edge.size() + hi - lo + 1);
+			fitWeights(i - lo, hi - i, edge.data() + edge.size() - (hi - lo + 1));
+		}
+	}
+
+	//@brief: smooth a profile
+	//@param v: values to smooth (length passed to assign)
+	//@param smoothed: location to write smoothed values (length passed to assign, must not overlap v)
+	void operator()(double const * const v, double * const smoothed) const {
+		size_t e = 0;//next edge weight
+		for(int i = 0; i < n; i++) {
+			const int lo = std::max(0, i - halfWidth), hi = std::min(n - 1, i + halfWidth);
+			double const * w = interior.data();
+			if(i - lo != halfWidth || hi - i != halfWidth) {
+				w = edge.data() + e;
+				e += hi - lo + 1;
+			}
+			double sum = 0.0;
+			for(int j = lo; j <= hi; j++) sum += w[j - lo] * v[j];
+			smoothed[i] = sum;
+		}
+	}
+};
+
+//@brief: working memory for smoothRowShifts (kept between frames so smoothing doesn't allocate)
+struct RowShiftSmoothing {
+	std::vector<double> values;  //shifts of a single pass
+	std::vector<double> median;  //running median of values
+	std::vector<double> window;  //sorting space for the running median
+	std::vector<double> smoothed;//filtered median
+	SavitzkyGolay filter[2];     //weights for each pass (the passes of a snake scan with an odd number of rows differ in length)
+};
+
+//@brief: smooth a profile of row shifts with a running median (rejecting rows that matched poorly) followed by a savitzky-golay filter
+//@param shifts: row shifts to smooth in place
+//@param snake: true to smooth even and odd rows separately (forward and backward passes can have different offsets)
+//@param scratch: working memory (reused between calls)
+//@param medianWidth: width of the running median in rows (odd, 1 to skip)
+//@param sgWidth: width of the savitzky-golay window in rows (odd, 1 to skip)
+//@param sgOrder: order of the savitzky-golay polynomial
+template <typename Real>
+void smoothRowShifts(std::vector<Real>& shifts, const bool snake, RowShiftSmoothing& scratch, const int medianWidth = 5, const int sgWidth = 15, const int sgOrder = 2) {
+	const size_t passes = snake ? 2 : 1;
+	for(size_t first = 0; first < passes; first++) {
+		std::vector<double>& v = scratch.values;
+		v.clear();
+		for(size_t i = first; i < shifts.size(); i += passes) v.push_back(shifts[i]);
+		const int n = (int)v.size();
+
+		//running median (window truncated at the ends)
+		std::vector<double>& median = scratch.median;
+		std::vector<double>& window = scratch.window;
+		median.resize(n);
+		for(int i = 0; i < n; i++) {
+			const int lo = std::max(0, i - medianWidth / 2), hi = std::min(n - 1, i + medianWidth / 2);
+			window.assign(v.begin() + lo, v.begin() + hi + 1);
+			std::nth_element(window.begin(), window.begin() + window.size() / 2, window.end());
+			median[i] = window[window.size() / 2];
+		}
+
+		scratch.smoothed.resize(n);
+		scratch.filter[first].assign(n, sgWidth / 2, sgOrder);
+		scratch.filter[first](median.data(), scratch.smoothed.data());
+		for(int i = 0; i < n; i++) shifts[first + i * passes] = Real(scratch.smoothed[i]);
+	}
+}
+
+//@brief: multiply a half spectrum by exp(i * k * f) for each of its frequencies f (shift a row by -k * cols / 2pi pixels)
+//@param fft: half spectrum of a row
+//@param freqs: frequency of each element (UpsampleKernel::frequencies)
+//@param k: phase slope in radians per frequency
+template <typename Real>
+void applyPhaseRamp(std::complex<Real> * const fft, const std::vector<int>& freqs, const double k) {
+	//step the phase with a complex multiply, resynchronizing periodically to keep rounding error from building up
+	const std::complex<double> step = std::polar(1.0, k);
+	std::complex<double> p(1.0, 0.0);
+	for(size_t f = 0; f < freqs.size(); f++) {
+		if(0 == f % 64) p = std::polar(1.0, k * f);
+		fft[f] *= std::complex<Real>(freqs[f] == (int)f ? p : std::polar(1.0, k * freqs[f]));
+		p *= step;
+	}
+}
+
+//@brief: working memory to align a frame, sized once and reused for every frame a thread aligns
+template <typename Real>
+struct AlignmentWorkspace {
+	FFTWBuffer<Real, Real> frameData;                 //frame converted to Real (rows x cols)
+	FFTWBuffer<std::complex<Real>, Real> movFrame;   //fft of each row (rows x fftSizePad)
+	std::vector<Real> xCorrRe, xCorrIm;               //first half of cross correlation for a row (split real / imaginary)
+	std::vector< std::complex<Real> > phaseShift;     //phase ramp to apply shift
+	std::vector<Real> movedRe, movedIm;               //xCorr with a whole pixel phase applied (UpsampledRow)
+	FFTWBuffer<std::complex<Real>, Real> xPower;      //cross power spectrum of each row (rows x fftSizePad), peak methods only
+	FFTWBuffer<Real, Real> xCorrFrame;                //cross correlation of each row (rows x cols), peak methods only
+	std::vector<Real> rowShift;                       //shift of each row (pixels)
+	std::vector<char> found;                          //true for rows that found a correlation peak
+	RowShiftSmoothing smoothing;                      //scratch space for per row shift profiles
+
+	//reference frame, only used by the thread calling correlateRows
+	FFTWBuffer<Real, Real> refData;                   //reference frame converted to Real (rows x cols), also the inverse of a spectrum sum
+	FFTWBuffer<std::complex<Real>, Real> refFrame;   //conjugate fft of each row of reference frame (rows x fftSizePad)
+	std::vector<Real> refEnergy;                      //rowEnergy of each row of reference frame
+	std::vector< std::unique_ptr< FFTWBuffer<std::complex<Real>, Real> > > blockSums;//sums of the shifted spectra of blocks of frames (rows x fftSizePad each)
+
+	//@brief: size buffers for a frame, memory is only reallocated if a size changes
+	//@param rows: frame height
+	//@param cols: frame width
+	//@param method: sub pixel method that will be used
+	void assign(const int rows, const int cols, const SubpixelMethod method = SubpixelMethod::KernelWalk) {
+		const int fftSize = cols / 2 + 1;
+		const int fftSizePad = alignmentFftDist(cols);
+		frameData.allocate((size_t)rows * cols);
+		movFrame.allocate((size_t)fftSizePad * rows);
+		xCorrRe.resize(fftSize);
+		xCorrIm.resize(fftSize);
+		phaseShift.resize(fftSize);
+		rowShift.resize(rows);
+		found.resize(rows);
+		if(SubpixelMethod::KernelWalk != method) {
+			xPower.allocate((size_t)fftSizePad * rows);
+			xCorrFrame.allocate((size_t)rows * cols);
+		}
+	}
+
+	//@brief: get the calling thread's workspace for a frame size and method (created on first use and kept for the life of the thread)
+	//@param rows: frame height
+	//@param cols: frame width
+	//@param method: sub pixel method that will be used
+	//@return: sized workspace
+	//@note: workspaces are kept per size so alternating between image sizes (e.g. batch reprocessing) doesn't reallocate
+	static AlignmentWorkspace& Get(const int rows, const int cols, const SubpixelMethod method) {
+		thread_local std::map<std::tuple<int, int, SubpixelMethod>, std::unique_ptr<AlignmentWorkspace> > cache;
+		std::unique_ptr<AlignmentWorkspace>& ws = cache[std::make_tuple(rows, cols, method)];
+		if(!ws) {
+			ws.reset(new AlignmentWorkspace());
+			ws->assign(rows, cols, method);
+		}
+		return *ws;
+	}
+};
+
+//@brief: upsampling kernel of "Efficient subpixel image registration algorithms," Opt. Lett. 33, 156-158 (2008), modified to account for conjugate symmetry
+//@note: the kernel row for a shift of s = q * upsampleFactor + r (-upsampleFactor/2 <= r < upsampleFactor - upsampleFactor/2) subpixels is exp(-2 pi i k s / (cols * upsampleFactor))
+//       this factors into a whole pixel phase exp(-2 pi i k q / cols) (a root of unity) times one of upsampleFactor fine rows,
+//       so only upsampleFactor rows + cols roots are stored instead of a row for every shift
+template <typename Real>
+class UpsampleKernel {
+	int nCols;                               //row length in real space
+	int factor;                              //sub pixel resolution factor
+	std::vector<int> freqs;                  //fft shifted frequency of each half spectrum entry (0, 1, 2, ..., cols/2 (negative for even cols))
+	std::vector<Real> fineRe, fineIm;        //fine rows (upsampleFactor x fftSize, split real / imaginary), row r + upsampleFactor/2 is the phase for r subpixels
+	std::vector< std::complex<Real> > roots; //exp(-2 pi i j / cols) for j in [0, cols)
+
+public:
+	//@param cols: row length in real space
+	//@param upsampleFactor: sub pixel resolution factor
+	UpsampleKernel(const int cols, const int upsampleFactor) : nCols(cols), factor(upsampleFactor) {
+		if(cols < 2 || upsampleFactor < 1) throw std::runtime_error("invalid upsampling kernel size");
+		const int fftSize = cols / 2 + 1;
+		freqs.resize(fftSize);
+		std::iota(freqs.begin(), freqs.end(), 0);
+		if(0 == cols % 2) freqs.back() = -freqs.back();
+		fineRe.resize((size_t)upsampleFactor * fftSize);
+		fineIm.resize((size_t)upsampleFactor * fftSize);
+		const Real kExp = Real(-6.2831853071795864769252867665590057683943387987502) / (cols * upsampleFactor);
+		for(int r = 0; r < upsampleFactor; r++) {
+			const Real k = kExp * (r - upsampleFactor / 2);
+			std::transform(freqs.begin(), freqs.end(), fineRe.begin() + (size_t)r * fftSize, [k](const int& x){return std::cos(k*x);});
+			std::transform(freqs.begin(), freqs.end(), fineIm.begin() + (size_t)r * fftSize, [k](const int& x){return std::sin(k*x);});
+		}
+		roots.resize(cols);
+		for(int j = 0; j < cols; j++) {
+			const Real k = Real(-6.2831853071795864769252867665590057683943387987502 * j) / cols;
+			roots[j] = std::complex<Real>(std::cos(k), std::sin(k));
+		}
+	}
+
+	//@brief: get a kernel shared by every caller with the same parameters (built on first use)
+	//@param cols: row length in real space
+	//@param upsampleFactor: sub pixel resolution factor
+	//@return: cached kernel
+	static std::shared_ptr<const UpsampleKernel> Get(const int cols, const int upsampleFactor) {
+		static std::mutex mut;
+		static std::map<std::pair<int, int>, std::shared_ptr<const UpsampleKernel> > cache;
+		std::lock_guard<std::mutex> lock(mut);
+		std::shared_ptr<const UpsampleKernel>& k = cache[std::make_pair(cols, upsampleFactor)];
+		if(!k) k = std::make_shared<const UpsampleKernel>(cols, upsampleFactor);
+		return k;
+	}
+
+	int cols() const {return nCols;}
+	int upsampleFactor() const {return factor;}
+	size_t fftSize() const {return freqs.size();}
+	const std::vector<int>& frequencies() const {return freqs;}
+	Real const * fineRowRe(const int r) const {return fineRe.data() + (size_t)(r + factor / 2) * freqs.size();}//r in [-upsampleFactor/2, upsampleFactor - upsampleFactor/2)
+	Real const * fineRowIm(const int r) const {return fineIm.data() + (size_t)(r + factor / 2) * freqs.size();}
+
+	//@brief: get the whole pixel phase of a frequency
+	//@param k: index into half spectrum
+	//@param q: whole pixel shift
+	const std::complex<Real>& coarse(const size_t k, const int q) const {
+		const long long j = ((long long)freqs[k] * q) % nCols;
+		return roots[(size_t)(j < 0 ? j + nCols : j)];
+	}
+};
+
+//@brief: evaluate the upsampled cross correlation of a single row at subpixel shifts
+//@note: the whole pixel phase is applied to the cross power spectrum once and reused until a shift in a different whole pixel is requested
+template <typename Real>
+class UpsampledRow {
+	const UpsampleKernel<Real>& kernel;
+	Real const * xRe, * xIm;           //first half of cross power spectrum
+	std::vector<Real>& movedRe;        //xCorr with whole pixel phase of q applied
+	std::vector<Real>& movedIm;
+	Real const * cRe, * cIm;           //spectrum for current whole pixel (x or moved)
+	int q;                             //current whole pixel shift
+	size_t count;                      //number of shifts evaluated
+
+	//@brief: get the whole pixel of a shift (nearest whole pixel so small shifts never leave q = 0)
+	int wholePixel(const int s) const {
+		const int up = kernel.upsampleFactor();
+		const int c = s + up / 2;
+		return c >= 0 ? c / up : -((up - 1 - c) / up);//floor division
+	}
+
+	//@brief: apply the phase for a whole pixel shift to the spectrum
+	void moveTo(const int sq) {
+		if(sq == q) return;
+		q = sq;
+		if(0 == q) {
+			cRe = xRe;
+			cIm = xIm;
+			return;
+		}
+		for(size_t k = 0; k < movedRe.size(); k++) {
+			const std::complex<Real>& p = kernel.coarse(k, q);
+			movedRe[k] = xRe[k] * p.real() - xIm[k] * p.imag();
+			movedIm[k] = xRe[k] * p.imag() + xIm[k] * p.real();
+		}
+		cRe = movedRe.data();
+		cIm = movedIm.data();
+	}
+
+public:
+	//@param k: upsampling kernel
+	//@param re: real part of first half of cross power spectrum (k.fftSize() values, must remain valid)
+	//@param im: imaginary part of first half of cross power spectrum
+	//@param scratchRe: working memory
+	//@param scratchIm: working memory
+	UpsampledRow(const UpsampleKernel<Real>& k, Real const * const re, Real const * const im, std::vector<Real>& scratchRe, std::vector<Real>& scratchIm) : kernel(k), xRe(re), xIm(im), movedRe(scratchRe), movedIm(scratchIm), cRe(re), cIm(im), q(0), count(0) {
+		movedRe.resize(kernel.fftSize());
+		movedIm.resize(kernel.fftSize());
+	}
+
+	//@brief: compute the upsampled cross correlation value for a single subpixel shift
+	//@param s: shift in subpixels (the correlation at -s / upsampleFactor pixels)
+	//@return: upsampled value
+	Real operator()(const int s) {
+		++count;
+		moveTo(wholePixel(s));
+		const int r = s - q * kernel.upsampleFactor();
+
+		//abs(dot(2 conjugate symmetric values)) -> all complex components cancel (center complex component doesn't but it is vanishingly small compared to real part for relevant sizes)
+		//to be fully rigourous could check for even length half cross correlations and handle)
+		//only accumulate the real part since the imaginary part will cancel out from conjugate symmetry, multiply by 2 to account for symmetry and add first entry (k[0] is always 1)
+		return simd::Kernels<Real>::dot(cRe + 1, cIm + 1, kernel.fineRowRe(r) + 1, kernel.fineRowIm(r) + 1, kernel.fftSize() - 1) * Real(2) + cRe[0];
+	}
+
+	//@brief: compute the upsampled cross correlation values for 3 neighboring shifts in a single pass over the spectrum when possible
+	//@param s: center shift in subpixels
+	//@param values: location to write values for s - 1, s, and s + 1
+	void triplet(const int s, Real * const values) {
+		const int sq = wholePixel(s - 1);
+		if(sq != wholePixel(s + 1)) {//fine rows aren't adjacent across whole pixels
+			for(int j = 0; j < 3; j++) values[j] = (*this)(s - 1 + j);
+			return;
+		}
+		count += 3;
+		moveTo(sq);
+		const int r = s - 1 - q * kernel.upsampleFactor();
+		simd::Kernels<Real>::dot3(cRe + 1, cIm + 1, kernel.fineRowRe(r) + 1, kernel.fineRowIm(r) + 1, kernel.fftSize(), kernel.fftSize() - 1, values);
+		for(int j = 0; j < 3; j++) values[j] = values[j] * Real(2) + cRe[0];
+	}
+
+	//@brief: get the number of shifts evaluated so far (cost of a search)
+	size_t evaluations() const {return count;}
+};
+
+//@brief: result of a search for the correlation peak of a row
+template <typename Real>
+struct RowPeak {
+	int shift;      //highest correlation shift (units depend on search)
+	Real correlation;//cross correlation at shift
+	bool found;     //false if the correlation was still increasing at the edge of the search window
+};
+
 //@brief: compute the highest correlation sub pixel shift
-//@param kernel: upsampling kernel
-//@param xCorr: fft of cross correlation
+//@param row: upsampled cross correlation
+//@param kernelSize: shifts must be within (-kernelSize, kernelSize)
 //@param shift: initial search position in upsampled kernel (relative to kernel center)
-//@return: highest correlation sub pixel shift (relative to kernel center)
+//@return: highest correlation sub pixel shift (relative to kernel center), not found if the search reached the end of the window
 template <typename Real>
-inline int computeSubpixelShift(const std::vector< std::vector< std::complex<Real> > >& kernel, const std::vector< std::complex<Real> >& xCorr, int shift = 0) {
+inline RowPeak<Real> computeSubpixelShift(UpsampledRow<Real>& row, const int kernelSize, int shift = 0) {
 	//this operation is relatively expensive to brute force and for dic speckle the cross correlation is well behaved for small shifts, so a linear search should work well
-	const size_t kernelSize = (kernel.size() + 1) / 2;
-	Real negCor = upsampledValue(kernel[kernelSize-1+shift-1], xCorr);//compute cross correlation for single sub pixel shift in negative direction
-	Real maxCor = upsampledValue(kernel[kernelSize-1+shift  ], xCorr);//compute cross correlation for previous sub pixel shift
-	Real posCor = upsampledValue(kernel[kernelSize-1+shift+1], xCorr);//compute cross correlation for single sub pixel shift in positive direction
+	Real cor[3];
+	row.triplet(shift, cor);//compute cross correlation for single sub pixel shifts in negative direction, previous shift, and positive direction together
+	Real negCor = cor[0];
+	Real maxCor = cor[1];
+	Real posCor = cor[2];
 	if(negCor > maxCor || posCor > maxCor) {
 		const bool neg = negCor > posCor;//determine which direction to search in
 		Real curCor = neg ? negCor : posCor;
@@ -100,54 +698,299 @@ inline int computeSubpixelShift(const std::vector< std::vector< std::complex<Rea
 		while(curCor > maxCor) {//search until the maximum is passed
 			maxCor = curCor;
 			neg ? --shift : ++shift;
-			if(shift == kernelSize || -shift == kernelSize) throw std::runtime_error("maxima not found within window");//the end of the window is reached
-			curCor = upsampledValue(kernel[kernelSize-1+shift], xCorr);//compute cross correlation for single sub pixel shift in positive direction
+			if(shift == kernelSize || -shift == kernelSize) {//the end of the window is reached
+				RowPeak<Real> edge = {neg ? shift + 1 : shift - 1, maxCor, false};
+				return edge;
+			}
+			curCor = row(shift);//compute cross correlation for single sub pixel shift in positive direction
 		}
 		neg ? ++shift : --shift;//walk back to maxima
 	}
-	return shift;
+	RowPeak<Real> peak = {shift, maxCor, true};
+	return peak;
+}
+
+//@brief: find the integer peak of a circular cross correlation
+//@param c: cross correlation (cols values, index n holds the correlation at shift n mod cols)
+//@param cols: length of cross correlation
+//@param window: largest shift magnitude to consider
+//@return: shift of highest correlation in [-window, window], not found if the correlation is still increasing past the edge of the window
+template <typename Real>
+inline RowPeak<Real> correlationPeak(Real const * const c, const int cols, int window) {
+	window = std::min(window, (cols - 1) / 2);
+	int peak = 0;
+	for(int n = -window; n <= window; n++) {
+		if(c[(n + cols) % cols] > c[(peak + cols) % cols]) peak = n;
+	}
+	//a peak on the edge of the window is only a maxima if the next value outside the window is lower
+	RowPeak<Real> result = {peak, c[(peak + cols) % cols], true};
+	if((window == peak || -window == peak) && window < cols / 2) {
+		const int outside = peak + (peak > 0 ? 1 : -1);
+		if(c[(outside + cols) % cols] > c[(peak + cols) % cols]) result.found = false;
+	}
+	return result;
+}
+
+//@brief: refine an integer correlation peak with a closed form fit through the peak and its neighbors
+//@param c: cross correlation (cols values)
+//@param cols: length of cross correlation
+//@param peak: integer peak
+//@param method: SubpixelMethod::Parabolic or SubpixelMethod::Gaussian
+//@return: sub pixel offset from peak in [-0.5, 0.5]
+template <typename Real>
+inline Real refinePeak(Real const * const c, const int cols, const int peak, const SubpixelMethod method) {
+	Real cm = c[(peak - 1 + cols) % cols];
+	Real c0 = c[(peak     + cols) % cols];
+	Real cp = c[(peak + 1 + cols) % cols];
+	if(SubpixelMethod::Gaussian == method && cm > 0 && c0 > 0 && cp > 0) {//the gaussian fit is undefined for non-positive values, fall back to a parabola
+		cm = std::log(cm);
+		c0 = std::log(c0);
+		cp = std::log(cp);
+	}
+	const Real denom = cm - c0 * 2 + cp;
+	if(!(denom < 0)) return 0;//flat or not a maxima
+	return std::max(Real(-0.5), std::min(Real(0.5), (cm - cp) / (denom * 2)));
+}
+
+//@brief: refine an integer correlation peak by evaluating the upsampled cross correlation in a +/-0.75 pixel window
+//@param row: upsampled cross correlation
+//@param peak: integer peak
+//@return: highest correlation sub pixel shift in 1/upsampleFactor pixel units (kernel convention) and its correlation
+template <typename Real>
+inline RowPeak<Real> refinePeakDft(UpsampledRow<Real>& row, const int peak, const int upsampleFactor) {
+	//correlation at peak + m / upsampleFactor is kernel shift -(peak * upsampleFactor + m)
+	const int center = -peak * upsampleFactor;
+	const int half = (upsampleFactor * 3 + 3) / 4;
+	int best = center;
+	Real maxCor = row(center);
+	Real cor[3];
+	for(int s = center - half; s <= center + half; s += 3) {
+		row.triplet(s + 1, cor);//evaluate 3 shifts per pass
+		for(int j = 0; j < 3 && s + j <= center + half; j++) {
+			if(cor[j] > maxCor) {
+				maxCor = cor[j];
+				best = s + j;
+			}
+		}
+	}
+	RowPeak<Real> result = {best, maxCor, true};
+	return result;
+}
+
+//@brief: outcome of aligning a frame
+enum class AlignStatus {
+	Aligned,  //every row found a correlation peak
+	Partial,  //some rows didn't find a peak within the maximum shift and used the shift of the nearest row that did
+	Failed,   //no row found a peak, the frame wasn't changed
+	Reference //the frame other frames were aligned to
+};
+
+//@brief: get a printable name for an alignment status
+inline const char* toString(const AlignStatus status) {
+	switch(status) {
+		case AlignStatus::Aligned  : return "aligned";
+		case AlignStatus::Partial  : return "partial";
+		case AlignStatus::Failed   : return "failed";
+		case AlignStatus::Reference: return "reference";
+	}
+	return "unknown";
+}
+
+//@brief: diagnostics for the alignment of a single frame
+template <typename Real>
+struct AlignResult {
+	Real shift;       //mean applied shift in pixels (fftw convention)
+	Real correlation; //mean normalized (zero mean) cross correlation at the peak over rows that found a peak (1 for a perfect match)
+	size_t steps;     //number of correlation values evaluated while searching (cost of the search)
+	size_t failedRows;//number of rows that didn't find a peak
+	AlignStatus status;
+
+	AlignResult() : shift(0), correlation(0), steps(0), failedRows(0), status(AlignStatus::Reference) {}
+};
+
+//@brief: get the energy of a row without its mean from the first half of its spectrum (Parseval)
+//@param fft: first half of row spectrum
+//@param fftSize: number of values in fft
+//@return: sum of squared deviations from the mean times the row length
+template <typename Real>
+inline Real rowEnergy(std::complex<Real> const * const fft, const size_t fftSize) {
+	Real sum = 0;
+	for(size_t k = 1; k < fftSize; k++) sum += std::norm(fft[k]);
+	return sum * 2;//conjugate symmetric half
+}
+
+//@brief: replace the shifts of rows that didn't find a peak with the shift of the nearest row that did
+//@param shifts: row shifts
+//@param found: true for rows that found a peak
+//@param snake: true to only borrow shifts from rows scanned in the same direction (if any found a peak)
+template <typename Real>
+void fillFailedRows(std::vector<Real>& shifts, const std::vector<char>& found, const bool snake) {
+	const int rows = (int)shifts.size();
+	for(int i = 0; i < rows; i++) {
+		if(found[i]) continue;
+		for(int pass = snake ? 0 : 1; pass < 2; pass++) {//same direction first, then any row
+			const int step = 0 == pass ? 2 : 1;
+			int nearest = -1;
+			for(int d = step; d < rows && nearest < 0; d += step) {
+				if(i - d >= 0   && found[i - d]) nearest = i - d;
+				else if(i + d < rows && found[i + d]) nearest = i + d;
+			}
+			if(nearest >= 0) {
+				shifts[i] = shifts[nearest];
+				break;
+			}
+		}
+	}
+}
+
+//@brief: add the half spectrum of every row of a frame to a running sum
+//@param sum: running sum (rows x fftSizePad)
+//@param fft: spectra to add (rows x fftSizePad)
+//@param rows: frame height
+//@param fftSize: elements in each half spectrum
+//@param fftSizePad: distance between rows
+template <typename Real>
+inline void addSpectra(std::complex<Real> * const sum, std::complex<Real> const * const fft, const int rows, const size_t fftSize, const int fftSizePad) {
+	for(int i = 0; i < rows; i++) {
+		std::complex<Real> * const s = sum + (size_t)i * fftSizePad;
+		std::complex<Real> const * const f = fft + (size_t)i * fftSizePad;
+		for(size_t j = 0; j < fftSize; j++) s[j] += f[j];
+	}
 }
 
 //@brief: compute the highest correlation sub pixel shift for each row, average, and apply the result
 //@param frame: the frame to align
 //@param refFrame: conj(fft(frame to align to))
-//@param inds: fft shifted intds (0, 1, 2, 3, ..., cols/2, -cols/2, 1-cols/2, ..., -3, -2, -1)
+//@param refEnergy: rowEnergy of each row of the frame to align to
 //@param kernel: upsampling kernel
+//@param kernelSize: row shifts must be within (-kernelSize, kernelSize) subpixels
 //@param cols: frame width
 //@param rows: frame height
 //@param snake: true/false if rows have the same / alternating shift
 //@param upsampleFactor: sub pixel resolution factor
-//@return: the applied shift
+//@param fftw: batched plans for all rows of a frame
+//@param ws: working memory (sized for rows x cols and method)
+//@param method: how to find the sub pixel shift of each row
+//@param profile: how the row shifts are applied
+//@param shiftedSum: running sum (rows x fftSizePad) to add the spectra of the shifted rows to instead of writing them back to frame, or NULL
+//@return: alignment diagnostics (the shift applied to each row is left in ws.rowShift)
+//@note: rows that don't find a peak within kernelSize use the shift of the nearest row that did, if no row finds a peak the frame is left unchanged
 template <typename Real, typename T>
-inline Real alignFrame(std::vector<T>& frame, const std::vector< std::complex<Real> >& refFrame, const std::vector<int>& inds, const std::vector< std::vector< std::complex<Real> > >& kernel, const int cols, const int rows, const bool snake, const int upsampleFactor, const FFTW<Real>& fftw) {
-	//compute fft of each row of moving frame
-	const int fftSize = cols / 2 + 1;
-	const int fftSizePad = (cols + 2) / 1;//odd size offsets can cause fftw to crash or prevent use of SIMD instructions
-	std::vector<Real> rowData(cols);
-	std::vector< std::complex<Real> > movFrame;
-	movFrame.reserve(fftSizePad * rows);
-	for(int i = 0; i < rows; i++) {
-		std::copy(frame.begin() + i * cols, frame.begin() + (i+1) * cols, rowData.begin());//copy data to Real
-		fftw.forward(rowData.data(), movFrame.data() + i * fftSizePad);//compute fft
+inline AlignResult<Real> alignFrame(std::vector<T>& frame, const FFTWBuffer<std::complex<Real>, Real>& refFrame, Real const * const refEnergy, const UpsampleKernel<Real>& kernel, const int kernelSize, const int cols, const int rows, const bool snake, const int upsampleFactor, const FFTW<Real>& fftw, AlignmentWorkspace<Real>& ws, const SubpixelMethod method, const ShiftProfile profile = ShiftProfile::Uniform, std::complex<Real> * const shiftedSum = NULL) {
+	//compute fft of every row of moving frame with a single plan execution
+	const int fftSizePad = alignmentFftDist(cols);
+	FFTWBuffer<Real, Real>& frameData = ws.frameData;
+	FFTWBuffer<std::complex<Real>, Real>& movFrame = ws.movFrame;
+	std::copy(frame.begin(), frame.begin() + (size_t)rows * cols, frameData.begin());//copy data to Real
+	fftw.forward(frameData.data(), movFrame.data());//compute fft
+
+	AlignResult<Real> result;
+	std::vector<char>& found = ws.found;
+	std::fill(found.begin(), found.end(), 1);
+	double corSum = 0;//sum of normalized correlations of rows that found a peak
+
+	//normalize the zero mean cross correlation of a row by the energy of both rows
+	const size_t fftSize = ws.xCorrRe.size();
+	auto normalized = [&](const int i, const Real cor) {
+		const Real energy = std::sqrt(refEnergy[i] * rowEnergy(movFrame.data() + i * fftSizePad, fftSize));
+		return energy > 0 ? cor / energy : Real(0);
+	};
+
+	//find the shift of each row in kernel units (1/upsampleFactor pixels)
+	if(SubpixelMethod::KernelWalk == method) {
+		//upsample convolved ffts near origin to find best shift for each row
+		int shift = 0;//search from zero on first row
+		for(int i = 0; i < rows; i++) {
+			simd::Kernels<Real>::multiply(refFrame.data() + i * fftSizePad, movFrame.data() + i * fftSizePad, ws.xCorrRe.data(), ws.xCorrIm.data(), fftSize);//first half of cross correlation
+			UpsampledRow<Real> row(kernel, ws.xCorrRe.data(), ws.xCorrIm.data(), ws.movedRe, ws.movedIm);
+			const RowPeak<Real> peak = computeSubpixelShift(row, kernelSize, snake ? -shift : shift);//search from previous result on subsequent rows
+			result.steps += row.evaluations();
+			if(peak.found) {
+				shift = peak.shift;
+				corSum += normalized(i, peak.correlation - ws.xCorrRe[0]);//remove mean contribution
+			} else {
+				found[i] = 0;
+				if(snake) shift = -shift;//keep searching from the last good shift
+			}
+			ws.rowShift[i] = Real((snake && 1 == i % 2) ? -shift : shift);
+		}
+	} else {
+		//cross correlate every row with a single inverse fft (dropping the mean so the peak sits on a zero baseline)
+		const int window = (kernelSize - 1) / upsampleFactor;//same range the kernel covers
+		for(int i = 0; i < rows; i++) {
+			std::transform(refFrame.data() + i * fftSizePad, refFrame.data() + i * fftSizePad + fftSize, movFrame.data() + i * fftSizePad, ws.xPower.data() + i * fftSizePad, std::multiplies< std::complex<Real> >());
+			ws.xPower[(size_t)i * fftSizePad] = 0;
+		}
+		fftw.inverse(ws.xCorrFrame.data(), ws.xPower.data());
+
+		//correlation peak at n corresponds to a kernel shift of -n * upsampleFactor
+		for(int i = 0; i < rows; i++) {
+			Real const * const c = ws.xCorrFrame.data() + (size_t)i * cols;
+			const RowPeak<Real> peak = correlationPeak(c, cols, window);
+			result.steps += 2 * std::min(window, (cols - 1) / 2) + 1;
+			if(!peak.found) {
+				found[i] = 0;
+				continue;
+			}
+			Real shift, cor = peak.correlation;
+			if(SubpixelMethod::LocalDft == method) {
+				simd::Kernels<Real>::multiply(refFrame.data() + i * fftSizePad, movFrame.data() + i * fftSizePad, ws.xCorrRe.data(), ws.xCorrIm.data(), fftSize);
+				UpsampledRow<Real> row(kernel, ws.xCorrRe.data(), ws.xCorrIm.data(), ws.movedRe, ws.movedIm);
+				const RowPeak<Real> fine = refinePeakDft(row, peak.shift, upsampleFactor);
+				result.steps += row.evaluations();
+				shift = Real(fine.shift);
+				cor = fine.correlation - ws.xCorrRe[0];//remove mean contribution
+			} else {
+				shift = -(peak.shift + refinePeak(c, cols, peak.shift, method)) * upsampleFactor;
+			}
+			corSum += normalized(i, cor);
+			ws.rowShift[i] = (snake && 1 == i % 2) ? -shift : shift;
+		}
 	}
 
-	//upsample convolved ffts near origin to find best shift for each row
-	int shift = 0;//search from zero on first row
-	Real meanShift = 0.0;
-	std::vector< std::complex<Real> > xCorr(fftSize);
-	for(int i = 0; i < rows; i++) {
-		std::transform(refFrame.begin() + i * fftSizePad, refFrame.begin() + i * fftSizePad + fftSize, movFrame.data() + i * fftSizePad, xCorr.begin(), std::multiplies< std::complex<Real> >());//first half of cross correlation
-		shift = computeSubpixelShift(kernel, xCorr, snake ? -shift : shift);//search from previous result on subsequent rows
-		meanShift += (snake && 1 == i % 2) ? -shift : shift;
+	//fall back to the nearest good row for rows without a peak
+	result.failedRows = (size_t)std::count(found.begin(), found.end(), 0);
+	if(result.failedRows == (size_t)rows) {
+		std::fill(ws.rowShift.begin(), ws.rowShift.end(), Real(0));
+		result.status = AlignStatus::Failed;
+		if(NULL != shiftedSum) addSpectra(shiftedSum, movFrame.data(), rows, fftSize, fftSizePad);
+		return result;
 	}
+	result.status = 0 == result.failedRows ? AlignStatus::Aligned : AlignStatus::Partial;
+	result.correlation = Real(corSum / (rows - result.failedRows));
+	if(result.failedRows > 0) fillFailedRows(ws.rowShift, found, snake);
+	Real meanShift = std::accumulate(ws.rowShift.begin(), ws.rowShift.end(), Real(0));
 	meanShift /= rows * upsampleFactor;//fftw using a different convention that I was
 
 	//apply shift
 	const Real vMin(std::numeric_limits<T>::lowest());
 	const Real vMax(std::numeric_limits<T>::max());
+	auto writeBack = [&]() {
+		if(NULL != shiftedSum) {
+			addSpectra(shiftedSum, movFrame.data(), rows, fftSize, fftSizePad);//stay in the frequency domain, the caller inverts the sum once
+			return;
+		}
+		fftw.inverse(frameData.data(), movFrame.data());//compute inverse fft of every row
+		std::transform(frameData.begin(), frameData.end(), frame.begin(), [cols, vMin, vMax](const Real&v){return (T)std::max(vMin, std::min(vMax, std::round(v / cols)));});//scale (fftw doesn't scale) and clamp to pixel range
+	};
+	if(ShiftProfile::PerRow == profile) {
+		//apply each row's smoothed shift while its fft is already in hand (no extra transforms)
+		for(Real& s : ws.rowShift) s /= upsampleFactor;
+		smoothRowShifts(ws.rowShift, snake, ws.smoothing);
+		meanShift = std::accumulate(ws.rowShift.begin(), ws.rowShift.end(), Real(0)) / rows;
+		for(int i = 0; i < rows; i++) {
+			const double k = -6.2831853071795864769252867665590057683943387987502 * ws.rowShift[i] / cols;
+			applyPhaseRamp(movFrame.data() + i * fftSizePad, kernel.frequencies(), (snake && 1 == i % 2) ? -k : k);
+		}
+		writeBack();
+		for(Real& s : ws.rowShift) s = -s;//fftw convention
+		result.shift = -meanShift;
+		return result;
+	}
+	std::fill(ws.rowShift.begin(), ws.rowShift.end(), -meanShift);//fftw convention
 	const Real k = Real(-6.2831853071795864769252867665590057683943387987502 * meanShift) / cols;
-	std::vector< std::complex<Real> > phaseShift(fftSize);
-	std::transform(inds.begin(), inds.end(), phaseShift.begin(), [k](const int& x){return std::complex<Real>(std::cos(k*x), std::sin(k*x));});
+	std::vector< std::complex<Real> >& phaseShift = ws.phaseShift;
+	std::transform(kernel.frequencies().begin(), kernel.frequencies().end(), phaseShift.begin(), [k](const int& x){return std::complex<Real>(std::cos(k*x), std::sin(k*x));});
 	if(snake) {
 		for(int i = 0; i < rows; i+=2) std::transform(phaseShift.begin(), phaseShift.end(), movFrame.data() + i * fftSizePad, movFrame.data() + i * fftSizePad, std::multiplies< std::complex<Real> >());
 		std::for_each(phaseShift.begin(), phaseShift.end(), [](std::complex<Real>& v){v = std::conj(v);});
@@ -155,75 +998,115 @@ inline Real alignFrame(std::vector<T>& frame, const std::vector< std::complex<Re
 	} else {
 		for(int i = 0; i < rows; i++) std::transform(phaseShift.begin(), phaseShift.end(), movFrame.data() + i * fftSizePad, movFrame.data() + i * fftSizePad, std::multiplies< std::complex<Real> >());
 	}
-	for(int i = 0; i < rows; i++) {
-		fftw.inverse(rowData.data(), movFrame.data() + i * fftSizePad);//compute inverse fft
-		std::transform(rowData.begin(), rowData.end(), frame.begin() + i * cols, [cols, vMin, vMax](const Real&v){return (T)std::max(vMin, std::min(vMax, std::round(v / cols)));});//scale (fftw doesn't scale) and clamp to pixel range
-	}
-	return -meanShift;//fftw convention
+	writeBack();
+	result.shift = -meanShift;//fftw convention
+	return result;
 }
 
-template <typename Real, typename T>
-inline void alignFrames(std::vector< std::vector<T> >& frames, const std::vector< std::complex<Real> >& refFrame, const std::vector<int>& inds, const std::vector< std::vector< std::complex<Real> > >& kernel, const int cols, const int rows, const bool snake, const int upsampleFactor, std::vector<Real>& shifts, const FFTW<Real>& fftw, int const * const bounds, std::exception_ptr& pExp) {
-	try {
-		for(int i = bounds[0]; i < bounds[1]; i++) shifts[i-1] = alignFrame(frames[i-1], refFrame, inds, kernel, cols, rows, snake, upsampleFactor, fftw);
-	} catch (...) {
-		pExp = std::current_exception();
-	}
+//@brief: create the fft plans correlateRows uses for a frame size (so their wisdom is accumulated)
+//@param rows: frame height
+//@param cols: frame width
+template <typename Real>
+void planAlignment(const int rows, const int cols) {
+	FFTWPlans<Real>::Get(cols, rows, alignmentFftDist(cols));
 }
 
+//@brief: align the rows of every frame to the rows of the last frame (frames are modified in place)
+//@param frames: frames to align (each rows x cols)
+//@param rows: frame height
+//@param cols: frame width
+//@param snake: true/false if rows have the same / alternating shift
+//@param maxShift: maximum row shift in pixels
+//@param upsampleFactor: sub pixel resolution factor
+//@param method: how to find the sub pixel shift of each row
+//@param profile: how the row shifts are applied
+//@param rowShifts: location to write the shift applied to each row of each frame (frames.size() x rows) or NULL
+//@param sum: location to write the unrounded sum of every aligned frame (rows x cols) instead of modifying frames, or NULL
+//@return: alignment diagnostics for each frame (the last frame is the reference)
+//@note: when summing the shifted spectra are added in the frequency domain and a single inverse fft gives the sum,
+//       so pixels are rounded once (by the caller) instead of once per frame
 template <typename Real, typename T>
-std::vector<Real> correlateRows(std::vector< std::vector<T> >& frames, const int rows, const int cols, const bool snake = true, const Real maxShift = 1.5, const int upsampleFactor = 16) {
+std::vector< AlignResult<Real> > correlateRows(std::vector< std::vector<T> >& frames, const int rows, const int cols, const bool snake = true, const Real maxShift = 1.5, const int upsampleFactor = 16, const SubpixelMethod method = SubpixelMethod::KernelWalk, const ShiftProfile profile = ShiftProfile::Uniform, std::vector< std::vector<Real> > * const rowShifts = NULL, std::vector<Real> * const sum = NULL) {
 	//compute fft timeings onces
-	const FFTW<Real> fftw(cols);//copmpute timings once
-	const int fftSize = cols / 2 + 1;
-	const int fftSizePad = (cols + 2) / 1;//odd size offsets can cause fftw to crash or prevent use of SIMD instructions
-
-	//"Efficient subpixel image registration algorithms," Opt. Lett. 33, 156-158 (2008).
-	//compute upsampling kernel for shifts of -maxShift->0->maxShift, modified to account for conjugate symmetry
-	std::vector<int> inds(fftSize);
-	std::iota(inds.begin(), inds.end(), 0);
-	if(0 == cols % 2) inds.back() = -inds.back();
+	const int fftSizePad = alignmentFftDist(cols);
+	const FFTW<Real>& fftw = FFTWPlans<Real>::Get(cols, rows, fftSizePad);//compute timings once for a batch of every row in a frame (shared between calls and threads)
+
+	//get upsampling kernel for shifts of -maxShift->0->maxShift (shared between calls)
+	const std::shared_ptr<const UpsampleKernel<Real> > kernel = UpsampleKernel<Real>::Get(cols, upsampleFactor);
 	const int kernelSize = (int) std::ceil(maxShift * upsampleFactor);
-	std::vector< std::vector< std::complex<Real> > > kernel(2 * kernelSize - 1);
-	const Real kExp = Real(-6.2831853071795864769252867665590057683943387987502) / (cols * upsampleFactor);
-	for(int i = 0; i < kernelSize; i++) {
-		const Real k = kExp * i;
-		kernel[kernelSize - 1 - i].reserve(fftSize);
-		kernel[kernelSize - 1 + i].reserve(fftSize);
-		std::transform(inds.begin(), inds.end(), std::back_inserter(kernel[kernelSize - 1 + i]), [k](const int& x){return std::complex<Real>(std::cos(k*x), std::sin(k*x));});
-		if(i > 0) std::transform(kernel[kernelSize - 1 + i].begin(), kernel[kernelSize - 1 + i].end(), std::back_inserter(kernel[kernelSize - 1 - i]), [](const std::complex<Real>& v){return std::conj(v);});
-	}
-
-	//compute fft of each row of final frame
-	std::vector<Real> rowData(cols);
-	std::vector< std::complex<Real> > refFrame(fftSizePad * rows);
-	for(int i = 0; i < rows; i++) {
-		std::copy(frames.back().begin() + i * cols, frames.back().begin() + (i+1) * cols, rowData.begin());//copy data to Real
-		fftw.forward(rowData.data(), refFrame.data() + i * fftSizePad);//compute fft (Note: the 2nd argument here can be seen as a pointer)
-	}
+
+	//compute fft of each row of final frame (in this thread's workspace so repeated calls don't reallocate)
+	AlignmentWorkspace<Real>& callerWs = AlignmentWorkspace<Real>::Get(rows, cols, method);
+	FFTWBuffer<Real, Real>& refData = callerWs.refData;
+	FFTWBuffer<std::complex<Real>, Real>& refFrame = callerWs.refFrame;
+	std::vector<Real>& refEnergy = callerWs.refEnergy;
+	refData.allocate((size_t)rows * cols);
+	refFrame.allocate((size_t)fftSizePad * rows);
+	refEnergy.resize(rows);
+	std::copy(frames.back().begin(), frames.back().begin() + (size_t)rows * cols, refData.begin());//copy data to Real
+	fftw.forward(refData.data(), refFrame.data());//compute fft of every row
 	for(std::complex<Real>& v : refFrame) v = std::conj(v);//need complex conjugate of reference fft
+	for(int i = 0; i < rows; i++) refEnergy[i] = rowEnergy(refFrame.data() + (size_t)i * fftSizePad, (size_t)(cols / 2 + 1));
+
+	//add the reference spectrum to the sum of the shifted spectra, invert once, and scale (fftw doesn't scale)
+	auto finishSum = [&](FFTWBuffer<std::complex<Real>, Real>& spectrum) {
+		for(int i = 0; i < rows; i++) {
+			for(int j = 0; j < cols / 2 + 1; j++) spectrum[(size_t)i * fftSizePad + j] += std::conj(refFrame[(size_t)i * fftSizePad + j]);
+		}
+		fftw.inverse(refData.data(), spectrum.data());
+		sum->resize((size_t)rows * cols);
+		std::transform(refData.begin(), refData.end(), sum->begin(), [cols](const Real& v){return v / cols;});
+	};
 
+	if(NULL != rowShifts) rowShifts->assign(frames.size(), std::vector<Real>(rows, Real(0)));
 	static const bool parallel = true;
 	if(parallel) {
-		//build indicies of threads
-		const size_t threadCount = std::max<size_t>(std::thread::hardware_concurrency(), 1);
-		std::vector<int> workerInds(threadCount + 1);
-		std::vector<std::exception_ptr> expPtrs(threadCount, NULL);
-		const Real frameCount = Real(frames.size()) / threadCount;
-		for(size_t i = 0; i < workerInds.size(); i++) workerInds[i] = (int)std::round(frameCount * i);
-		std::replace(workerInds.begin(), workerInds.end(), 0, 1);
-
-		//compute and apply subpixel shift for each frame in parallel
-		std::vector<Real> frameShifts(frames.size());
-		std::vector<std::thread> workers((size_t)threadCount);
-		for(size_t i = 0; i < workers.size(); i++) workers[i] = std::thread(alignFrames<Real, T>, std::ref(frames), std::ref(refFrame), std::ref(inds), std::ref(kernel), cols, rows, snake, upsampleFactor, std::ref(frameShifts), std::ref(fftw), workerInds.data() + i, std::ref(expPtrs[i]));
-		for(size_t i = 0; i < workers.size(); i++) workers[i].join();
-		for(size_t i = 0; i < workers.size(); i++)
-			if(NULL != expPtrs[i]) std::rethrow_exception(expPtrs[i]);
-		return frameShifts;
+		//compute and apply subpixel shift for each frame as a separate task so idle workers can steal frames that take longer to align
+		ThreadPool& pool = ThreadPool::Shared();
+		std::vector< AlignResult<Real> > results(frames.size());
+		if(NULL == sum) {
+			pool.parallelFor(1, frames.size(), [&](const size_t i) {
+				AlignmentWorkspace<Real>& ws = AlignmentWorkspace<Real>::Get(rows, cols, method);//each thread's own, reused for every frame it aligns
+				results[i-1] = alignFrame(frames[i-1], refFrame, refEnergy.data(), *kernel, kernelSize, cols, rows, snake, upsampleFactor, fftw, ws, method, profile);
+				if(NULL != rowShifts) (*rowShifts)[i-1] = ws.rowShift;
+			});
+			return results;
+		}
+
+		//when summing, contiguous blocks of frames accumulate into their own spectrum and the blocks are added in order
+		//(the result doesn't depend on which worker aligned which frame)
+		const size_t nAlign = frames.size() - 1;
+		const size_t nBlocks = std::max<size_t>(1, std::min(nAlign, pool.size() + 1));
+		std::vector< std::unique_ptr< FFTWBuffer<std::complex<Real>, Real> > >& blockSums = callerWs.blockSums;
+		while(blockSums.size() < nBlocks) blockSums.push_back(std::unique_ptr< FFTWBuffer<std::complex<Real>, Real> >(new FFTWBuffer<std::complex<Real>, Real>()));
+		pool.parallelFor(0, nBlocks, [&](const size_t b) {
+			AlignmentWorkspace<Real>& ws = AlignmentWorkspace<Real>::Get(rows, cols, method);
+			FFTWBuffer<std::complex<Real>, Real>& blockSum = *blockSums[b];
+			blockSum.allocate((size_t)fftSizePad * rows);
+			std::fill(blockSum.begin(), blockSum.end(), std::complex<Real>(0));
+			for(size_t i = nAlign * b / nBlocks; i < nAlign * (b + 1) / nBlocks; i++) {
+				results[i] = alignFrame(frames[i], refFrame, refEnergy.data(), *kernel, kernelSize, cols, rows, snake, upsampleFactor, fftw, ws, method, profile, blockSum.data());
+				if(NULL != rowShifts) (*rowShifts)[i] = ws.rowShift;
+			}
+		});
+		for(size_t b = 1; b < nBlocks; b++) std::transform(blockSums[0]->begin(), blockSums[0]->end(), blockSums[b]->begin(), blockSums[0]->begin(), std::plus< std::complex<Real> >());
+		finishSum(*blockSums[0]);
+		return results;
 	} else {
-		std::vector<Real> frameShifts(frames.size());
-		for(int i = 1; i < frames.size(); i++) frameShifts[i-1] = alignFrame(frames[i-1], refFrame, inds, kernel, cols, rows, snake, upsampleFactor, fftw);//serial
-		return frameShifts;
+		std::vector< AlignResult<Real> > results(frames.size());
+		AlignmentWorkspace<Real>& ws = AlignmentWorkspace<Real>::Get(rows, cols, method);
+		std::vector< std::unique_ptr< FFTWBuffer<std::complex<Real>, Real> > >& blockSums = ws.blockSums;
+		if(blockSums.empty()) blockSums.push_back(std::unique_ptr< FFTWBuffer<std::complex<Real>, Real> >(new FFTWBuffer<std::complex<Real>, Real>()));
+		FFTWBuffer<std::complex<Real>, Real>& spectrum = *blockSums[0];
+		spectrum.allocate(NULL == sum ? 0 : (size_t)fftSizePad * rows);
+		std::fill(spectrum.begin(), spectrum.end(), std::complex<Real>(0));
+		for(int i = 1; i < frames.size(); i++) {//serial
+			results[i-1] = alignFrame(frames[i-1], refFrame, refEnergy.data(), *kernel, kernelSize, cols, rows, snake, upsampleFactor, fftw, ws, method, profile, NULL == sum ? NULL : spectrum.data());
+			if(NULL != rowShifts) (*rowShifts)[i-1] = ws.rowShift;
+		}
+		if(NULL != sum) finishSum(spectrum);
+		return results;
 	}
-}
\ No newline at end of file
+}
+
+#endif//_alignment_h_
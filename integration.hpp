@@ -0,0 +1,172 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                                 *
+ * Copyright (c) 2017, Reagents of the University of California                    *
+ * All rights reserved.                                                            *
+ *                                                                                 *
+ * Redistribution and use in source and binary forms, with or without              *
+ * modification, are permitted provided that the following conditions are met:     *
+ *                                                                                 *
+ * 1. Redistributions of source code must retain the above copyright notice, this  *
+ *    list of conditions and the following disclaimer.                             *
+ *                                                                                 *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,    *
+ *    this list of conditions and the following disclaimer in the documentation    *
+ *    and/or other materials provided with the distribution.                       *
+ *                                                                                 *
+ * 3. Neither the name of the copyright holder nor the names of its                *
+ *    contributors may be used to endorse or promote products derived from         *
+ *    this software without specific prior written permission.                     *
+ *                                                                                 *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"     *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE  *
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE    *
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL      *
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR      *
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER      *
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,   *
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE   *
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.            *
+ *                                                                                 *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef _integration_h_
+#define _integration_h_
+
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define INTEGRATION_USE_SSE2
+#endif
+
+//@brief: add a page of 16 bit values to 32 bit sums
+//@param sum: running sums to add to
+//@param page: values to add
+//@param count: number of values
+inline void accumulate(std::uint32_t * const sum, std::uint16_t const * const page, const size_t count) {
+	size_t i = 0;
+#ifdef INTEGRATION_USE_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	for(; i + 8 <= count; i += 8) {
+		const __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(page + i));
+		__m128i * const s = reinterpret_cast<__m128i*>(sum + i);
+		_mm_storeu_si128(s    , _mm_add_epi32(_mm_loadu_si128(s    ), _mm_unpacklo_epi16(v, zero)));
+		_mm_storeu_si128(s + 1, _mm_add_epi32(_mm_loadu_si128(s + 1), _mm_unpackhi_epi16(v, zero)));
+	}
+#endif
+	for(; i < count; i++) sum[i] += page[i];
+}
+
+//@brief: add 32 bit sums to 32 bit sums
+//@param sum: running sums to add to
+//@param add: values to add
+//@param count: number of values
+inline void accumulate(std::uint32_t * const sum, std::uint32_t const * const add, const size_t count) {
+	size_t i = 0;
+#ifdef INTEGRATION_USE_SSE2
+	for(; i + 4 <= count; i += 4) {
+		__m128i * const s = reinterpret_cast<__m128i*>(sum + i);
+		_mm_storeu_si128(s, _mm_add_epi32(_mm_loadu_si128(s), _mm_loadu_si128(reinterpret_cast<__m128i const*>(add + i))));
+	}
+#endif
+	for(; i < count; i++) sum[i] += add[i];
+}
+
+//@brief: convert sums of n 16 bit values to rounded (half up) means without per element division
+//@note: division is replaced by a shift when n is a power of 2 and by a multiply + shift otherwise
+//       since every sum is at most 65535 * n the multiplier can be chosen to give the exact quotient
+class RoundedMean {
+	std::uint32_t n;         //number of values in each sum
+	std::uint32_t half;      //n / 2 (rounding offset)
+	std::uint32_t multiplier;//0 for power of 2 / division
+	int shift;               //right shift after multiply (or only shift for powers of 2)
+	bool divide;             //true if n is too large for an exact 32 bit multiplier
+
+public:
+	//@param count: number of 16 bit values in each sum (at most 65537 so sums fit in 32 bits)
+	explicit RoundedMean(const std::uint32_t count) : n(count), half(count / 2), multiplier(0), shift(0), divide(false) {
+		if(0 == n) throw std::runtime_error("can't average 0 values");
+		if(n > 65537) throw std::runtime_error("sums of more than 65537 16 bit values may overflow 32 bits");
+		int l = 0;
+		while((std::uint64_t(1) << l) < n) ++l;//l = ceil(log2(n))
+		if(n == (std::uint32_t(1) << l)) {
+			shift = l;
+		} else if(l <= 14) {
+			//x < 2^16 * n and m = ceil(2^k / n) with k = 16 + 2l keeps the error term below 1/n (exact floor) with m < 2^32
+			shift = 16 + 2 * l;
+			multiplier = std::uint32_t(((std::uint64_t(1) << shift) + n - 1) / n);
+		} else {
+			divide = true;
+		}
+	}
+
+	//@brief: compute the rounded mean of a single sum
+	std::uint16_t operator()(const std::uint32_t sum) const {
+		const std::uint64_t x = std::uint64_t(sum) + half;
+		if(divide) return std::uint16_t(x / n);
+		if(0 == multiplier) return std::uint16_t(x >> shift);
+		return std::uint16_t((x * multiplier) >> shift);
+	}
+
+	//@brief: compute the rounded means of an array of sums
+	//@param sums: sums of n values (each at most 65535 * n)
+	//@param means: location to write means
+	//@param count: number of sums
+	void operator()(std::uint32_t const * const sums, std::uint16_t * const means, const size_t count) const {
+		size_t i = 0;
+#ifdef INTEGRATION_USE_SSE2
+		if(!divide) {
+			const __m128i vHalf = _mm_set1_epi32((int)half);
+			const __m128i vMult = _mm_set1_epi32((int)multiplier);
+			const __m128i vShift = _mm_cvtsi32_si128(shift);
+			const __m128i vBias = _mm_set1_epi32(32768);
+			const __m128i vFlip = _mm_set1_epi16((short)0x8000);
+			__m128i q[2];
+			for(; i + 8 <= count; i += 8) {
+				for(size_t j = 0; j < 2; j++) {
+					const __m128i x = _mm_add_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(sums + i + 4 * j)), vHalf);//rounding can't overflow since sums <= 65535 * n
+					if(0 == multiplier) {
+						q[j] = _mm_srl_epi32(x, vShift);
+					} else {
+						const __m128i q02 = _mm_srl_epi64(_mm_mul_epu32(x, vMult), vShift);//lanes 0 and 2
+						const __m128i q13 = _mm_srl_epi64(_mm_mul_epu32(_mm_srli_epi64(x, 32), vMult), vShift);//lanes 1 and 3
+						q[j] = _mm_or_si128(q02, _mm_slli_epi64(q13, 32));
+					}
+				}
+				//there is no unsigned 32 -> 16 bit pack in sse2, so shift to signed range, pack, and shift back
+				const __m128i packed = _mm_packs_epi32(_mm_sub_epi32(q[0], vBias), _mm_sub_epi32(q[1], vBias));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(means + i), _mm_xor_si128(packed, vFlip));
+			}
+		}
+#endif
+		for(; i < count; i++) means[i] = (*this)(sums[i]);
+	}
+};
+
+//@brief: add unrounded values to double sums
+//@param sum: running sums to add to
+//@param add: values to add
+//@param count: number of values
+template <typename T>
+inline void accumulate(double * const sum, T const * const add, const size_t count) {
+	for(size_t i = 0; i < count; i++) sum[i] += add[i];
+}
+
+//@brief: convert unrounded sums of n values to rounded (half up) means clamped to 16 bits
+//@param sums: sums of n values
+//@param means: location to write means
+//@param count: number of sums
+//@param n: number of values in each sum
+//@note: for sums that were never rounded (e.g. corrected pages summed as floats) so each mean is rounded exactly once
+template <typename T>
+inline void roundedMean(T const * const sums, std::uint16_t * const means, const size_t count, const double n) {
+	const double scale = 1.0 / n;
+	for(size_t i = 0; i < count; i++) means[i] = std::uint16_t(std::max(0.0, std::min(65535.0, std::floor(double(sums[i]) * scale + 0.5))));
+}
+
+#endif//_integration_h_
@@ -33,13 +33,109 @@
 
 #include <iostream>
 #include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <vector>
+#include <utility>
 
 #include "ExternalScan.h"
 
 static const float64 maxVoltage = 5.0; //hard coded limit on voltage amplitude to protect scan coils. For Tescan, this is 5.0. Use 4.6 to get same field of view as shown in UI.
 
+//@brief: pre-generate fftw wisdom for the alignment ffts of a list of frame sizes
+//@param argc: number of arguments (including subcommand)
+//@param argv: arguments, argv[0] is the subcommand
+//@return: exit code
+static int generateWisdom(int argc, char *argv[]) {
+	std::string wisdomFile = "fftw_wisdom.dat";
+	std::string effort = "patient";
+	char precision = 'f';
+	std::vector< std::pair<int, int> > sizes;
+
+	std::stringstream ss;
+	ss << "usage: wisdom [-W file] [-P effort] [-R precision] [width[xheight] ...]\n";
+	ss << "\t[-W]: wisdom file to update (defaults to " << wisdomFile << ")\n";
+	ss << "\t[-P]: fft planning effort, estimate, measure, patient, or exhaustive (defaults to " << effort << ")\n";
+	ss << "\t[-R]: fft precision, f (float, used for alignment), d (double), or l (long double) (defaults to " << precision << ")\n";
+	ss << "\t sizes: frame sizes to plan, height defaults to width (defaults to 256 512 1024 2048 4096)\n";
+
+	for (int i = 1; i < argc; i++) {
+		if ('-' == argv[i][0]) {
+			if (2 != strlen(argv[i]) || i + 1 == argc) throw std::runtime_error(ss.str() + "(bad option " + argv[i] + ")\n");
+			switch (argv[i][1]) {
+			case 'W': wisdomFile = std::string(argv[i + 1]); break;
+			case 'P': effort = std::string(argv[i + 1]); break;
+			case 'R': precision = argv[i + 1][0]; break;
+			default: throw std::runtime_error(ss.str() + "(unknown option " + argv[i] + ")\n");
+			}
+			++i;
+		} else {
+			int w = 0, h = 0;
+			const int n = sscanf(argv[i], "%dx%d", &w, &h);
+			if (n < 1 || w <= 0 || (2 == n && h <= 0)) throw std::runtime_error(ss.str() + "(bad size " + argv[i] + ")\n");
+			sizes.push_back(std::pair<int, int>(w, 2 == n ? h : w));
+		}
+	}
+	if (sizes.empty()) {
+		for (int w = 256; w <= 4096; w *= 2) sizes.push_back(std::pair<int, int>(w, w));
+	}
+	FFTWPlanner::effort() = FFTWPlanner::parseEffort(effort);
+
+	//planning a size also exports the accumulated wisdom
+	for (const std::pair<int, int>& size : sizes) {
+		std::cout << "planning " << size.first << "x" << size.second << std::endl;
+		switch (precision) {
+		case 'f': FFTWWisdom<float      >::file() = wisdomFile; planAlignment<float      >(size.second, size.first); break;
+		case 'd': FFTWWisdom<double     >::file() = wisdomFile; planAlignment<double     >(size.second, size.first); break;
+		case 'l': FFTWWisdom<long double>::file() = wisdomFile; planAlignment<long double>(size.second, size.first); break;
+		default: throw std::runtime_error(ss.str() + "(unknown precision " + precision + ")\n");
+		}
+	}
+	std::cout << "wrote wisdom to " << wisdomFile << std::endl;
+	return EXIT_SUCCESS;
+}
+
+//@brief: correct and integrate the raw pages saved by a previous acquisition again without using the DAQ
+//@param argc: number of arguments (including subcommand)
+//@param argv: arguments, argv[0] is the subcommand
+//@return: exit code
+static int reprocess(int argc, char *argv[]) {
+	std::string input, output;
+	ReprocessOptions options;
+
+	std::stringstream ss;
+	ss << "usage: reprocess [-o file] " << ReprocessOptions::synopsis() << " image\n";
+	ss << "\t image: averaged image of an acquisition saved with -v 0 (its _Frame_*_Line_*_RSs_noFFT stacks are read)\n";
+	ss << "\t[-o]: output image name (defaults to the input name with _reprocessed appended)\n";
+	ss << options.usage();
+
+	for (int i = 1; i < argc; i++) {
+		if ('-' == argv[i][0]) {
+			if (2 != strlen(argv[i]) || i + 1 == argc) throw std::runtime_error(ss.str() + "(bad option " + argv[i] + ")\n");
+			if ('o' == argv[i][1]) output = std::string(argv[i + 1]);
+			else if (!options.parse(argv[i][1], argv[i + 1])) throw std::runtime_error(ss.str() + "(unknown option " + argv[i] + ")\n");
+			++i;
+		} else {
+			if (!input.empty()) throw std::runtime_error(ss.str() + "(only one image can be reprocessed)\n");
+			input = argv[i];
+		}
+	}
+	if (input.empty()) throw std::runtime_error(ss.str() + "(image missing)\n");
+	if (output.empty()) output = insertSuffix(input, "_reprocessed");
+	options.apply(ss.str());
+
+	TifWriteQueue writer;
+	reprocessImage(input, output, options.params, writer);
+	writer.wait();
+	std::cout << "wrote " << output << std::endl;
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, char *argv[]) {
 	try {
+		if (argc > 1 && 0 == strcmp(argv[1], "wisdom")) return generateWisdom(argc - 1, argv + 1);
+		if (argc > 1 && 0 == strcmp(argv[1], "reprocess")) return reprocess(argc - 1, argv + 1);
+
 		//arguments
 		std::string xPath = "dev2/ao0";
 		std::string yPath = "dev2/ao1";
@@ -64,6 +160,17 @@ int main(int argc, char *argv[]) {
 		uInt64 nFrames = 1;				// frame integration.
 		uInt64 nLines = 1;				// line integration.
 		float64 maxShift = 20.0;		//maximum pixel shift to correct
+		float64 simRate = 0;			//sample rate for simulated acquisition (0 to use the DAQ)
+		uInt64 ringDepth = 16;			//rows buffered between the DAQ callback and processing
+		uInt64 rowProfile = 0;			//fft correction applies the mean row shift (0) or a smoothed per row shift profile (1)
+		uInt64 subpixel = 0;			//fft correction subpixel peak method (0 = kernel walk, 1 = parabolic, 2 = gaussian, 3 = local dft)
+		uInt64 frameRegistration = 0;	//frame registration before averaging (0 = none, 1 = translation, 2 = rotation / scale + translation)
+		uInt64 spectralSum = 0;			//fft correction rounds every corrected page (0) or sums each line group in the frequency domain and rounds once (1)
+		std::string wisdomFile;			//fftw wisdom file for alignment (empty to plan from scratch every run)
+		std::string fftEffort = "measure";	//fftw planning effort
+		std::string tifCompression = "none";	//compression of written tifs
+		uInt64 tileSize = 0;			//tif tile size (0 for strips)
+		uInt64 pyramidLevels = 0;		//reduced resolution copies stored with each tif page
 		// uInt64 autoLoop = 0;			//whether use this code to do an auto image test with iFast
 		// std::string output_raw;			// records the raw output name
 
@@ -71,7 +178,8 @@ int main(int argc, char *argv[]) {
 		std::stringstream ss;
 		ss << "usage: " + std::string(argv[0]) + " -x path -y path -e path -a voltage -b voltage -o file "
 			+ "[-s dwellSamples] [-w width] [-h height] [-r RasterSnake] [-t file] [-k voltage] [-i voltage] "
-			+ "[-f maxShift] [-v saveAverageOnly] [-n nFrames] [-l nLines] [-c correctTF]\n";
+			+ "[-f maxShift] [-v saveAverageOnly] [-n nFrames] [-l nLines] [-c correctTF] [-m simRate] [-q ringDepth] [-S subpixel] [-j perRowShift] [-F spectralSum] [-g registration] [-W wisdomFile] [-P fftEffort] [-z compression] [-T tileSize] [-L pyramidLevels]\n"
+			+ "       " + std::string(argv[0]) + " wisdom [-W file] [-P effort] [-R precision] [width[xheight] ...] (pre-generate fft wisdom)\n";
 		ss << "\t -x : path to X analog out channel (e.g. 'Dev0/ao0') (defaults to " << xPath << ")\n";
 		ss << "\t -y : path to Y analog out channel (defaults to " << yPath << ")\n";
 		ss << "\t -e : path to ETD analog in channel (defaults to " << ePath << ")\n";
@@ -92,6 +200,17 @@ int main(int argc, char *argv[]) {
 		ss << "\t[-l]: # of lines to integrate (defaults to " << nLines << ")\n";
 		// ss << "\t[-p]: autoLoop until stop signal (3000Hz) and auto fileName, default = " << autoLoop << ")\n";
 		ss << "\t[-c]: correct using FFT or not, default = " << correctTF << ")\n";
+		ss << "\t[-m]: simulate acquisition at this sample rate in Hz instead of using the DAQ (defaults to " << simRate << " = use DAQ)\n";
+		ss << "\t[-q]: # of acquired rows that can wait for processing (defaults to " << ringDepth << ")\n";
+		ss << "\t[-S]: subpixel peak method for correction, 0 = kernel walk, 1 = parabolic, 2 = gaussian, 3 = local dft (defaults to " << subpixel << ")\n";
+		ss << "\t[-j]: fft correction applies a smoothed shift to each row instead of the mean shift (for line jitter), default = " << rowProfile << ")\n";
+		ss << "\t[-F]: fft correction sums each line group's shifted pages before the inverse fft and rounds each output once, default = " << spectralSum << ")\n";
+		ss << "\t[-g]: register frames before averaging, 0 = none, 1 = translation, 2 = rotation / scale + translation (defaults to " << frameRegistration << ")\n";
+		ss << "\t[-W]: fftw wisdom file, loaded before and updated after planning (defaults to none)\n";
+		ss << "\t[-P]: fft planning effort, estimate, measure, patient, or exhaustive (defaults to " << fftEffort << ")\n";
+		ss << "\t[-z]: lossless tif compression, none, lzw, deflate, or zstd (defaults to " << tifCompression << ")\n";
+		ss << "\t[-T]: write tifs as square tiles of this size (multiple of 16), 0 = strips (defaults to " << tileSize << ")\n";
+		ss << "\t[-L]: # of half resolution copies stored with each tif page for previews (defaults to " << pyramidLevels << ")\n";
 
 		//parse arguments
 		for (int i = 1; i < argc; i++) {
@@ -129,6 +248,17 @@ int main(int argc, char *argv[]) {
 				case 'v': saveAverageOnly = atoi(argv[i + 1]); break;
 				case 'n': nFrames = atoi(argv[i + 1]); break;
 				case 'l': nLines = atoi(argv[i + 1]); break;				
+				case 'm': simRate = atof(argv[i + 1]); break;
+				case 'q': ringDepth = atoi(argv[i + 1]); break;
+				case 'S': subpixel = atoi(argv[i + 1]); break;
+				case 'j': rowProfile = atoi(argv[i + 1]); break;
+				case 'F': spectralSum = atoi(argv[i + 1]); break;
+				case 'g': frameRegistration = atoi(argv[i + 1]); break;
+				case 'W': wisdomFile = std::string(argv[i + 1]); break;
+				case 'P': fftEffort = std::string(argv[i + 1]); break;
+				case 'z': tifCompression = std::string(argv[i + 1]); break;
+				case 'T': tileSize = atoi(argv[i + 1]); break;
+				case 'L': pyramidLevels = atoi(argv[i + 1]); break;
 				// case 'p': autoLoop = atoi(argv[i + 1]); break;
 				}
 				if (requiresOption) ++i;//double increment if the next agrument isn't a flag
@@ -145,16 +275,40 @@ int main(int argc, char *argv[]) {
 		if (scanVoltageH > maxVoltage) throw std::runtime_error(ss.str() + "(scan amplitude is too large - passed " + std::to_string(scanVoltageH) + ", max " + std::to_string(maxVoltage) + ")\n");
 		if (scanVoltageV > maxVoltage) throw std::runtime_error(ss.str() + "(scan amplitude is too large - passed " + std::to_string(scanVoltageV) + ", max " + std::to_string(maxVoltage) + ")\n");
 		
+		if (frameRegistration > 2) throw std::runtime_error(ss.str() + "(registration must be 0, 1, or 2)\n");
+		if (subpixel > 3) throw std::runtime_error(ss.str() + "(subpixel method must be 0, 1, 2, or 3)\n");
+		FFTWWisdom<float>::file() = wisdomFile;
+		FFTWPlanner::effort() = FFTWPlanner::parseEffort(fftEffort);
+		Tif::options().compression = parseTifCompression(tifCompression);
+		Tif::options().tileSize = (std::uint32_t)tileSize;
+		Tif::options().levels = (std::uint32_t)pyramidLevels;
+		Tif::options().validate();
+
 		float64 maxDelayRatio = (maxVoltage-scanVoltageH) / scanVoltageH /2 * 4;	// see note for 'd1' in 'ExternalScan.h'
 		std::cout << "maxDelayRatio = " << maxDelayRatio << std::endl;
 		if (delayRatio > maxDelayRatio) throw std::runtime_error(ss.str() + "delay ratio is too large - passed " + std::to_string(delayRatio) + ", max " + std::to_string(maxDelayRatio) + ")\n");
+		//create simulated device if needed (synthetic speckle reference covering the full scan range)
+		std::unique_ptr<AcquisitionDevice> device;
+		if (simRate > 0) {
+			SimulationParameters params;
+			params.sampleRate = simRate;
+			const uInt64 refSize = std::max(width, height) * 2;
+			device.reset(new SimulatedDevice(SimulatedDevice::SyntheticReference(refSize, refSize), refSize, refSize, params));
+		}
+
 		//create scan opject
-		ExternalScan scan(xPath, yPath, ePath, dwellSamples, scanVoltageH, scanVoltageV, width, height, snake, vBlack, vWhite, nLines, nFrames, delayRatio);
+		ExternalScan scan(xPath, yPath, ePath, dwellSamples, scanVoltageH, scanVoltageV, width, height, snake, vBlack, vWhite, nLines, nFrames, delayRatio, std::move(device));
+		scan.setRingDepth((size_t)ringDepth);
+		scan.setRowShiftProfile(0 == rowProfile ? ShiftProfile::Uniform : ShiftProfile::PerRow);
+		scan.setSubpixelMethod(subpixelMethod((size_t)subpixel));
+		scan.setSpectralSum(0 != spectralSum);
+		scan.setFrameRegistration(0 == frameRegistration ? RegistrationMode::None : (1 == frameRegistration ? RegistrationMode::Translation : RegistrationMode::Similarity));
 
 		//execute scan and write image
 		std::time_t start = std::time(NULL);
 		scan.execute(output, saveAverageOnly, maxShift, correctTF);
 		std::time_t end = std::time(NULL);
+		scan.waitForWrites();
 
 		//append time stamps to log if needed
 		if (!timeLog.empty()){
@@ -0,0 +1,191 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                                 *
+ * Copyright (c) 2017, Reagents of the University of California                    *
+ * All rights reserved.                                                            *
+ *                                                                                 *
+ * Redistribution and use in source and binary forms, with or without              *
+ * modification, are permitted provided that the following conditions are met:     *
+ *                                                                                 *
+ * 1. Redistributions of source code must retain the above copyright notice, this  *
+ *    list of conditions and the following disclaimer.                             *
+ *                                                                                 *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,    *
+ *    this list of conditions and the following disclaimer in the documentation    *
+ *    and/or other materials provided with the distribution.                       *
+ *                                                                                 *
+ * 3. Neither the name of the copyright holder nor the names of its                *
+ *    contributors may be used to endorse or promote products derived from         *
+ *    this software without specific prior written permission.                     *
+ *                                                                                 *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"     *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE  *
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE    *
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL      *
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR      *
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER      *
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,   *
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE   *
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.            *
+ *                                                                                 *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef _planes_h_
+#define _planes_h_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define PLANES_USE_SSE2
+#endif
+
+//@brief: 64 byte (cache line) aligned array of trivial types, contents are uninitialized
+template <typename T>
+class AlignedBuffer {
+	std::unique_ptr<char[]> raw;//underlying allocation
+	T* ptr;                     //aligned start of data
+	size_t count;               //number of elements
+
+public:
+	static const size_t Alignment = 64;
+
+	AlignedBuffer() : ptr(NULL), count(0) {}
+	explicit AlignedBuffer(const size_t n) : ptr(NULL), count(0) {allocate(n);}
+
+	//@brief: resize the buffer, memory is only reallocated if the size changes
+	//@param n: number of elements
+	void allocate(const size_t n) {
+		if(n == count) return;
+		raw.reset(new char[n * sizeof(T) + Alignment - 1]);
+		const std::uintptr_t address = reinterpret_cast<std::uintptr_t>(raw.get());
+		ptr = reinterpret_cast<T*>((address + Alignment - 1) & ~std::uintptr_t(Alignment - 1));
+		count = n;
+	}
+
+	T* data() {return ptr;}
+	T const * data() const {return ptr;}
+	size_t size() const {return count;}
+	T& operator[](const size_t i) {return ptr[i];}
+	const T& operator[](const size_t i) const {return ptr[i];}
+};
+
+//@brief: single contiguous allocation of equally sized 2d planes, each row starts on a 64 byte boundary
+template <typename T>
+class PlaneStore {
+	size_t nPlanes, nRows, nCols;//dimensions
+	size_t stride;               //elements between the start of subsequent rows
+	AlignedBuffer<T> buff;       //plane data
+
+public:
+	PlaneStore() : nPlanes(0), nRows(0), nCols(0), stride(0) {}
+
+	//@brief: set dimensions, memory is only reallocated if the total size changes
+	//@param planes: number of planes
+	//@param rows: rows per plane
+	//@param cols: columns per row
+	void assign(const size_t planes, const size_t rows, const size_t cols) {
+		const size_t rowAlign = AlignedBuffer<T>::Alignment / sizeof(T);
+		nPlanes = planes;
+		nRows = rows;
+		nCols = cols;
+		stride = (cols + rowAlign - 1) / rowAlign * rowAlign;
+		buff.allocate(planes * rows * stride);
+	}
+
+	size_t planes() const {return nPlanes;}
+	size_t rows() const {return nRows;}
+	size_t cols() const {return nCols;}
+
+	T* row(const size_t plane, const size_t r) {return buff.data() + (plane * nRows + r) * stride;}
+	T const * row(const size_t plane, const size_t r) const {return buff.data() + (plane * nRows + r) * stride;}
+};
+
+namespace detail {
+	//@brief: split interleaved samples into planes with plain loops
+	template <typename T>
+	void deinterleaveScalar(T const * src, T * const * const dst, const size_t n, const size_t begin, const size_t end) {
+		src += begin * n;
+		for(size_t c = begin; c < end; c++) {
+			for(size_t i = 0; i < n; i++) dst[i][c] = *src++;
+		}
+	}
+
+#ifdef PLANES_USE_SSE2
+	//@brief: gather the even/odd 16 bit elements of two vectors
+	inline __m128i evens16(const __m128i a, const __m128i b) {return _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16), _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));}
+	inline __m128i odds16 (const __m128i a, const __m128i b) {return _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));}
+
+	//@brief: transpose N vectors of 8 pixels x N interleaved samples into N vectors of 8 pixels (one per sample) by repeated unzipping
+	template <size_t N>
+	struct Unzip16 {
+		static void apply(__m128i * const v) {
+			__m128i e[N/2], o[N/2];
+			for(size_t i = 0; i < N/2; i++) {
+				e[i] = evens16(v[2*i], v[2*i+1]);
+				o[i] = odds16 (v[2*i], v[2*i+1]);
+			}
+			Unzip16<N/2>::apply(e);//e now holds samples 0, 2, 4, ...
+			Unzip16<N/2>::apply(o);//o now holds samples 1, 3, 5, ...
+			for(size_t i = 0; i < N/2; i++) {
+				v[2*i  ] = e[i];
+				v[2*i+1] = o[i];
+			}
+		}
+	};
+	template <> struct Unzip16<1> {static void apply(__m128i * const) {}};
+
+	//@brief: split interleaved 16 bit samples into N planes, 8 pixels at a time
+	//@param stream: true to use non-temporal stores (all destinations must be 16 byte aligned)
+	template <size_t N>
+	void deinterleave16(std::int16_t const * const src, std::int16_t * const * const dst, const size_t cols, const bool stream) {
+		const size_t blocks = cols / 8;
+		__m128i v[N];
+		for(size_t b = 0; b < blocks; b++) {
+			__m128i const * const p = reinterpret_cast<__m128i const*>(src + b * 8 * N);
+			for(size_t i = 0; i < N; i++) v[i] = _mm_loadu_si128(p + i);
+			Unzip16<N>::apply(v);
+			if(stream) {
+				for(size_t i = 0; i < N; i++) _mm_stream_si128(reinterpret_cast<__m128i*>(dst[i] + b * 8), v[i]);
+			} else {
+				for(size_t i = 0; i < N; i++) _mm_storeu_si128(reinterpret_cast<__m128i*>(dst[i] + b * 8), v[i]);
+			}
+		}
+		if(stream) _mm_sfence();//make non-temporal stores visible before returning
+		deinterleaveScalar(src, dst, N, blocks * 8, cols);
+	}
+#endif
+}
+
+//@brief: split interleaved samples into separate rows, src[c * n + i] -> dst[i][c]
+//@param src: interleaved samples (cols * n)
+//@param dst: n destination rows of cols elements
+//@param n: number of interleaved samples per column
+//@param cols: number of columns
+//@param stream: true to bypass the cache when writing (use when dst won't be read again soon)
+template <typename T>
+void deinterleave(T const * const src, T * const * const dst, const size_t n, const size_t cols, const bool stream = false) {
+	if(1 == n) std::memcpy(dst[0], src, cols * sizeof(T));
+	else detail::deinterleaveScalar(src, dst, n, 0, cols);
+}
+
+#ifdef PLANES_USE_SSE2
+inline void deinterleave(std::int16_t const * const src, std::int16_t * const * const dst, const size_t n, const size_t cols, const bool stream = false) {
+	//streaming stores require 16 byte aligned rows
+	bool aligned = stream;
+	for(size_t i = 0; i < n && aligned; i++) aligned = 0 == reinterpret_cast<std::uintptr_t>(dst[i]) % 16;
+	switch(n) {
+		case  1: std::memcpy(dst[0], src, cols * sizeof(std::int16_t)); break;
+		case  2: detail::deinterleave16< 2>(src, dst, cols, aligned); break;
+		case  4: detail::deinterleave16< 4>(src, dst, cols, aligned); break;
+		case  8: detail::deinterleave16< 8>(src, dst, cols, aligned); break;
+		case 16: detail::deinterleave16<16>(src, dst, cols, aligned); break;
+		default: detail::deinterleaveScalar(src, dst, n, 0, cols);
+	}
+}
+#endif
+
+#endif//_planes_h_
@@ -0,0 +1,374 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                                 *
+ * Copyright (c) 2017, Reagents of the University of California                    *
+ * All rights reserved.                                                            *
+ *                                                                                 *
+ * Redistribution and use in source and binary forms, with or without              *
+ * modification, are permitted provided that the following conditions are met:     *
+ *                                                                                 *
+ * 1. Redistributions of source code must retain the above copyright notice, this  *
+ *    list of conditions and the following disclaimer.                             *
+ *                                                                                 *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,    *
+ *    this list of conditions and the following disclaimer in the documentation    *
+ *    and/or other materials provided with the distribution.                       *
+ *                                                                                 *
+ * 3. Neither the name of the copyright holder nor the names of its                *
+ *    contributors may be used to endorse or promote products derived from         *
+ *    this software without specific prior written permission.                     *
+ *                                                                                 *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"     *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE  *
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE    *
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL      *
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR      *
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER      *
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,   *
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE   *
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.            *
+ *                                                                                 *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#ifndef _postprocess_h_
+#define _postprocess_h_
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <functional>
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <sstream>
+#include <cstdlib>
+
+#include "tif.hpp"
+#include "alignment.hpp"
+#include "registration.hpp"
+#include "integration.hpp"
+
+//@brief: how the pages of an image are corrected and combined
+struct IntegrationParams {
+	std::uint32_t width, height;   //page size
+	size_t nFrames;                //number of frames integrated
+	size_t nLines;                 //number of line integrations in each frame
+	size_t pagesPerLine;           //pages in each line group (scan directions x dwell samples)
+	bool saveAverageOnly;          //true to only write the averaged image
+	bool correct;                  //true to align the rows of each page before integration
+	double maxShift;               //maximum row shift in pixels for correction
+	int upsample;                  //subpixel upsampling factor for correction
+	SubpixelMethod subpixel;       //how the subpixel peak of each row's cross correlation is found
+	ShiftProfile profile;          //how row shifts found by correction are applied
+	RegistrationMode registration; //frame drift correction applied before frames are averaged
+	bool spectralSum;              //true to sum corrected pages in the frequency domain and round each output pixel once (instead of rounding every corrected page)
+	bool verbose;                  //true to print correction / registration results
+
+	IntegrationParams() : width(0), height(0), nFrames(1), nLines(1), pagesPerLine(1), saveAverageOnly(true), correct(false), maxShift(20.0), upsample(16), subpixel(SubpixelMethod::KernelWalk), profile(ShiftProfile::Uniform), registration(RegistrationMode::None), spectralSum(false), verbose(true) {}
+};
+
+//@brief: insert text before the extension of a file name (e.g. data.v2/image.tif -> data.v2/image_Frames.tif)
+//@param fileName: file name
+//@param suffix: text to insert
+//@return: modified name
+inline std::string insertSuffix(std::string fileName, const std::string& suffix) {
+	const size_t slash = fileName.find_last_of("/\\");
+	const size_t dot = fileName.find('.', std::string::npos == slash ? 0 : slash + 1);
+	fileName.insert(std::string::npos == dot ? fileName.size() : dot, suffix);
+	return fileName;
+}
+
+//@brief: estimate the peak memory held by integrateImage (excluding fft work buffers)
+//@param p: integration parameters
+//@return: bytes for one line group of pages, the lines of one frame, every frame, and the 32 bit sums
+inline std::uint64_t integrationBytes(const IntegrationParams& p) {
+	const std::uint64_t nPixels = std::uint64_t(p.width) * p.height;
+	const bool registering = RegistrationMode::None != p.registration && p.nFrames > 1;
+	const std::uint64_t sumBytes = p.correct && p.spectralSum ? sizeof(double) : sizeof(std::uint32_t);
+	std::uint64_t bytes = nPixels * (sizeof(std::uint16_t) * (p.pagesPerLine + p.nLines + p.nFrames + 1) + sumBytes * 3);
+	if (registering) bytes += nPixels * sumBytes * p.nFrames;
+	return bytes;
+}
+
+//@brief: source for the pages of a line group
+//@param frame: frame index
+//@param line: line integration index
+//@param pages: location to write pages (pagesPerLine pages of width x height, may be moved from)
+typedef std::function<void(size_t frame, size_t line, std::vector<std::vector<std::uint16_t> >& pages)> LinePageSource;
+
+//@brief: destination for the pages of a line group once they have been integrated (e.g. to keep their memory for the next image)
+//@param frame: frame index
+//@param line: line integration index
+//@param pages: pages passed to the LinePageSource (contents may have been corrected in place, may be moved from)
+typedef std::function<void(size_t frame, size_t line, std::vector<std::vector<std::uint16_t> >& pages)> LinePageRelease;
+
+//@brief: correct and integrate every page of an image, register frames, and queue the _LinesInFrame_, _Frames, and averaged tifs
+//@param p: integration parameters
+//@param source: function to get the pages of each line group (called once per group in frame / line order)
+//@param writer: queue to write images with
+//@param fileName: name of averaged image (other images are named from it)
+//@param release: function to hand back the pages of each line group once they are integrated (or empty to free them)
+inline void integrateImage(const IntegrationParams& p, const LinePageSource& source, TifWriteQueue& writer, const std::string& fileName, const LinePageRelease& release = LinePageRelease()) {
+	// every level of integration is a rounded mean of the sum of the underlying samples (rather than a mean of truncated means)
+	// if a sum could overflow 32 bits the sum of the previous level's means is used instead
+	// when corrected pages are summed in the frequency domain they are never rounded, so the sums are kept as doubles
+	const size_t nPixels = size_t(p.width) * p.height;
+	const bool summed = p.correct && p.spectralSum;
+	const std::uint64_t samplesPerLine = p.pagesPerLine;
+	const std::uint64_t samplesPerFrame = p.nLines * samplesPerLine;
+	const std::uint64_t samplesPerPixel = p.nFrames * samplesPerFrame;
+	const bool registering = RegistrationMode::None != p.registration && p.nFrames > 1;
+	const bool exactFrame = samplesPerFrame <= 65537, exactTotal = samplesPerPixel <= 65537;
+	const RoundedMean lineMean((std::uint32_t)samplesPerLine);
+	const RoundedMean frameMean((std::uint32_t)(exactFrame ? samplesPerFrame : p.nLines));
+	const RoundedMean totalMean((std::uint32_t)(exactTotal ? samplesPerPixel : p.nFrames));
+	std::vector<std::uint32_t> lineSum(nPixels), frameSumF(nPixels), totalSum(nPixels, 0);
+	std::vector<std::vector<std::uint16_t> > frameImagesF(p.nFrames, std::vector<std::uint16_t>(nPixels));	// has nFrame pages
+	std::vector<std::uint16_t> frameImagesA(nPixels);	// one page holding the average value
+	std::vector<std::vector<std::uint32_t> > frameSums(registering && exactTotal && !summed ? p.nFrames : 0);	// each frame's sums, held until the frames are registered
+	std::vector<float> lineSumS(summed ? nPixels : 0);	// unrounded sum of a corrected line group
+	std::vector<double> frameSumS(summed ? nPixels : 0), totalSumS(summed ? nPixels : 0, 0.0);	// unrounded frame and total sums
+	std::vector<std::vector<double> > frameSumsS(registering && summed ? p.nFrames : 0);	// each frame's unrounded sums, held until the frames are registered
+	for (size_t iFrameInt = 0; iFrameInt < p.nFrames; ++iFrameInt){
+		// need to apply average between these lineInts.  Backward scan already reversed and repositioned, so it's the same line integration.
+		std::vector< std::vector<std::uint16_t> > frameImagesL(p.nLines, std::vector<std::uint16_t>(nPixels));	// temp for all the lineInt images under this frame
+		std::fill(frameSumF.begin(), frameSumF.end(), 0);
+		std::fill(frameSumS.begin(), frameSumS.end(), 0.0);
+
+		for (size_t iLineInt = 0; iLineInt < p.nLines; ++iLineInt){
+			// get the pages of this line group (nRS = either 1 or 2), they aren't needed after this
+			std::vector<std::vector<std::uint16_t> > tempV(p.pagesPerLine);
+			source(iFrameInt, iLineInt, tempV);
+
+			// apply shift correction
+			if (p.correct){
+				const std::chrono::steady_clock::time_point alignStart = std::chrono::steady_clock::now();
+				const std::vector<AlignResult<float> > results = correlateRows<float>(tempV, p.height, p.width, false, p.maxShift, p.upsample, p.subpixel, p.profile, NULL, summed ? &lineSumS : NULL);	// Backward scan reversed, so this is always raster.
+				const double alignTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - alignStart).count();
+
+				// log correction quality and cost for this line group
+				if (p.verbose) {
+					size_t steps = 0, aligned = 0;
+					double correlation = 0, lowShift = 0, highShift = 0;
+					for (const AlignResult<float>& r : results) {
+						steps += r.steps;
+						if (AlignStatus::Aligned != r.status && AlignStatus::Partial != r.status) continue;
+						correlation += r.correlation;
+						lowShift = 0 == aligned ? r.shift : std::min<double>(lowShift, r.shift);
+						highShift = 0 == aligned ? r.shift : std::max<double>(highShift, r.shift);
+						++aligned;
+					}
+					std::cout << "frame " << iFrameInt << " line " << iLineInt << " alignment: " << alignTime * 1000.0 << " ms, " << steps << " search steps";
+					if (aligned > 0) std::cout << ", shifts " << lowShift << " to " << highShift << " pixels, mean correlation " << correlation / aligned;
+					std::cout << '\n';
+					for (size_t iPage = 0; iPage < results.size(); ++iPage) {
+						const AlignResult<float>& r = results[iPage];
+						if (AlignStatus::Partial == r.status) std::cout << "\tpage " << iPage << ": " << r.failedRows << " of " << p.height << " rows didn't find a peak within " << p.maxShift << " pixels (used nearest good row)\n";
+						if (AlignStatus::Failed == r.status) std::cout << "\tpage " << iPage << ": no row found a peak within " << p.maxShift << " pixels (not corrected)\n";
+					}
+				}
+			}
+
+			// average and assign to frameImagesL,
+			if (summed) {
+				roundedMean(lineSumS.data(), frameImagesL[iLineInt].data(), nPixels, double(samplesPerLine));
+				accumulate(frameSumS.data(), lineSumS.data(), nPixels);
+			} else {
+				std::fill(lineSum.begin(), lineSum.end(), 0);
+				for (size_t ii = 0; ii < p.pagesPerLine; ++ii) accumulate(lineSum.data(), tempV[ii].data(), nPixels);
+				lineMean(lineSum.data(), frameImagesL[iLineInt].data(), nPixels);
+				if (exactFrame) accumulate(frameSumF.data(), lineSum.data(), nPixels);
+				else accumulate(frameSumF.data(), frameImagesL[iLineInt].data(), nPixels);
+			}
+			if (release) release(iFrameInt, iLineInt, tempV);
+		}
+
+		if (summed) {
+			roundedMean(frameSumS.data(), frameImagesF[iFrameInt].data(), nPixels, double(samplesPerFrame));
+			if (registering) frameSumsS[iFrameInt] = frameSumS;
+			else accumulate(totalSumS.data(), frameSumS.data(), nPixels);
+		} else {
+			frameMean(frameSumF.data(), frameImagesF[iFrameInt].data(), nPixels);
+			if (registering) {
+				if (exactTotal) frameSums[iFrameInt] = frameSumF;
+			} else if (exactTotal) accumulate(totalSum.data(), frameSumF.data(), nPixels);
+			else accumulate(totalSum.data(), frameImagesF[iFrameInt].data(), nPixels);
+		}
+
+		if (!p.saveAverageOnly) {
+			writer.write(std::move(frameImagesL), p.width, p.height, insertSuffix(fileName, "_LinesInFrame_" + std::to_string(iFrameInt)));
+		}
+	}
+
+	// register every frame to the first and resample it to remove the drift before it is added to the average
+	if (registering) {
+		const std::vector<FrameDrift> drifts = registerFrames<float>(frameImagesF, (int)p.height, (int)p.width, p.registration);
+		for (size_t iFrameInt = 0; iFrameInt < p.nFrames && p.verbose; ++iFrameInt) {
+			const FrameDrift& d = drifts[iFrameInt];
+			std::cout << "frame " << iFrameInt << " drift: (" << d.dx << ", " << d.dy << ") pixels";
+			if (RegistrationMode::Similarity == p.registration) std::cout << ", " << d.angle * 57.295779513082320876798154814105 << " degrees, scale " << d.scale;
+			std::cout << " (correlation " << d.peak << ")\n";
+		}
+		ThreadPool::Shared().parallelFor(0, p.nFrames, [&](const size_t iFrameInt) {
+			std::vector<std::uint16_t> warped(nPixels);
+			warpFrame(frameImagesF[iFrameInt].data(), warped.data(), (int)p.height, (int)p.width, drifts[iFrameInt]);
+			frameImagesF[iFrameInt].swap(warped);
+			if (summed) {
+				std::vector<double> warpedSum(nPixels);
+				warpFrame(frameSumsS[iFrameInt].data(), warpedSum.data(), (int)p.height, (int)p.width, drifts[iFrameInt]);
+				frameSumsS[iFrameInt].swap(warpedSum);
+			} else if (exactTotal) {
+				std::vector<std::uint32_t> warpedSum(nPixels);
+				warpFrame(frameSums[iFrameInt].data(), warpedSum.data(), (int)p.height, (int)p.width, drifts[iFrameInt]);
+				frameSums[iFrameInt].swap(warpedSum);
+			}
+		});
+		for (size_t iFrameInt = 0; iFrameInt < p.nFrames; ++iFrameInt) {
+			if (summed) accumulate(totalSumS.data(), frameSumsS[iFrameInt].data(), nPixels);
+			else if (exactTotal) accumulate(totalSum.data(), frameSums[iFrameInt].data(), nPixels);
+			else accumulate(totalSum.data(), frameImagesF[iFrameInt].data(), nPixels);
+		}
+	}
+
+	// average frames into frameImagesA
+	if (summed) roundedMean(totalSumS.data(), frameImagesA.data(), nPixels, double(samplesPerPixel));
+	else totalMean(totalSum.data(), frameImagesA.data(), nPixels);
+
+	const std::string fileNameS = insertSuffix(fileName, "_Frames");	//make a new file name for the stacked image
+
+	// finished images are handed to the writer so the next image can start while they are written
+	if (!p.saveAverageOnly) writer.write(std::move(frameImagesF), p.width, p.height, fileNameS);
+	writer.write(std::move(frameImagesA), p.width, p.height, fileName);
+
+}
+
+//@brief: get the name of the raw page stack saved for a line group
+//@param fileName: name of averaged image
+//@param frame: frame index
+//@param line: line integration index
+//@return: stack name (e.g. image_Frame_0_Line_1_RSs_noFFT.tif)
+inline std::string rawStackName(const std::string& fileName, const size_t frame, const size_t line) {
+	return insertSuffix(fileName, "_Frame_" + std::to_string(frame) + "_Line_" + std::to_string(line) + "_RSs_noFFT");
+}
+
+//@brief: find the raw page stacks saved by an acquisition and fill in the image dimensions
+//@param fileName: name of averaged image of the acquisition
+//@param p: parameters to fill in (width, height, nFrames, nLines, pagesPerLine)
+inline void findRawStacks(const std::string& fileName, IntegrationParams& p) {
+	p.nFrames = 0;
+	while (std::ifstream(rawStackName(fileName, p.nFrames, 0)).good()) ++p.nFrames;
+	p.nLines = 0;
+	while (std::ifstream(rawStackName(fileName, 0, p.nLines)).good()) ++p.nLines;
+	if (0 == p.nFrames) throw std::runtime_error("no raw pages found for " + fileName + " (expected " + rawStackName(fileName, 0, 0) + ", acquired without -v 0?)");
+	const TifReader first(rawStackName(fileName, 0, 0));
+	p.width = first.page(0).width;
+	p.height = first.page(0).height;
+	p.pagesPerLine = first.pages();
+}
+
+//@brief: correct and integrate the raw pages saved by a previous acquisition again (e.g. with different correction settings)
+//@param input: name of averaged image of the acquisition (raw stacks are found from it)
+//@param output: name of new averaged image (other images are named from it)
+//@param p: correction and integration parameters, image dimensions are filled in from the raw stacks
+//@param writer: queue to write images with
+inline void reprocessImage(const std::string& input, const std::string& output, IntegrationParams p, TifWriteQueue& writer) {
+	findRawStacks(input, p);
+	if (p.verbose) std::cout << "reprocessing " << p.nFrames << " frame(s) x " << p.nLines << " line(s) x " << p.pagesPerLine << " page(s) of " << p.width << "x" << p.height << '\n';
+	integrateImage(p, [&](const size_t frame, const size_t line, std::vector<std::vector<std::uint16_t> >& pages) {
+		const std::string name = rawStackName(input, frame, line);
+		const TifReader stack(name);
+		if (stack.pages() != pages.size()) throw std::runtime_error(name + " doesn't have " + std::to_string(pages.size()) + " pages");
+		for (size_t i = 0; i < pages.size(); ++i) {
+			const TifReader::Page& page = stack.page(i);
+			if (page.width != p.width || page.height != p.height) throw std::runtime_error(name + " has a page with the wrong size");
+			if (stack.viewable(i)) {//copy straight out of the mapping (correction modifies pages in place)
+				std::uint16_t const * const view = stack.view<std::uint16_t>(i);
+				pages[i].assign(view, view + size_t(p.width) * p.height);
+			} else {
+				pages[i] = stack.read<std::uint16_t>(i);
+			}
+		}
+	}, writer, output);
+}
+
+//@brief: command line options shared by the reprocessing front ends (the reprocess subcommand and Reprocess)
+struct ReprocessOptions {
+	IntegrationParams params;                    //correction and integration parameters
+	size_t rowProfile, frameRegistration, subpixel;//enum options as passed on the command line
+	std::string wisdomFile, fftEffort, tifCompression;
+	size_t tileSize, pyramidLevels;
+
+	ReprocessOptions() : rowProfile(0), frameRegistration(0), subpixel(0), fftEffort("measure"), tifCompression("none"), tileSize(0), pyramidLevels(0) {
+		params.correct = true;
+	}
+
+	//@brief: get the usage synopsis of the shared options
+	static std::string synopsis() {
+		return "[-c correctTF] [-f maxShift] [-u upsample] [-S subpixel] [-j perRowShift] [-F spectralSum] [-g registration] [-v saveAverageOnly] [-W wisdomFile] [-P fftEffort] [-z compression] [-T tileSize] [-L pyramidLevels]";
+	}
+
+	//@brief: get the help text of the shared options (one line per option, showing the current values as defaults)
+	std::string usage() const {
+		std::stringstream ss;
+		ss << "\t[-c]: correct using FFT or not (defaults to " << params.correct << ")\n";
+		ss << "\t[-f]: max number of pixels to shift (defaults to " << params.maxShift << ")\n";
+		ss << "\t[-u]: subpixel upsampling factor for correction (defaults to " << params.upsample << ")\n";
+		ss << "\t[-S]: subpixel peak method for correction, 0 = kernel walk, 1 = parabolic, 2 = gaussian, 3 = local dft (defaults to " << subpixel << ")\n";
+		ss << "\t[-j]: fft correction applies a smoothed shift to each row instead of the mean shift (defaults to " << rowProfile << ")\n";
+		ss << "\t[-F]: fft correction sums each line group's shifted pages before the inverse fft and rounds each output once (defaults to " << params.spectralSum << ")\n";
+		ss << "\t[-g]: register frames before averaging, 0 = none, 1 = translation, 2 = rotation / scale + translation (defaults to " << frameRegistration << ")\n";
+		ss << "\t[-v]: save averaged image only (defaults to " << params.saveAverageOnly << ")\n";
+		ss << "\t[-W]: fftw wisdom file, loaded before and updated after planning (defaults to none)\n";
+		ss << "\t[-P]: fft planning effort, estimate, measure, patient, or exhaustive (defaults to " << fftEffort << ")\n";
+		ss << "\t[-z]: lossless tif compression, none, lzw, deflate, or zstd (defaults to " << tifCompression << ")\n";
+		ss << "\t[-T]: write tifs as square tiles of this size (multiple of 16), 0 = strips (defaults to " << tileSize << ")\n";
+		ss << "\t[-L]: # of half resolution copies stored with each tif page for previews (defaults to " << pyramidLevels << ")\n";
+		return ss.str();
+	}
+
+	//@brief: parse a shared option
+	//@param opt: option letter
+	//@param value: option argument
+	//@return: true if opt is a shared option, false if the caller should handle it
+	bool parse(const char opt, const char* value) {
+		switch (opt) {
+		case 'c': params.correct = 0 != atoi(value); break;
+		case 'f': params.maxShift = atof(value); break;
+		case 'u': params.upsample = atoi(value); break;
+		case 'S': subpixel = atoi(value); break;
+		case 'j': rowProfile = atoi(value); break;
+		case 'F': params.spectralSum = 0 != atoi(value); break;
+		case 'g': frameRegistration = atoi(value); break;
+		case 'v': params.saveAverageOnly = 0 != atoi(value); break;
+		case 'W': wisdomFile = std::string(value); break;
+		case 'P': fftEffort = std::string(value); break;
+		case 'z': tifCompression = std::string(value); break;
+		case 'T': tileSize = atoi(value); break;
+		case 'L': pyramidLevels = atoi(value); break;
+		default: return false;
+		}
+		return true;
+	}
+
+	//@brief: check the parsed options, convert the enum options into params, and set the global fftw / tif options
+	//@param usage: text to start error messages with
+	void apply(const std::string& usage) {
+		if (params.upsample < 1) throw std::runtime_error(usage + "(upsample must be at least 1)\n");
+		if (frameRegistration > 2) throw std::runtime_error(usage + "(registration must be 0, 1, or 2)\n");
+		if (subpixel > 3) throw std::runtime_error(usage + "(subpixel method must be 0, 1, 2, or 3)\n");
+		params.profile = 0 == rowProfile ? ShiftProfile::Uniform : ShiftProfile::PerRow;
+		params.subpixel = subpixelMethod(subpixel);
+		params.registration = 0 == frameRegistration ? RegistrationMode::None : (1 == frameRegistration ? RegistrationMode::Translation : RegistrationMode::Similarity);
+		FFTWWisdom<float>::file() = wisdomFile;
+		FFTWPlanner::effort() = FFTWPlanner::parseEffort(fftEffort);
+		Tif::options().compression = parseTifCompression(tifCompression);
+		Tif::options().tileSize = (std::uint32_t)tileSize;
+		Tif::options().levels = (std::uint32_t)pyramidLevels;
+		Tif::options().validate();
+	}
+};
+
+#endif//_postprocess_h_
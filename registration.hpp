@@ -0,0 +1,448 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                                 *
+ * Copyright (c) 2017, Reagents of the University of California                    *
+ * All rights reserved.                                                            *
+ *                                                                                 *
+ * Redistribution and use in source and binary forms, with or without              *
+ * modification, are permitted provided that the following conditions are met:     *
+ *                                                                                 *
+ * 1. Redistributions of source code must retain the above copyright notice, this  *
+ *    list of conditions and the following disclaimer.                             *
+ *                                                                                 *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,    *
+ *    this list of conditions and the following disclaimer in the documentation    *
+ *    and/or other materials provided with the distribution.                       *
+ *                                                                                 *
+ * 3. Neither the name of the copyright holder nor the names of its                *
+ *    contributors may be used to endorse or promote products derived from         *
+ *    this software without specific prior written permission.                     *
+ *                                                                                 *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"     *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE  *
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE    *
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL      *
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR      *
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER      *
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,   *
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE   *
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.            *
+ *                                                                                 *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#ifndef _registration_h_
+#define _registration_h_
+
+#include <cmath>
+#include <complex>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <type_traits>
+
+#include "alignment.hpp"
+#include "threadpool.hpp"
+
+//@brief: frame to frame registration model
+enum class RegistrationMode {
+	None,       //frames are averaged as acquired
+	Translation,//2d sub pixel translation
+	Similarity  //rotation and scale about the frame center (from the log-polar magnitude spectrum) followed by translation
+};
+
+//@brief: drift of a frame relative to the reference frame
+//@note: the frame content at reference pixel p is at c + scale * R(angle) * (p - c) + (dx, dy) where c is the frame center and R(angle) rotates from x towards y
+struct FrameDrift {
+	double dx, dy;//translation in pixels
+	double angle; //rotation in radians
+	double scale; //magnification
+	double peak;  //normalized phase correlation peak (1 for identical frames, ~0 if nothing matched)
+
+	FrameDrift() : dx(0), dy(0), angle(0), scale(1), peak(1) {}
+};
+
+//@brief: resample a frame to undo a drift (bilinear interpolation, samples outside the frame are clamped to the nearest edge)
+//@param src: frame to correct (rows x cols)
+//@param dst: location to write corrected frame (rows x cols), must not overlap src
+//@param rows: frame height
+//@param cols: frame width
+//@param drift: drift of src relative to the reference frame
+template <typename T, typename U>
+void warpFrame(T const * const src, U * const dst, const int rows, const int cols, const FrameDrift& drift) {
+	const double cx = 0.5 * (cols - 1), cy = 0.5 * (rows - 1);
+	const double c = drift.scale * std::cos(drift.angle), s = drift.scale * std::sin(drift.angle);
+	const double vMin = std::is_integral<U>::value ? (double)std::numeric_limits<U>::lowest() : -std::numeric_limits<double>::infinity();
+	const double vMax = std::is_integral<U>::value ? (double)std::numeric_limits<U>::max() : std::numeric_limits<double>::infinity();
+	for(int i = 0; i < rows; i++) {
+		const double py = i - cy;
+		for(int j = 0; j < cols; j++) {
+			const double px = j - cx;
+			const double x = std::max(0.0, std::min(double(cols - 1), cx + c * px - s * py + drift.dx));
+			const double y = std::max(0.0, std::min(double(rows - 1), cy + s * px + c * py + drift.dy));
+			const int x0 = std::min((int)x, cols - 2 < 0 ? 0 : cols - 2), y0 = std::min((int)y, rows - 2 < 0 ? 0 : rows - 2);
+			const int x1 = std::min(x0 + 1, cols - 1), y1 = std::min(y0 + 1, rows - 1);
+			const double fx = x - x0, fy = y - y0;
+			T const * const r0 = src + (size_t)y0 * cols;
+			T const * const r1 = src + (size_t)y1 * cols;
+			double v = (1 - fy) * ((1 - fx) * r0[x0] + fx * r0[x1]) + fy * ((1 - fx) * r1[x0] + fx * r1[x1]);
+			if(std::is_integral<U>::value) v = std::max(vMin, std::min(vMax, std::round(v)));
+			dst[(size_t)i * cols + j] = (U)v;
+		}
+	}
+}
+
+//@brief: 2d phase correlation of images against a fixed reference
+template <typename Real>
+class PhaseCorrelator {
+public:
+	//@brief: working memory for a single thread
+	struct Workspace {
+		FFTWBuffer<Real, Real> image;                 //windowed image, then inverse transform of cross power spectrum (rows x cols)
+		FFTWBuffer<std::complex<Real>, Real> spectrum;//fft of image, then normalized cross power spectrum (rows x (cols / 2 + 1))
+		FFTWBuffer<std::complex<Real>, Real> cross;   //copy of cross power spectrum for inverse transform (destroyed by fftw)
+		std::vector<std::complex<Real> > partial;     //cross power spectrum evaluated at fine column positions for each row frequency
+
+		void assign(const int rows, const int cols) {
+			image.allocate((size_t)rows * cols);
+			spectrum.allocate((size_t)rows * (cols / 2 + 1));
+			cross.allocate((size_t)rows * (cols / 2 + 1));
+		}
+	};
+
+	//@brief: sub pixel shift of an image relative to the reference, image(p) ~ reference(p - (dx, dy))
+	struct Shift {
+		double dx, dy;//shift in pixels
+		double peak;  //normalized correlation peak height
+	};
+
+	PhaseCorrelator() : nRows(0), nCols(0), factor(1), fftw(NULL) {}
+
+	//@brief: set image size
+	//@param rows: image height
+	//@param cols: image width
+	//@param upsampleFactor: shifts are found to the nearest 1 / upsampleFactor pixel
+	//@param windowRows: true to taper the image to 0 at the top and bottom (false if the image is periodic in y)
+	//@param windowCols: true to taper the image to 0 at the left and right (false if the image is periodic in x)
+	void assign(const int rows, const int cols, const int upsampleFactor, const bool windowRows = true, const bool windowCols = true) {
+		if(rows < 2 || cols < 2) throw std::runtime_error("phase correlation requires at least 2x2 images");
+		if(upsampleFactor < 1) throw std::runtime_error("upsample factor must be at least 1");
+		nRows = rows;
+		nCols = cols;
+		factor = upsampleFactor;
+		fftw = &FFTWPlans<Real>::Get2D(rows, cols);
+		winRows = window(rows, windowRows);
+		winCols = window(cols, windowCols);
+		ref.allocate((size_t)rows * (cols / 2 + 1));
+	}
+
+	int rows() const {return nRows;}
+	int cols() const {return nCols;}
+
+	//@brief: compute the fft of a windowed image with its mean removed
+	//@param img: image to transform (rows x cols)
+	//@param ws: workspace to hold the transform (ws.spectrum)
+	template <typename T>
+	void transform(T const * const img, Workspace& ws) const {
+		ws.assign(nRows, nCols);
+		const size_t count = (size_t)nRows * nCols;
+		const double mean = std::accumulate(img, img + count, 0.0) / count;
+		for(int i = 0; i < nRows; i++) {
+			for(int j = 0; j < nCols; j++) ws.image[(size_t)i * nCols + j] = Real((img[(size_t)i * nCols + j] - mean) * winRows[i] * winCols[j]);
+		}
+		fftw->forward(ws.image.data(), ws.spectrum.data());
+	}
+
+	//@brief: set the reference image
+	//@param img: reference image (rows x cols)
+	//@param ws: workspace
+	template <typename T>
+	void setReference(T const * const img, Workspace& ws) {
+		transform(img, ws);
+		setReferenceSpectrum(ws);
+	}
+
+	//@brief: set the reference image from a transform already held in the workspace
+	//@param ws: workspace holding the reference transform (from transform())
+	void setReferenceSpectrum(const Workspace& ws) {
+		std::transform(ws.spectrum.begin(), ws.spectrum.end(), ref.begin(), [](const std::complex<Real>& v){return std::conj(v);});
+	}
+
+	//@brief: find the shift of an image relative to the reference
+	//@param img: image (rows x cols)
+	//@param ws: workspace
+	//@return: shift
+	template <typename T>
+	Shift estimate(T const * const img, Workspace& ws) const {
+		transform(img, ws);
+		return correlate(ws);
+	}
+
+	//@brief: find the shift of an image relative to the reference from a transform already held in the workspace
+	//@param ws: workspace holding the image transform (from transform()), the transform is overwritten
+	//@return: shift
+	Shift correlate(Workspace& ws) const {
+		//cross power spectrum, whitened so that every frequency with significant power contributes equally
+		//frequencies with power well below the mean are mostly noise / interpolation error so they are damped instead of amplified
+		const int hc = nCols / 2 + 1;
+		std::complex<Real> const * r = ref.data();
+		double meanMag = 0;
+		for(std::complex<Real>& v : ws.spectrum) {
+			v *= *r++;
+			meanMag += std::abs(v);
+		}
+		const Real eps = Real(meanMag / ws.spectrum.size()) + std::numeric_limits<Real>::min();
+		double weight = 0;//sum of whitened magnitudes over the full (conjugate symmetric) spectrum for normalization
+		for(size_t i = 0; i < ws.spectrum.size(); i++) {
+			std::complex<Real>& v = ws.spectrum[i];
+			const Real mag = std::abs(v);
+			v /= mag + eps;
+			const size_t k = i % hc;
+			weight += (0 == k || 2 * k == (size_t)nCols ? 1.0 : 2.0) * mag / (mag + eps);
+		}
+
+		//whole pixel peak of cross correlation
+		std::copy(ws.spectrum.begin(), ws.spectrum.end(), ws.cross.begin());
+		fftw->inverse(ws.image.data(), ws.cross.data());
+		const size_t iMax = std::distance(ws.image.begin(), std::max_element(ws.image.begin(), ws.image.end()));
+		const int py = int(iMax / nCols), px = int(iMax % nCols);
+
+		//refine by evaluating the inverse transform on a fine grid of +/-0.75 pixels around the peak (the grid includes the whole pixel peak)
+		const int half = (3 * factor + 3) / 4;
+		const int n = 2 * half + 1;
+		const double twoPi = 6.2831853071795864769252867665590057683943387987502;
+		std::vector<std::complex<Real> > colPhase((size_t)n * hc);
+		for(int j = 0; j < n; j++) {
+			const double x = px + double(j - half) / factor;
+			for(int k = 0; k < hc; k++) {
+				const double w = (0 == k || 2 * k == nCols) ? 1.0 : 2.0;//the other half of the spectrum is the complex conjugate
+				colPhase[(size_t)j * hc + k] = std::complex<Real>(std::polar(w, twoPi * k * x / nCols));
+			}
+		}
+		ws.partial.assign((size_t)nRows * n, std::complex<Real>(0));
+		for(int ky = 0; ky < nRows; ky++) {
+			std::complex<Real> const * const q = ws.spectrum.data() + (size_t)ky * hc;
+			for(int j = 0; j < n; j++) {
+				std::complex<Real> const * const e = colPhase.data() + (size_t)j * hc;
+				std::complex<Real> sum(0);
+				for(int k = 0; k < hc; k++) sum += q[k] * e[k];
+				ws.partial[(size_t)ky * n + j] = sum;
+			}
+		}
+		std::vector<double> fine((size_t)n * n);
+		std::vector<std::complex<double> > rowPhase(nRows);
+		for(int i = 0; i < n; i++) {
+			const double y = py + double(i - half) / factor;
+			for(int ky = 0; ky < nRows; ky++) rowPhase[ky] = std::polar(1.0, twoPi * (2 * ky > nRows ? ky - nRows : ky) * y / nRows);
+			for(int j = 0; j < n; j++) {
+				double c = 0;
+				for(int ky = 0; ky < nRows; ky++) c += (std::complex<double>(ws.partial[(size_t)ky * n + j]) * rowPhase[ky]).real();
+				fine[(size_t)i * n + j] = c;
+			}
+		}
+
+		//fine grid maximum, then a parabola through it and its neighbors in each direction
+		const size_t iFine = std::distance(fine.begin(), std::max_element(fine.begin(), fine.end()));
+		const int bi = int(iFine / n), bj = int(iFine % n);
+		const double c0 = fine[iFine];
+		double oy = 0, ox = 0;
+		if(bi > 0 && bi + 1 < n) {
+			const double cm = fine[iFine - n], cp = fine[iFine + n], d = cm - 2 * c0 + cp;
+			if(d < 0) oy = std::max(-0.5, std::min(0.5, 0.5 * (cm - cp) / d));
+		}
+		if(bj > 0 && bj + 1 < n) {
+			const double cm = fine[iFine - 1], cp = fine[iFine + 1], d = cm - 2 * c0 + cp;
+			if(d < 0) ox = std::max(-0.5, std::min(0.5, 0.5 * (cm - cp) / d));
+		}
+		Shift best;
+		best.dx = px + (bj - half + ox) / factor;
+		best.dy = py + (bi - half + oy) / factor;
+		best.peak = weight > 0 ? c0 / weight : 0;
+
+		//convert from circular to signed shifts
+		if(2 * best.dx > nCols) best.dx -= nCols;
+		if(2 * best.dy > nRows) best.dy -= nRows;
+		return best;
+	}
+
+private:
+	int nRows, nCols;                          //image size
+	int factor;                                //upsampling factor for sub pixel peak
+	FFTW<Real> const * fftw;                   //shared 2d plans
+	std::vector<double> winRows, winCols;      //separable window
+	FFTWBuffer<std::complex<Real>, Real> ref;  //complex conjugate of reference fft
+
+	//@brief: build a hann window (or all ones)
+	static std::vector<double> window(const int n, const bool taper) {
+		std::vector<double> w(n, 1.0);
+		if(taper) {
+			const double twoPi = 6.2831853071795864769252867665590057683943387987502;
+			for(int i = 0; i < n; i++) w[i] = 0.5 - 0.5 * std::cos(twoPi * (i + 0.5) / n);
+		}
+		return w;
+	}
+};
+
+//@brief: working memory for FrameRegistration (one per thread)
+template <typename Real>
+struct RegistrationWorkspace {
+	typename PhaseCorrelator<Real>::Workspace frame;   //frame sized correlation
+	typename PhaseCorrelator<Real>::Workspace logPolar;//log-polar sized correlation (similarity only)
+	std::vector<Real> magnitude;                        //high pass filtered magnitude spectrum (similarity only)
+	std::vector<Real> polar;                            //log-polar resampled magnitude spectrum (similarity only)
+	std::vector<Real> unrotated;                        //frame with rotation / scale removed (similarity only)
+};
+
+//@brief: estimate the drift of frames relative to a reference frame by phase correlation
+//@note: rotation and scale are found from the translation invariant magnitude spectrum resampled onto a log-polar grid
+//       where they become a translation, the frame is then derotated and the translation is found as usual
+template <typename Real>
+class FrameRegistration {
+	int nRows, nCols;            //frame size
+	RegistrationMode mode;       //registration model
+	PhaseCorrelator<Real> frame; //frame correlation
+	PhaseCorrelator<Real> polar; //log-polar magnitude spectrum correlation (angle x log radius)
+	double rMin, logStep;        //log-polar radius of first column (cycles / pixel) and log radius spacing
+
+	//@brief: resample the magnitude of the frame transform held in a workspace onto the log-polar grid
+	void logPolar(RegistrationWorkspace<Real>& ws) const {
+		//high pass filter to suppress the low frequency peak (which doesn't rotate with the image content)
+		const int hc = nCols / 2 + 1;
+		const double pi = 3.1415926535897932384626433832795028841971693993751;
+		ws.magnitude.resize((size_t)nRows * hc);
+		for(int ky = 0; ky < nRows; ky++) {
+			const double cy = std::cos(pi * (2 * ky > nRows ? ky - nRows : ky) / nRows);
+			for(int kx = 0; kx < hc; kx++) {
+				const double x = cy * std::cos(pi * kx / nCols);
+				ws.magnitude[(size_t)ky * hc + kx] = Real(std::abs(ws.frame.spectrum[(size_t)ky * hc + kx]) * (1.0 - x) * (2.0 - x));
+			}
+		}
+
+		//bilinear interpolation of the half spectrum at angles [0, pi) and log spaced radii
+		const int nA = polar.rows(), nR = polar.cols();
+		ws.polar.resize((size_t)nA * nR);
+		for(int i = 0; i < nA; i++) {
+			const double theta = pi * i / nA;
+			const double ct = std::cos(theta), st = std::sin(theta);
+			for(int j = 0; j < nR; j++) {
+				const double r = rMin * std::exp(logStep * j);
+				double kx = r * ct * nCols, ky = r * st * nRows;
+				if(kx < 0) {//use the conjugate symmetric half
+					kx = -kx;
+					ky = -ky;
+				}
+				const int x0 = std::min((int)kx, hc - 1), x1 = std::min(x0 + 1, hc - 1);
+				const int yf = (int)std::floor(ky);
+				const double fx = kx - x0, fy = ky - yf;
+				const int y0 = ((yf % nRows) + nRows) % nRows, y1 = (y0 + 1) % nRows;
+				Real const * const m0 = ws.magnitude.data() + (size_t)y0 * hc;
+				Real const * const m1 = ws.magnitude.data() + (size_t)y1 * hc;
+				ws.polar[(size_t)i * nR + j] = Real((1 - fy) * ((1 - fx) * m0[x0] + fx * m0[x1]) + fy * ((1 - fx) * m1[x0] + fx * m1[x1]));
+			}
+		}
+	}
+
+public:
+	//@param rows: frame height
+	//@param cols: frame width
+	//@param registration: registration model (not None)
+	//@param upsampleFactor: shifts (and angles) are found to 1 / upsampleFactor of a pixel (or log-polar bin)
+	FrameRegistration(const int rows, const int cols, const RegistrationMode registration, const int upsampleFactor = 16) : nRows(rows), nCols(cols), mode(registration), rMin(0), logStep(0) {
+		if(RegistrationMode::None == mode) throw std::runtime_error("registration mode must be translation or similarity");
+		frame.assign(rows, cols, upsampleFactor);
+		if(RegistrationMode::Similarity == mode) {
+			//power of 2 grid between 64 and 512 bins on a side depending on frame size, radii from 2 frequency bins to nyquist
+			int n = 64;
+			while(n < 512 && 2 * n <= std::min(rows, cols)) n *= 2;
+			rMin = 2.0 / std::min(rows, cols);
+			logStep = std::log(0.5 / rMin) / (n - 1);
+			polar.assign(n, n, upsampleFactor, false, true);//angle is periodic, log radius isn't
+		}
+	}
+
+	//@brief: set the frame other frames are registered to
+	//@param ref: reference frame (rows x cols)
+	//@param ws: workspace
+	template <typename T>
+	void setReference(T const * const ref, RegistrationWorkspace<Real>& ws) {
+		frame.transform(ref, ws.frame);
+		frame.setReferenceSpectrum(ws.frame);
+		if(RegistrationMode::Similarity == mode) {
+			logPolar(ws);
+			polar.setReference(ws.polar.data(), ws.logPolar);
+		}
+	}
+
+	//@brief: find the drift of a frame relative to the reference (may be called from multiple threads with separate workspaces)
+	//@param img: frame (rows x cols)
+	//@param ws: workspace
+	//@return: drift of frame
+	template <typename T>
+	FrameDrift estimate(T const * const img, RegistrationWorkspace<Real>& ws) const {
+		FrameDrift drift;
+		if(RegistrationMode::Translation == mode) {
+			const typename PhaseCorrelator<Real>::Shift s = frame.estimate(img, ws.frame);
+			drift.dx = s.dx;
+			drift.dy = s.dy;
+			drift.peak = s.peak;
+			return drift;
+		}
+
+		//rotation and scale from log-polar magnitude spectra (the magnitude spectrum is symmetric so rotations of theta and theta + pi are indistinguishable)
+		const double pi = 3.1415926535897932384626433832795028841971693993751;
+		frame.transform(img, ws.frame);
+		logPolar(ws);
+		const typename PhaseCorrelator<Real>::Shift s = polar.estimate(ws.polar.data(), ws.logPolar);
+		drift.angle = s.dy * pi / polar.rows();
+		drift.scale = std::exp(-s.dx * logStep);
+
+		//remove rotation / scale and find translation, keeping whichever of the 2 possible rotations matches better
+		ws.unrotated.resize((size_t)nRows * nCols);
+		drift.peak = -std::numeric_limits<double>::infinity();
+		const double angle = drift.angle;
+		for(int k = 0; k < 2; k++) {
+			FrameDrift candidate;
+			candidate.angle = 0 == k ? angle : (angle > 0 ? angle - pi : angle + pi);
+			candidate.scale = drift.scale;
+			warpFrame(img, ws.unrotated.data(), nRows, nCols, candidate);
+			const typename PhaseCorrelator<Real>::Shift t = frame.estimate(ws.unrotated.data(), ws.frame);
+			if(t.peak > drift.peak) {
+				//the translation was measured in derotated coordinates
+				const double c = candidate.scale * std::cos(candidate.angle), sn = candidate.scale * std::sin(candidate.angle);
+				drift.angle = candidate.angle;
+				drift.dx = c * t.dx - sn * t.dy;
+				drift.dy = sn * t.dx + c * t.dy;
+				drift.peak = t.peak;
+			}
+		}
+		return drift;
+	}
+};
+
+//@brief: estimate the drift of every frame relative to a reference frame (frames are registered in parallel)
+//@param frames: frames to register (each rows x cols)
+//@param rows: frame height
+//@param cols: frame width
+//@param mode: registration model (None returns no drift for every frame)
+//@param reference: index of reference frame
+//@param upsampleFactor: shifts are found to 1 / upsampleFactor of a pixel
+//@return: drift of each frame (the reference has no drift)
+template <typename Real, typename T>
+std::vector<FrameDrift> registerFrames(const std::vector< std::vector<T> >& frames, const int rows, const int cols, const RegistrationMode mode, const size_t reference = 0, const int upsampleFactor = 16) {
+	std::vector<FrameDrift> drifts(frames.size());
+	if(RegistrationMode::None == mode || frames.size() < 2) return drifts;
+	if(reference >= frames.size()) throw std::runtime_error("registration reference frame out of bounds");
+
+	ThreadPool& pool = ThreadPool::Shared();
+	std::vector< RegistrationWorkspace<Real> > workspaces(pool.size() + 1);//one per worker (+1 for the calling thread)
+	FrameRegistration<Real> registration(rows, cols, mode, upsampleFactor);
+	registration.setReference(frames[reference].data(), workspaces[pool.workerIndex()]);
+	pool.parallelFor(0, frames.size(), [&](const size_t i) {
+		if(reference != i) drifts[i] = registration.estimate(frames[i].data(), workspaces[pool.workerIndex()]);
+	});
+	return drifts;
+}
+
+#endif//_registration_h_
@@ -0,0 +1,247 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                                 *
+ * Copyright (c) 2017, Reagents of the University of California                    *
+ * All rights reserved.                                                            *
+ *                                                                                 *
+ * Redistribution and use in source and binary forms, with or without              *
+ * modification, are permitted provided that the following conditions are met:     *
+ *                                                                                 *
+ * 1. Redistributions of source code must retain the above copyright notice, this  *
+ *    list of conditions and the following disclaimer.                             *
+ *                                                                                 *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,    *
+ *    this list of conditions and the following disclaimer in the documentation    *
+ *    and/or other materials provided with the distribution.                       *
+ *                                                                                 *
+ * 3. Neither the name of the copyright holder nor the names of its                *
+ *    contributors may be used to endorse or promote products derived from         *
+ *    this software without specific prior written permission.                     *
+ *                                                                                 *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"     *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE  *
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE    *
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL      *
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR      *
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER      *
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,   *
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE   *
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.            *
+ *                                                                                 *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+//batch reprocessing of saved acquisitions without the DAQ (see usage below)
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <set>
+#include <regex>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+#ifdef _WIN32
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <windows.h>
+#else
+	#include <glob.h>
+	#include <sys/stat.h>
+#endif
+
+#include "postprocess.hpp"
+
+//@brief: list the files matching a directory (every file in it) or a wildcard pattern
+//@param path: directory or pattern (plain file names match themselves)
+//@return: matching paths
+static std::vector<std::string> listFiles(const std::string& path) {
+	std::vector<std::string> files;
+#ifdef _WIN32
+	const DWORD attributes = GetFileAttributesA(path.c_str());
+	const bool directory = INVALID_FILE_ATTRIBUTES != attributes && 0 != (attributes & FILE_ATTRIBUTE_DIRECTORY);
+	const std::string pattern = directory ? path + "\\*" : path;
+	const size_t slash = pattern.find_last_of("/\\");
+	const std::string folder = std::string::npos == slash ? std::string() : pattern.substr(0, slash + 1);
+	WIN32_FIND_DATAA data;
+	HANDLE h = FindFirstFileA(pattern.c_str(), &data);
+	if (INVALID_HANDLE_VALUE == h) return files;
+	do {
+		if (0 == (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) files.push_back(folder + data.cFileName);
+	} while (FindNextFileA(h, &data));
+	FindClose(h);
+#else
+	struct stat info;
+	const bool directory = 0 == stat(path.c_str(), &info) && S_ISDIR(info.st_mode);
+	const std::string pattern = directory ? path + "/*" : path;
+	glob_t matches;
+	if (0 == glob(pattern.c_str(), GLOB_MARK, NULL, &matches)) {
+		for (size_t i = 0; i < matches.gl_pathc; i++) {
+			const std::string name(matches.gl_pathv[i]);
+			if ('/' != name.back()) files.push_back(name);//GLOB_MARK appends a slash to directories
+		}
+	}
+	globfree(&matches);
+#endif
+	return files;
+}
+
+//@brief: find the acquisitions with saved raw stacks in a list of files
+//@param files: file names (raw stacks or averaged images)
+//@return: averaged image name of each acquisition (the name its raw stacks were derived from)
+static std::vector<std::string> findAcquisitions(const std::vector<std::string>& files) {
+	//rawStackName inserts _Frame_0_Line_0_RSs_noFFT before the extension, every acquisition has this stack
+	const std::regex firstStack("(.*)_Frame_0_Line_0_RSs_noFFT([^/\\\\]*)");
+	std::set<std::string> names;
+	std::smatch match;
+	for (const std::string& file : files) {
+		if (std::regex_match(file, match, firstStack)) names.insert(match[1].str() + match[2].str());
+		else if (std::ifstream(rawStackName(file, 0, 0)).good()) names.insert(file);//averaged image of an acquisition
+	}
+	return std::vector<std::string>(names.begin(), names.end());
+}
+
+//@brief: get the file name part of a path
+static std::string leafName(const std::string& path) {
+	const size_t slash = path.find_last_of("/\\");
+	return std::string::npos == slash ? path : path.substr(slash + 1);
+}
+
+//@brief: limit the memory used by acquisitions being processed at once
+//@note: an acquisition is always admitted when nothing else is running so one larger than the budget can't stall the batch
+class MemoryBudget {
+	std::uint64_t limit;//maximum bytes in use
+	std::uint64_t used; //bytes held by admitted acquisitions
+	std::mutex mut;
+	std::condition_variable cv;
+
+public:
+	explicit MemoryBudget(const std::uint64_t bytes) : limit(bytes), used(0) {}
+
+	//@brief: wait until bytes are available and take them
+	void acquire(const std::uint64_t bytes) {
+		std::unique_lock<std::mutex> lock(mut);
+		cv.wait(lock, [&]{return 0 == used || used + bytes <= limit;});
+		used += bytes;
+	}
+
+	//@brief: return bytes taken by acquire
+	void release(const std::uint64_t bytes) {
+		{
+			std::lock_guard<std::mutex> lock(mut);
+			used -= bytes;
+		}
+		cv.notify_all();
+	}
+};
+
+int main(int argc, char *argv[]) {
+	try {
+		std::vector<std::string> paths;
+		std::string outputDir;
+		ReprocessOptions options;
+		size_t jobs = 2, budgetMB = 4096;
+
+		std::stringstream ss;
+		ss << "usage: Reprocess [-o directory] [-N files] [-M memory] " << ReprocessOptions::synopsis() << " path ...\n";
+		ss << "\t path: directory or wildcard pattern (e.g. d:/testImage/*.tiff) containing the _Frame_*_Line_*_RSs_noFFT stacks of acquisitions saved with -v 0, or an averaged image\n";
+		ss << "\t[-o]: output directory (defaults to next to each acquisition with _reprocessed appended)\n";
+		ss << "\t[-N]: # of acquisitions processed at once (defaults to " << jobs << ")\n";
+		ss << "\t[-M]: memory budget in MB for acquisitions being processed (defaults to " << budgetMB << ")\n";
+		ss << options.usage();
+
+		for (int i = 1; i < argc; i++) {
+			if ('-' == argv[i][0]) {
+				if (2 != strlen(argv[i]) || i + 1 == argc) throw std::runtime_error(ss.str() + "(bad option " + argv[i] + ")\n");
+				switch (argv[i][1]) {
+				case 'o': outputDir = std::string(argv[i + 1]); break;
+				case 'N': jobs = atoi(argv[i + 1]); break;
+				case 'M': budgetMB = atoi(argv[i + 1]); break;
+				default: if (!options.parse(argv[i][1], argv[i + 1])) throw std::runtime_error(ss.str() + "(unknown option " + argv[i] + ")\n");
+				}
+				++i;
+			} else {
+				paths.push_back(argv[i]);
+			}
+		}
+		if (paths.empty()) throw std::runtime_error(ss.str() + "(path missing)\n");
+		if (jobs < 1) throw std::runtime_error(ss.str() + "(# of files must be at least 1)\n");
+		options.apply(ss.str());
+		IntegrationParams& params = options.params;
+
+		//find acquisitions
+		std::vector<std::string> files;
+		for (const std::string& path : paths) {
+			const std::vector<std::string> matches = listFiles(path);
+			files.insert(files.end(), matches.begin(), matches.end());
+		}
+		const std::vector<std::string> inputs = findAcquisitions(files);
+		if (inputs.empty()) throw std::runtime_error("no raw page stacks (*_Frame_0_Line_0_RSs_noFFT*) found\n");
+		if (!outputDir.empty() && '/' != outputDir.back() && '\\' != outputDir.back()) outputDir += '/';
+		jobs = std::min<size_t>(jobs, inputs.size());
+		params.verbose = 1 == jobs;//interleaved per line logs from several acquisitions aren't readable
+		std::cout << "reprocessing " << inputs.size() << " acquisition(s), " << jobs << " at a time\n";
+
+		//each worker reads, corrects, and integrates one acquisition at a time and writes it on its own queue,
+		//so the disk io of one acquisition overlaps the ffts of the others (which share the thread pool)
+		MemoryBudget budget(std::uint64_t(budgetMB) << 20);
+		std::atomic<size_t> next(0);
+		std::mutex logMut;
+		std::vector<std::string> failures;
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		std::vector<std::thread> workers;
+		for (size_t iWorker = 0; iWorker < jobs; iWorker++) {
+			workers.push_back(std::thread([&]() {
+				TifWriteQueue writer;
+				for (size_t i = next++; i < inputs.size(); i = next++) {
+					const std::string& input = inputs[i];
+					const std::string output = outputDir.empty() ? insertSuffix(input, "_reprocessed") : outputDir + leafName(input);
+					const std::chrono::steady_clock::time_point fileStart = std::chrono::steady_clock::now();
+					std::uint64_t bytes = 0;
+					std::string error;
+					try {
+						IntegrationParams p = params;
+						findRawStacks(input, p);
+						bytes = integrationBytes(p);
+						budget.acquire(bytes);
+						reprocessImage(input, output, p, writer);
+						writer.wait();//finished images hold their memory until written
+					} catch (std::exception& e) {
+						error = e.what();
+						try {
+							writer.wait();
+						} catch (...) {}//already failing
+					}
+					if (bytes > 0) budget.release(bytes);
+					const double seconds = std::chrono::duration_cast< std::chrono::duration<double> >(std::chrono::steady_clock::now() - fileStart).count();
+					std::lock_guard<std::mutex> lock(logMut);
+					if (error.empty()) {
+						std::cout << "wrote " << output << " (" << seconds << " s)" << std::endl;
+					} else {
+						std::cout << "failed " << input << ": " << error << std::endl;
+						failures.push_back(input);
+					}
+				}
+			}));
+		}
+		for (std::thread& t : workers) t.join();
+
+		const double seconds = std::chrono::duration_cast< std::chrono::duration<double> >(std::chrono::steady_clock::now() - start).count();
+		std::cout << inputs.size() - failures.size() << " of " << inputs.size() << " acquisition(s) reprocessed in " << seconds << " s\n";
+		for (const std::string& f : failures) std::cout << "\tfailed: " << f << '\n';
+		if (!failures.empty()) return EXIT_FAILURE;
+	}
+	catch (std::exception& e) {
+		std::cout << e.what();
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
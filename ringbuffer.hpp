@@ -0,0 +1,133 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                                 *
+ * Copyright (c) 2017, Reagents of the University of California                    *
+ * All rights reserved.                                                            *
+ *                                                                                 *
+ * Redistribution and use in source and binary forms, with or without              *
+ * modification, are permitted provided that the following conditions are met:     *
+ *                                                                                 *
+ * 1. Redistributions of source code must retain the above copyright notice, this  *
+ *    list of conditions and the following disclaimer.                             *
+ *                                                                                 *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,    *
+ *    this list of conditions and the following disclaimer in the documentation    *
+ *    and/or other materials provided with the distribution.                       *
+ *                                                                                 *
+ * 3. Neither the name of the copyright holder nor the names of its                *
+ *    contributors may be used to endorse or promote products derived from         *
+ *    this software without specific prior written permission.                     *
+ *                                                                                 *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"     *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE  *
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE    *
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL      *
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR      *
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER      *
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,   *
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE   *
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.            *
+ *                                                                                 *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef _ringbuffer_h_
+#define _ringbuffer_h_
+
+#include <atomic>
+#include <cstddef>
+
+#include "planes.hpp"
+
+//@brief: usage statistics for a RowRing
+struct RingStats {
+	size_t depth;    //number of slots
+	size_t highWater;//maximum number of rows waiting to be processed at once
+	size_t stalls;   //number of times the producer found the ring full
+};
+
+//@brief: single producer / single consumer lock free ring of fixed length rows
+//@note: exactly one thread may call acquireWrite/commitWrite and exactly one (other) thread may call acquireRead/releaseRead
+template <typename T>
+class RowRing {
+	size_t nSlots;                     //number of rows the ring can hold
+	size_t length;                     //elements per row
+	size_t stride;                     //elements between the start of subsequent slots
+	AlignedBuffer<T> slots;            //row storage
+
+	//counters only ever increase, slot index is count % nSlots (kept on separate cache lines to avoid false sharing)
+	alignas(64) std::atomic<size_t> head;//rows committed by producer
+	alignas(64) std::atomic<size_t> tail;//rows released by consumer
+	alignas(64) size_t highWater;        //producer owned statistics
+	size_t stalls;
+	bool full;                           //true while the producer is waiting for a free slot (so each wait is counted once)
+
+public:
+	RowRing() : nSlots(0), length(0), stride(0), head(0), tail(0), highWater(0), stalls(0), full(false) {}
+
+	//@brief: allocate slots and reset the ring (must not be called while in use)
+	//@param depth: number of rows the ring can hold
+	//@param rowLength: elements per row
+	void assign(const size_t depth, const size_t rowLength) {
+		const size_t rowAlign = AlignedBuffer<T>::Alignment / sizeof(T);
+		nSlots = depth;
+		length = rowLength;
+		stride = (rowLength + rowAlign - 1) / rowAlign * rowAlign;
+		slots.allocate(nSlots * stride);
+		reset();
+	}
+
+	//@brief: empty the ring and clear statistics (must not be called while in use)
+	void reset() {
+		head.store(0);
+		tail.store(0);
+		highWater = 0;
+		stalls = 0;
+		full = false;
+	}
+
+	size_t depth() const {return nSlots;}
+	size_t rowLength() const {return length;}
+
+	//@brief: get the next free row for writing (producer only)
+	//@return: pointer to row or NULL if the ring is full
+	T* acquireWrite() {
+		const size_t h = head.load(std::memory_order_relaxed);
+		if(h - tail.load(std::memory_order_acquire) == nSlots) {
+			if(!full) ++stalls;//count polls of the same full ring once
+			full = true;
+			return NULL;
+		}
+		full = false;
+		return slots.data() + (h % nSlots) * stride;
+	}
+
+	//@brief: publish the row returned by acquireWrite (producer only)
+	void commitWrite() {
+		const size_t h = head.load(std::memory_order_relaxed) + 1;
+		head.store(h, std::memory_order_release);
+		const size_t used = h - tail.load(std::memory_order_relaxed);
+		if(used > highWater) highWater = used;
+	}
+
+	//@brief: get the oldest unprocessed row (consumer only)
+	//@return: pointer to row or NULL if the ring is empty
+	T const * acquireRead() const {
+		const size_t t = tail.load(std::memory_order_relaxed);
+		if(t == head.load(std::memory_order_acquire)) return NULL;
+		return slots.data() + (t % nSlots) * stride;
+	}
+
+	//@brief: return the row returned by acquireRead to the producer (consumer only)
+	void releaseRead() {tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);}
+
+	//@brief: get usage statistics (only consistent while the producer is idle)
+	RingStats stats() const {
+		RingStats s;
+		s.depth = nSlots;
+		s.highWater = highWater;
+		s.stalls = stalls;
+		return s;
+	}
+};
+
+#endif//_ringbuffer_h_
@@ -0,0 +1,347 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                                 *
+ * Copyright (c) 2017, Reagents of the University of California                    *
+ * All rights reserved.                                                            *
+ *                                                                                 *
+ * Redistribution and use in source and binary forms, with or without              *
+ * modification, are permitted provided that the following conditions are met:     *
+ *                                                                                 *
+ * 1. Redistributions of source code must retain the above copyright notice, this  *
+ *    list of conditions and the following disclaimer.                             *
+ *                                                                                 *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,    *
+ *    this list of conditions and the following disclaimer in the documentation    *
+ *    and/or other materials provided with the distribution.                       *
+ *                                                                                 *
+ * 3. Neither the name of the copyright holder nor the names of its                *
+ *    contributors may be used to endorse or promote products derived from         *
+ *    this software without specific prior written permission.                     *
+ *                                                                                 *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"     *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE  *
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE    *
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL      *
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR      *
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER      *
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,   *
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE   *
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.            *
+ *                                                                                 *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef _simd_h_
+#define _simd_h_
+
+#include <cstddef>
+#include <complex>
+
+//kernels for the innermost alignment loops on split real / imaginary arrays
+//float and double kernels are built for SSE, AVX2 (+FMA) and AVX-512 and the best supported set is chosen at runtime
+//other types (and non x86 builds) use plain loops
+
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || (defined(__i386__) && defined(__SSE2__))
+	#define SIMD_X86
+	#include <immintrin.h>
+	#ifdef _MSC_VER
+		#include <intrin.h>
+		#define SIMD_TARGET_AVX2
+		#define SIMD_TARGET_AVX512
+	#else
+		#define SIMD_TARGET_AVX2 __attribute__((target("avx2,fma")))
+		#define SIMD_TARGET_AVX512 __attribute__((target("avx512f")))
+	#endif
+#endif
+
+namespace simd {
+	//@brief: instruction sets kernels are available for
+	enum class Level {Scalar, SSE, AVX2, AVX512};
+
+	//@brief: determine the best instruction set supported by the cpu and os
+	inline Level detect() {
+#ifdef SIMD_X86
+	#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		const int maxLeaf = info[0];
+		__cpuid(info, 1);
+		const bool osxsave = 0 != (info[2] & (1 << 27));
+		const bool fma = 0 != (info[2] & (1 << 12));
+		bool avx2 = false, avx512 = false;
+		if(maxLeaf >= 7) {
+			__cpuidex(info, 7, 0);
+			avx2 = 0 != (info[1] & (1 << 5));
+			avx512 = 0 != (info[1] & (1 << 16));
+		}
+		const unsigned long long xcr = osxsave ? _xgetbv(0) : 0;
+		if(avx512 && 0xe6 == (xcr & 0xe6)) return Level::AVX512;//os saves zmm, ymm, and opmask registers
+		if(avx2 && fma && 0x6 == (xcr & 0x6)) return Level::AVX2;//os saves ymm registers
+	#else
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx512f")) return Level::AVX512;
+		if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return Level::AVX2;
+	#endif
+		return Level::SSE;
+#else
+		return Level::Scalar;
+#endif
+	}
+
+	//@brief: get the instruction set used by the kernels (detected once)
+	inline Level level() {
+		static const Level l = detect();
+		return l;
+	}
+
+	namespace detail {
+		//@brief: plain loop kernels (also handle remainders of the vector kernels)
+		template <typename R>
+		struct Scalar {
+			typedef R Real;
+
+			//@brief: sum(aRe * bRe - aIm * bIm), the real part of the dot product of a and b
+			static Real dot(Real const * aRe, Real const * aIm, Real const * bRe, Real const * bIm, const size_t n) {
+				Real sum(0);
+				for(size_t i = 0; i < n; i++) sum += aRe[i] * bRe[i] - aIm[i] * bIm[i];
+				return sum;
+			}
+
+			//@brief: dot of a with 3 equally spaced b rows
+			static void dot3(Real const * aRe, Real const * aIm, Real const * bRe, Real const * bIm, const size_t stride, const size_t n, Real * const out) {
+				for(size_t j = 0; j < 3; j++) out[j] = dot(aRe, aIm, bRe + j * stride, bIm + j * stride, n);
+			}
+
+			//@brief: complex product of interleaved a and b written to split arrays
+			static void multiply(std::complex<Real> const * a, std::complex<Real> const * b, Real * re, Real * im, const size_t n) {
+				for(size_t i = 0; i < n; i++) {
+					re[i] = a[i].real() * b[i].real() - a[i].imag() * b[i].imag();
+					im[i] = a[i].real() * b[i].imag() + a[i].imag() * b[i].real();
+				}
+			}
+		};
+
+#ifdef SIMD_X86
+		//vector operations for each instruction set / type, kernels below are written once in terms of these
+		//deinterleave loads 2 vectors of interleaved complex values and splits them into real and imaginary parts (in order)
+		struct SseF {
+			typedef float Real; typedef __m128 V; static const size_t W = 4;
+			static V zero() {return _mm_setzero_ps();}
+			static V load(Real const * p) {return _mm_loadu_ps(p);}
+			static void store(Real * p, const V v) {_mm_storeu_ps(p, v);}
+			static V mul(const V a, const V b) {return _mm_mul_ps(a, b);}
+			static V fmadd(const V a, const V b, const V c) {return _mm_add_ps(_mm_mul_ps(a, b), c);}
+			static V fnmadd(const V a, const V b, const V c) {return _mm_sub_ps(c, _mm_mul_ps(a, b));}
+			static V fmsub(const V a, const V b, const V c) {return _mm_sub_ps(_mm_mul_ps(a, b), c);}
+			static Real sum(const V v) {
+				const __m128 h = _mm_add_ps(v, _mm_movehl_ps(v, v));
+				return _mm_cvtss_f32(_mm_add_ss(h, _mm_shuffle_ps(h, h, 1)));
+			}
+			static void deinterleave(Real const * p, V& re, V& im) {
+				const V a = _mm_loadu_ps(p), b = _mm_loadu_ps(p + 4);
+				re = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+				im = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+			}
+		};
+
+		struct SseD {
+			typedef double Real; typedef __m128d V; static const size_t W = 2;
+			static V zero() {return _mm_setzero_pd();}
+			static V load(Real const * p) {return _mm_loadu_pd(p);}
+			static void store(Real * p, const V v) {_mm_storeu_pd(p, v);}
+			static V mul(const V a, const V b) {return _mm_mul_pd(a, b);}
+			static V fmadd(const V a, const V b, const V c) {return _mm_add_pd(_mm_mul_pd(a, b), c);}
+			static V fnmadd(const V a, const V b, const V c) {return _mm_sub_pd(c, _mm_mul_pd(a, b));}
+			static V fmsub(const V a, const V b, const V c) {return _mm_sub_pd(_mm_mul_pd(a, b), c);}
+			static Real sum(const V v) {return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));}
+			static void deinterleave(Real const * p, V& re, V& im) {
+				const V a = _mm_loadu_pd(p), b = _mm_loadu_pd(p + 2);
+				re = _mm_unpacklo_pd(a, b);
+				im = _mm_unpackhi_pd(a, b);
+			}
+		};
+
+		struct Avx2F {
+			typedef float Real; typedef __m256 V; static const size_t W = 8;
+			SIMD_TARGET_AVX2 static V zero() {return _mm256_setzero_ps();}
+			SIMD_TARGET_AVX2 static V load(Real const * p) {return _mm256_loadu_ps(p);}
+			SIMD_TARGET_AVX2 static void store(Real * p, const V v) {_mm256_storeu_ps(p, v);}
+			SIMD_TARGET_AVX2 static V mul(const V a, const V b) {return _mm256_mul_ps(a, b);}
+			SIMD_TARGET_AVX2 static V fmadd(const V a, const V b, const V c) {return _mm256_fmadd_ps(a, b, c);}
+			SIMD_TARGET_AVX2 static V fnmadd(const V a, const V b, const V c) {return _mm256_fnmadd_ps(a, b, c);}
+			SIMD_TARGET_AVX2 static V fmsub(const V a, const V b, const V c) {return _mm256_fmsub_ps(a, b, c);}
+			SIMD_TARGET_AVX2 static Real sum(const V v) {return SseF::sum(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));}
+			SIMD_TARGET_AVX2 static void deinterleave(Real const * p, V& re, V& im) {
+				const V a = _mm256_loadu_ps(p), b = _mm256_loadu_ps(p + 8);
+				//in lane shuffles give elements in 64 bit blocks ordered 0, 2, 1, 3
+				re = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))), _MM_SHUFFLE(3, 1, 2, 0)));
+				im = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))), _MM_SHUFFLE(3, 1, 2, 0)));
+			}
+		};
+
+		struct Avx2D {
+			typedef double Real; typedef __m256d V; static const size_t W = 4;
+			SIMD_TARGET_AVX2 static V zero() {return _mm256_setzero_pd();}
+			SIMD_TARGET_AVX2 static V load(Real const * p) {return _mm256_loadu_pd(p);}
+			SIMD_TARGET_AVX2 static void store(Real * p, const V v) {_mm256_storeu_pd(p, v);}
+			SIMD_TARGET_AVX2 static V mul(const V a, const V b) {return _mm256_mul_pd(a, b);}
+			SIMD_TARGET_AVX2 static V fmadd(const V a, const V b, const V c) {return _mm256_fmadd_pd(a, b, c);}
+			SIMD_TARGET_AVX2 static V fnmadd(const V a, const V b, const V c) {return _mm256_fnmadd_pd(a, b, c);}
+			SIMD_TARGET_AVX2 static V fmsub(const V a, const V b, const V c) {return _mm256_fmsub_pd(a, b, c);}
+			SIMD_TARGET_AVX2 static Real sum(const V v) {return SseD::sum(_mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1)));}
+			SIMD_TARGET_AVX2 static void deinterleave(Real const * p, V& re, V& im) {
+				const V a = _mm256_loadu_pd(p), b = _mm256_loadu_pd(p + 4);
+				re = _mm256_permute4x64_pd(_mm256_unpacklo_pd(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+				im = _mm256_permute4x64_pd(_mm256_unpackhi_pd(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+			}
+		};
+
+		struct Avx512F {
+			typedef float Real; typedef __m512 V; static const size_t W = 16;
+			SIMD_TARGET_AVX512 static V zero() {return _mm512_setzero_ps();}
+			SIMD_TARGET_AVX512 static V load(Real const * p) {return _mm512_loadu_ps(p);}
+			SIMD_TARGET_AVX512 static void store(Real * p, const V v) {_mm512_storeu_ps(p, v);}
+			SIMD_TARGET_AVX512 static V mul(const V a, const V b) {return _mm512_mul_ps(a, b);}
+			SIMD_TARGET_AVX512 static V fmadd(const V a, const V b, const V c) {return _mm512_fmadd_ps(a, b, c);}
+			SIMD_TARGET_AVX512 static V fnmadd(const V a, const V b, const V c) {return _mm512_fnmadd_ps(a, b, c);}
+			SIMD_TARGET_AVX512 static V fmsub(const V a, const V b, const V c) {return _mm512_fmsub_ps(a, b, c);}
+			SIMD_TARGET_AVX512 static Real sum(V v) {
+				v = _mm512_add_ps(v, _mm512_shuffle_f32x4(v, v, _MM_SHUFFLE(1, 0, 3, 2)));//fold 256 bit halves
+				v = _mm512_add_ps(v, _mm512_shuffle_f32x4(v, v, _MM_SHUFFLE(2, 3, 0, 1)));//fold 128 bit quarters
+				return SseF::sum(_mm512_castps512_ps128(v));
+			}
+			SIMD_TARGET_AVX512 static void deinterleave(Real const * p, V& re, V& im) {
+				const V a = _mm512_loadu_ps(p), b = _mm512_loadu_ps(p + 16);
+				re = _mm512_permutex2var_ps(a, _mm512_set_epi32(30, 28, 26, 24, 22, 20, 18, 16, 14, 12, 10, 8, 6, 4, 2, 0), b);
+				im = _mm512_permutex2var_ps(a, _mm512_set_epi32(31, 29, 27, 25, 23, 21, 19, 17, 15, 13, 11, 9, 7, 5, 3, 1), b);
+			}
+		};
+
+		struct Avx512D {
+			typedef double Real; typedef __m512d V; static const size_t W = 8;
+			SIMD_TARGET_AVX512 static V zero() {return _mm512_setzero_pd();}
+			SIMD_TARGET_AVX512 static V load(Real const * p) {return _mm512_loadu_pd(p);}
+			SIMD_TARGET_AVX512 static void store(Real * p, const V v) {_mm512_storeu_pd(p, v);}
+			SIMD_TARGET_AVX512 static V mul(const V a, const V b) {return _mm512_mul_pd(a, b);}
+			SIMD_TARGET_AVX512 static V fmadd(const V a, const V b, const V c) {return _mm512_fmadd_pd(a, b, c);}
+			SIMD_TARGET_AVX512 static V fnmadd(const V a, const V b, const V c) {return _mm512_fnmadd_pd(a, b, c);}
+			SIMD_TARGET_AVX512 static V fmsub(const V a, const V b, const V c) {return _mm512_fmsub_pd(a, b, c);}
+			SIMD_TARGET_AVX512 static Real sum(V v) {
+				v = _mm512_add_pd(v, _mm512_shuffle_f64x2(v, v, _MM_SHUFFLE(1, 0, 3, 2)));//fold 256 bit halves
+				v = _mm512_add_pd(v, _mm512_shuffle_f64x2(v, v, _MM_SHUFFLE(2, 3, 0, 1)));//fold 128 bit quarters
+				return SseD::sum(_mm512_castpd512_pd128(v));
+			}
+			SIMD_TARGET_AVX512 static void deinterleave(Real const * p, V& re, V& im) {
+				const V a = _mm512_loadu_pd(p), b = _mm512_loadu_pd(p + 8);
+				re = _mm512_permutex2var_pd(a, _mm512_set_epi64(14, 12, 10, 8, 6, 4, 2, 0), b);
+				im = _mm512_permutex2var_pd(a, _mm512_set_epi64(15, 13, 11, 9, 7, 5, 3, 1), b);
+			}
+		};
+
+		//the kernel bodies are shared, but each instruction set needs its own target attribute so they are stamped out with a macro
+		#define SIMD_DEFINE_KERNELS(NAME, OPS, TARGET) \
+		struct NAME { \
+			typedef OPS::Real Real; \
+			typedef OPS::V V; \
+			TARGET static Real dot(Real const * aRe, Real const * aIm, Real const * bRe, Real const * bIm, const size_t n) { \
+				V s0 = OPS::zero(), s1 = OPS::zero(); \
+				size_t i = 0; \
+				for(; i + OPS::W <= n; i += OPS::W) { \
+					s0 = OPS::fmadd(OPS::load(aRe + i), OPS::load(bRe + i), s0); \
+					s1 = OPS::fmadd(OPS::load(aIm + i), OPS::load(bIm + i), s1); \
+				} \
+				return OPS::sum(s0) - OPS::sum(s1) + Scalar<Real>::dot(aRe + i, aIm + i, bRe + i, bIm + i, n - i); \
+			} \
+			TARGET static void dot3(Real const * aRe, Real const * aIm, Real const * bRe, Real const * bIm, const size_t stride, const size_t n, Real * const out) { \
+				V s[3] = {OPS::zero(), OPS::zero(), OPS::zero()}; \
+				size_t i = 0; \
+				for(; i + OPS::W <= n; i += OPS::W) { \
+					const V re = OPS::load(aRe + i), im = OPS::load(aIm + i); \
+					for(size_t j = 0; j < 3; j++) s[j] = OPS::fnmadd(im, OPS::load(bIm + j * stride + i), OPS::fmadd(re, OPS::load(bRe + j * stride + i), s[j])); \
+				} \
+				for(size_t j = 0; j < 3; j++) out[j] = OPS::sum(s[j]) + Scalar<Real>::dot(aRe + i, aIm + i, bRe + j * stride + i, bIm + j * stride + i, n - i); \
+			} \
+			TARGET static void multiply(std::complex<Real> const * a, std::complex<Real> const * b, Real * re, Real * im, const size_t n) { \
+				size_t i = 0; \
+				for(; i + OPS::W <= n; i += OPS::W) { \
+					V aRe, aIm, bRe, bIm; \
+					OPS::deinterleave(reinterpret_cast<Real const*>(a + i), aRe, aIm); \
+					OPS::deinterleave(reinterpret_cast<Real const*>(b + i), bRe, bIm); \
+					OPS::store(re + i, OPS::fmsub(aRe, bRe, OPS::mul(aIm, bIm))); \
+					OPS::store(im + i, OPS::fmadd(aRe, bIm, OPS::mul(aIm, bRe))); \
+				} \
+				Scalar<Real>::multiply(a + i, b + i, re + i, im + i, n - i); \
+			} \
+		};
+
+		SIMD_DEFINE_KERNELS(SseKernelsF, SseF, )
+		SIMD_DEFINE_KERNELS(SseKernelsD, SseD, )
+		SIMD_DEFINE_KERNELS(Avx2KernelsF, Avx2F, SIMD_TARGET_AVX2)
+		SIMD_DEFINE_KERNELS(Avx2KernelsD, Avx2D, SIMD_TARGET_AVX2)
+		SIMD_DEFINE_KERNELS(Avx512KernelsF, Avx512F, SIMD_TARGET_AVX512)
+		SIMD_DEFINE_KERNELS(Avx512KernelsD, Avx512D, SIMD_TARGET_AVX512)
+		#undef SIMD_DEFINE_KERNELS
+#endif
+
+		//@brief: function table for a type
+		template <typename Real>
+		struct Table {
+			Real (*dot)(Real const *, Real const *, Real const *, Real const *, size_t);
+			void (*dot3)(Real const *, Real const *, Real const *, Real const *, size_t, size_t, Real *);
+			void (*multiply)(std::complex<Real> const *, std::complex<Real> const *, Real *, Real *, size_t);
+		};
+
+		template <typename K>
+		Table<typename K::Real> makeTable() {
+			Table<typename K::Real> t = {&K::dot, &K::dot3, &K::multiply};
+			return t;
+		}
+
+		template <typename Real>
+		struct Select {static Table<Real> table(const Level) {return makeTable< Scalar<Real> >();}};
+#ifdef SIMD_X86
+		template <>
+		struct Select<float> {
+			static Table<float> table(const Level l) {
+				switch(l) {
+					case Level::AVX512: return makeTable<Avx512KernelsF>();
+					case Level::AVX2  : return makeTable<Avx2KernelsF  >();
+					case Level::SSE   : return makeTable<SseKernelsF   >();
+					default           : return makeTable< Scalar<float> >();
+				}
+			}
+		};
+		template <>
+		struct Select<double> {
+			static Table<double> table(const Level l) {
+				switch(l) {
+					case Level::AVX512: return makeTable<Avx512KernelsD>();
+					case Level::AVX2  : return makeTable<Avx2KernelsD  >();
+					case Level::SSE   : return makeTable<SseKernelsD   >();
+					default           : return makeTable< Scalar<double> >();
+				}
+			}
+		};
+#endif
+	}
+
+	//@brief: runtime dispatched kernels for a type
+	template <typename Real>
+	struct Kernels {
+		//@brief: get kernels for the best supported instruction set
+		static const detail::Table<Real>& get() {
+			static const detail::Table<Real> t = detail::Select<Real>::table(level());
+			return t;
+		}
+
+		//@brief: compute sum(aRe * bRe - aIm * bIm), the real part of the dot product of two split complex arrays
+		static Real dot(Real const * aRe, Real const * aIm, Real const * bRe, Real const * bIm, const size_t n) {return get().dot(aRe, aIm, bRe, bIm, n);}
+
+		//@brief: compute dot for 3 b arrays (b + 0, b + stride, b + 2 * stride) in a single pass over a
+		static void dot3(Real const * aRe, Real const * aIm, Real const * bRe, Real const * bIm, const size_t stride, const size_t n, Real * const out) {get().dot3(aRe, aIm, bRe, bIm, stride, n, out);}
+
+		//@brief: compute the complex product of 2 interleaved arrays into split real / imaginary arrays
+		static void multiply(std::complex<Real> const * a, std::complex<Real> const * b, Real * re, Real * im, const size_t n) {get().multiply(a, b, re, im, n);}
+	};
+}
+
+#endif//_simd_h_
@@ -0,0 +1,100 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                                 *
+ * Copyright (c) 2017, Reagents of the University of California                    *
+ * All rights reserved.                                                            *
+ *                                                                                 *
+ * Redistribution and use in source and binary forms, with or without              *
+ * modification, are permitted provided that the following conditions are met:     *
+ *                                                                                 *
+ * 1. Redistributions of source code must retain the above copyright notice, this  *
+ *    list of conditions and the following disclaimer.                             *
+ *                                                                                 *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,    *
+ *    this list of conditions and the following disclaimer in the documentation    *
+ *    and/or other materials provided with the distribution.                       *
+ *                                                                                 *
+ * 3. Neither the name of the copyright holder nor the names of its                *
+ *    contributors may be used to endorse or promote products derived from         *
+ *    this software without specific prior written permission.                     *
+ *                                                                                 *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"     *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE  *
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE    *
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL      *
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR      *
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER      *
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,   *
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE   *
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.            *
+ *                                                                                 *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+//benchmark of the row ffts used for alignment: one plan execution per row vs one batched execution per frame (see usage below)
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <utility>
+#include <chrono>
+#include <complex>
+#include <iostream>
+#include <algorithm>
+
+#include "../alignment.hpp"
+
+//@brief: time the fastest of several runs of a function
+//@param runs: number of runs
+//@param f: function to time
+//@return: fastest run in seconds
+template <typename F>
+static double bestOf(const size_t runs, F f) {
+	double best = 0;
+	for(size_t r = 0; r < runs; r++) {
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		f();
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		best = 0 == r ? seconds : std::min(best, seconds);
+	}
+	return best;
+}
+
+int main(int argc, char *argv[]) {
+	//frame sizes
+	std::vector< std::pair<int, int> > sizes;
+	for(int i = 1; i < argc; i++) {
+		int w = 0, h = 0;
+		const int n = sscanf(argv[i], "%dx%d", &w, &h);
+		if(n < 1 || w <= 0 || (2 == n && h <= 0)) {
+			std::cout << "usage: " << argv[0] << " [width[xheight] ...] (defaults to 1024 2048 4096, height defaults to width)\n";
+			return EXIT_FAILURE;
+		}
+		sizes.push_back(std::pair<int, int>(w, 2 == n ? h : w));
+	}
+	if(sizes.empty()) {
+		for(int w = 1024; w <= 4096; w *= 2) sizes.push_back(std::pair<int, int>(w, w));
+	}
+
+	for(const std::pair<int, int>& size : sizes) {
+		//same layout correlateRows uses: contiguous rows on the real side, alignmentFftDist apart on the frequency side
+		const int cols = size.first, rows = size.second;
+		const int fftSizePad = alignmentFftDist(cols);
+		FFTWBuffer<float, float> data((size_t)rows * cols);
+		FFTWBuffer<std::complex<float>, float> fft((size_t)rows * fftSizePad);
+		for(size_t i = 0; i < data.size(); i++) data[i] = float((i * 2654435761u) % 65536);
+		const FFTW<float>& single = FFTWPlans<float>::Get(cols, 1, fftSizePad);
+		const FFTW<float>& batch = FFTWPlans<float>::Get(cols, rows, fftSizePad);
+
+		//forward and inverse transform of every row of a frame (the work of one alignFrame call)
+		const double tRow = bestOf(5, [&]() {
+			for(int i = 0; i < rows; i++) single.forward(data.data() + (size_t)i * cols, fft.data() + (size_t)i * fftSizePad);
+			for(int i = 0; i < rows; i++) single.inverse(data.data() + (size_t)i * cols, fft.data() + (size_t)i * fftSizePad);
+		});
+		const double tBatch = bestOf(5, [&]() {
+			batch.forward(data.data(), fft.data());
+			batch.inverse(data.data(), fft.data());
+		});
+		std::cout << cols << "x" << rows << ": per row " << tRow * 1000.0 << " ms, batched " << tBatch * 1000.0 << " ms (" << tRow / tBatch << "x)\n";
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,119 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                                 *
+ * Copyright (c) 2017, Reagents of the University of California                    *
+ * All rights reserved.                                                            *
+ *                                                                                 *
+ * Redistribution and use in source and binary forms, with or without              *
+ * modification, are permitted provided that the following conditions are met:     *
+ *                                                                                 *
+ * 1. Redistributions of source code must retain the above copyright notice, this  *
+ *    list of conditions and the following disclaimer.                             *
+ *                                                                                 *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,    *
+ *    this list of conditions and the following disclaimer in the documentation    *
+ *    and/or other materials provided with the distribution.                       *
+ *                                                                                 *
+ * 3. Neither the name of the copyright holder nor the names of its                *
+ *    contributors may be used to endorse or promote products derived from         *
+ *    this software without specific prior written permission.                     *
+ *                                                                                 *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"     *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE  *
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE    *
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL      *
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR      *
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER      *
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,   *
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE   *
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.            *
+ *                                                                                 *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+//benchmark of page integration: truncating per sample means vs exact sums with one rounded mean (see usage below)
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+
+#include "../integration.hpp"
+
+//@brief: time the fastest of several runs of a function
+//@param runs: number of runs
+//@param f: function to time
+//@return: fastest run in seconds
+template <typename F>
+static double bestOf(const size_t runs, F f) {
+	double best = 0;
+	for(size_t r = 0; r < runs; r++) {
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		f();
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		best = 0 == r ? seconds : std::min(best, seconds);
+	}
+	return best;
+}
+
+int main(int argc, char *argv[]) {
+	if(argc != 1 && argc != 4) {
+		std::cout << "usage: " << argv[0] << " [width height pages] (defaults to 4096 4096 64)\n";
+		return EXIT_FAILURE;
+	}
+	const size_t width  = argc > 1 ? (size_t)atoi(argv[1]) : 4096;
+	const size_t height = argc > 1 ? (size_t)atoi(argv[2]) : 4096;
+	const size_t nPages = argc > 1 ? (size_t)atoi(argv[3]) : 64;
+	const size_t nPixels = width * height;
+	if(0 == nPixels || 0 == nPages || nPages > 65537) {
+		std::cout << "image must be non empty with 1 - 65537 pages\n";
+		return EXIT_FAILURE;
+	}
+
+	//pseudo random 16 bit pages
+	std::cout << "integrating " << nPages << " pages of " << width << "x" << height << '\n';
+	std::vector<std::vector<std::uint16_t> > pages(nPages, std::vector<std::uint16_t>(nPixels));
+	std::uint32_t state = 12345;
+	for(std::vector<std::uint16_t>& page : pages) {
+		for(std::uint16_t& v : page) {
+			state = state * 1664525u + 1013904223u;
+			v = std::uint16_t(state >> 16);
+		}
+	}
+
+	//previous method: every sample is divided before it is added (a hardware divide per sample, truncates up to n - 1 counts)
+	std::vector<std::uint16_t> truncated(nPixels);
+	const std::uint64_t n = nPages;
+	const double tTruncated = bestOf(3, [&]() {
+		std::fill(truncated.begin(), truncated.end(), 0);
+		for(const std::vector<std::uint16_t>& page : pages) {
+			for(size_t i = 0; i < nPixels; i++) truncated[i] += std::uint16_t(page[i] / n);
+		}
+	});
+
+	//current method: 32 bit sums and a single rounded mean
+	std::vector<std::uint32_t> sums(nPixels);
+	std::vector<std::uint16_t> rounded(nPixels);
+	const RoundedMean mean((std::uint32_t)nPages);
+	const double tRounded = bestOf(3, [&]() {
+		std::fill(sums.begin(), sums.end(), 0);
+		for(const std::vector<std::uint16_t>& page : pages) accumulate(sums.data(), page.data(), nPixels);
+		mean(sums.data(), rounded.data(), nPixels);
+	});
+
+	//error of each method against the exact rounded mean
+	size_t roundedErrors = 0;
+	double truncatedError = 0;
+	for(size_t i = 0; i < nPixels; i++) {
+		const std::uint16_t exact = std::uint16_t((std::uint64_t(sums[i]) + n / 2) / n);
+		if(exact != rounded[i]) ++roundedErrors;
+		truncatedError += double(exact) - truncated[i];
+	}
+
+	const double gb = double(nPixels) * nPages * sizeof(std::uint16_t) / 1e9;
+	std::cout << "truncating per sample mean: " << tTruncated * 1000.0 << " ms (" << gb / tTruncated << " GB/s), mean error " << truncatedError / nPixels << " counts\n";
+	std::cout << "sum then rounded mean:      " << tRounded   * 1000.0 << " ms (" << gb / tRounded   << " GB/s), " << roundedErrors << " pixels differ from exact\n";
+	std::cout << "speedup: " << tTruncated / tRounded << "x\n";
+	return 0 == roundedErrors ? EXIT_SUCCESS : EXIT_FAILURE;
+}
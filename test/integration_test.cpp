@@ -0,0 +1,134 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                                 *
+ * Copyright (c) 2017, Reagents of the University of California                    *
+ * All rights reserved.                                                            *
+ *                                                                                 *
+ * Redistribution and use in source and binary forms, with or without              *
+ * modification, are permitted provided that the following conditions are met:     *
+ *                                                                                 *
+ * 1. Redistributions of source code must retain the above copyright notice, this  *
+ *    list of conditions and the following disclaimer.                             *
+ *                                                                                 *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,    *
+ *    this list of conditions and the following disclaimer in the documentation    *
+ *    and/or other materials provided with the distribution.                       *
+ *                                                                                 *
+ * 3. Neither the name of the copyright holder nor the names of its                *
+ *    contributors may be used to endorse or promote products derived from         *
+ *    this software without specific prior written permission.                     *
+ *                                                                                 *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"     *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE  *
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE    *
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL      *
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR      *
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER      *
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,   *
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE   *
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.            *
+ *                                                                                 *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+//check of the rounded mean kernels against exact division (see usage below)
+//ctest runs a representative set of counts, passing a maximum count checks every count up to it (65537 for the exhaustive sweep)
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <iostream>
+
+#include "../integration.hpp"
+#include "../threadpool.hpp"
+
+static std::mutex logMut;//serializes mismatch reports
+
+//@brief: check a rounded mean against exact division at 0, the largest possible sum, and every multiple of its count +/- 1
+//@param n: number of values in each sum
+//@param sums: working memory
+//@param exact: working memory
+//@param scalar: working memory
+//@param vectorized: working memory
+//@return: number of sums checked and number of mismatches
+static std::pair<size_t, size_t> checkCount(const std::uint32_t n, std::vector<std::uint32_t>& sums, std::vector<std::uint16_t>& exact, std::vector<std::uint16_t>& scalar, std::vector<std::uint16_t>& vectorized) {
+	//(k * n + d + n / 2) / n = k + q[d + 1] for q[d + 1] = (n + d + n / 2) / n - 1, so only 3 divisions are needed per count
+	std::uint32_t q[3];
+	for(int d = -1; d <= 1; d++) q[d + 1] = (n + d + n / 2) / n - 1;
+
+	//every multiple of n +/- 1 in order, the first and last values (-1 and 65535 * n + 1) are replaced with 0 and 65535 * n
+	const size_t count = 65536 * 3;
+	sums.resize(count);
+	exact.resize(count);
+	for(std::uint32_t k = 0; k <= 65535; k++) {
+		for(std::uint32_t d = 0; d < 3; d++) {
+			sums [k * 3 + d] = k * n + d - 1;
+			exact[k * 3 + d] = std::uint16_t(k + q[d]);
+		}
+	}
+	sums.front() = 0;
+	exact.front() = 0;
+	sums.back() = 65535 * n;
+	exact.back() = 65535;
+
+	//evaluate both paths
+	const RoundedMean mean(n);
+	scalar.resize(count);
+	vectorized.resize(count);
+	for(size_t i = 0; i < count; i++) scalar[i] = mean(sums[i]);
+	mean(sums.data(), vectorized.data(), count);//sse2 path (when available) with a scalar tail
+
+	size_t bad = 0;
+	for(size_t i = 0; i < count; i++) bad += (exact[i] != scalar[i] || exact[i] != vectorized[i]) ? 1 : 0;
+	for(size_t i = 0; i < count && bad > 0; i++) {
+		if(exact[i] == scalar[i] && exact[i] == vectorized[i]) continue;
+		std::lock_guard<std::mutex> lock(logMut);
+		std::cout << "n = " << n << ", sum = " << sums[i] << ": expected " << exact[i] << ", scalar " << scalar[i] << ", vectorized " << vectorized[i] << '\n';
+		break;
+	}
+	return std::pair<size_t, size_t>(count, bad);
+}
+
+//@brief: get a representative set of counts
+//@return: every count up to 512, each power of 2 and its neighbors (where the multiplier's shift changes),
+//         the switch from multiply to divide, the largest counts, and every 97th count in between
+static std::vector<std::uint32_t> representativeCounts() {
+	std::set<std::uint32_t> counts;
+	for(std::uint32_t n = 1; n <= 512; n++) counts.insert(n);
+	for(std::uint32_t p = 1024; p <= 65536; p *= 2) {//smaller powers are already included
+		for(std::uint32_t n = p - 2; n <= std::min<std::uint32_t>(p + 2, 65537); n++) counts.insert(n);
+	}
+	const std::uint32_t edges[] = {16383, 16384, 16385, 16386, 32767, 32768, 32769, 65535, 65536, 65537};
+	counts.insert(edges, edges + sizeof(edges) / sizeof(edges[0]));
+	for(std::uint32_t n = 513; n <= 65537; n += 97) counts.insert(n);
+	return std::vector<std::uint32_t>(counts.begin(), counts.end());
+}
+
+int main(int argc, char *argv[]) {
+	std::vector<std::uint32_t> counts;
+	if(argc > 2 || (2 == argc && (atoi(argv[1]) < 1 || atoi(argv[1]) > 65537))) {
+		std::cout << "usage: " << argv[0] << " [maxCount] (check every count 1 - maxCount <= 65537, defaults to a representative set of counts)\n";
+		return EXIT_FAILURE;
+	}
+	if(2 == argc) {
+		for(std::uint32_t n = 1; n <= (std::uint32_t)atoi(argv[1]); n++) counts.push_back(n);//65537 checks every count a RoundedMean accepts (~13 billion sums)
+	} else {
+		counts = representativeCounts();
+	}
+
+	//check counts in parallel
+	std::atomic<size_t> checked(0), failures(0);
+	ThreadPool::Shared().parallelFor(0, counts.size(), [&](const size_t i) {
+		static thread_local std::vector<std::uint32_t> sums;
+		static thread_local std::vector<std::uint16_t> exact, scalar, vectorized;
+		const std::pair<size_t, size_t> result = checkCount(counts[i], sums, exact, scalar, vectorized);
+		checked += result.first;
+		failures += result.second;
+	}, 16);
+
+	std::cout << checked << " sums checked for " << counts.size() << " counts (1 - " << counts.back() << "), " << failures << " mismatches\n";
+	return 0 == failures ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,139 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                                 *
+ * Copyright (c) 2017, Reagents of the University of California                    *
+ * All rights reserved.                                                            *
+ *                                                                                 *
+ * Redistribution and use in source and binary forms, with or without              *
+ * modification, are permitted provided that the following conditions are met:     *
+ *                                                                                 *
+ * 1. Redistributions of source code must retain the above copyright notice, this  *
+ *    list of conditions and the following disclaimer.                             *
+ *                                                                                 *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,    *
+ *    this list of conditions and the following disclaimer in the documentation    *
+ *    and/or other materials provided with the distribution.                       *
+ *                                                                                 *
+ * 3. Neither the name of the copyright holder nor the names of its                *
+ *    contributors may be used to endorse or promote products derived from         *
+ *    this software without specific prior written permission.                     *
+ *                                                                                 *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"     *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE  *
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE    *
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL      *
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR      *
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER      *
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,   *
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE   *
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.            *
+ *                                                                                 *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+//check of the sub pixel methods against the kernel walk on synthetic rows with known shifts, with timings (see usage below)
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+
+#include "../alignment.hpp"
+
+//@brief: fill frames with band limited periodic rows, each frame is the last (reference) frame with every row shifted by a known amount
+//@param frames: location to write frames (count x rows x cols)
+//@param shifts: location to write the shift of each row of each moving frame in pixels (count - 1 x rows)
+//@param rows: frame height
+//@param cols: frame width
+//@param count: number of frames (including the reference)
+//@param maxShift: largest shift to apply in pixels (row shifts are within +/-maxShift)
+static void syntheticFrames(std::vector< std::vector<float> >& frames, std::vector< std::vector<double> >& shifts, const int rows, const int cols, const size_t count, const double maxShift) {
+	static const double pi = 3.14159265358979323846;
+	std::mt19937 gen(12345);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+	//a few random sinusoids per row (integer frequencies so rows are periodic and a circular shift is exact)
+	const size_t nWaves = 12;
+	std::vector<double> freq((size_t)rows * nWaves), phase(freq.size()), amp(freq.size());
+	for(size_t i = 0; i < freq.size(); i++) {
+		freq[i] = 1 + std::floor(uniform(gen) * (cols / 8));
+		phase[i] = 2 * pi * uniform(gen);
+		amp[i] = 100 + 400 * uniform(gen);
+	}
+	auto row = [&](const int i, const double x) {
+		double v = 2000;
+		for(size_t k = 0; k < nWaves; k++) v += amp[i * nWaves + k] * std::cos(2 * pi * freq[i * nWaves + k] * x / cols + phase[i * nWaves + k]);
+		return float(v);
+	};
+
+	frames.assign(count, std::vector<float>((size_t)rows * cols));
+	shifts.assign(count - 1, std::vector<double>(rows));
+	for(size_t f = 0; f < count; f++) {
+		const double offset = (uniform(gen) - 0.5) * maxShift;
+		const double slope = (uniform(gen) - 0.5) * maxShift;
+		for(int i = 0; i < rows; i++) {
+			const double d = f + 1 == count ? 0 : offset + slope * (2.0 * i / std::max(rows - 1, 1) - 1);//linearly varying sub pixel shift (unchanged by the per row smoothing)
+			if(f + 1 != count) shifts[f][i] = d;
+			for(int j = 0; j < cols; j++) frames[f][(size_t)i * cols + j] = row(i, j - d);
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	int cols = 256, rows = 64, count = 9;
+	if(argc > 1) cols = atoi(argv[1]);
+	if(argc > 2) rows = atoi(argv[2]);
+	if(argc > 3) count = atoi(argv[3]);
+	if(argc > 4 || cols < 32 || rows < 1 || count < 2) {
+		std::cout << "usage: " << argv[0] << " [width [height [frames]]] (defaults to 256 64 9)\n";
+		return EXIT_FAILURE;
+	}
+	const int upsample = 16;
+	const float maxShift = 8;
+	std::vector< std::vector<float> > original;
+	std::vector< std::vector<double> > truth;
+	syntheticFrames(original, truth, rows, cols, (size_t)count, maxShift * 0.5);
+
+	//align with every method and keep the shift applied to each row
+	const SubpixelMethod methods[4] = {SubpixelMethod::KernelWalk, SubpixelMethod::Parabolic, SubpixelMethod::Gaussian, SubpixelMethod::LocalDft};
+	const char* names[4] = {"kernel walk", "parabolic", "gaussian", "local dft"};
+	const double tolerance[4] = {0, 0.1, 0.1, 1.0 / upsample};//largest allowed difference from the kernel walk in pixels
+	std::vector< std::vector< std::vector<float> > > rowShifts(4);
+	bool pass = true;
+	for(size_t m = 0; m < 4; m++) {
+		std::vector< std::vector<float> > frames = original;
+		correlateRows<float>(frames, rows, cols, false, maxShift, upsample, methods[m], ShiftProfile::PerRow);//warm up plans, kernels, and workspaces
+
+		double best = 0;
+		std::vector< AlignResult<float> > results;
+		for(size_t r = 0; r < 3; r++) {
+			frames = original;
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			results = correlateRows<float>(frames, rows, cols, false, maxShift, upsample, methods[m], ShiftProfile::PerRow, &rowShifts[m]);
+			const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			best = 0 == r ? seconds : std::min(best, seconds);
+		}
+
+		//compare every row with the kernel walk (and the known shift)
+		double maxDiff = 0, maxError = 0, sumError = 0;
+		size_t failed = 0;
+		for(size_t f = 0; f + 1 < (size_t)count; f++) {
+			failed += results[f].failedRows;
+			for(int i = 0; i < rows; i++) {
+				const double found = rowShifts[m][f][i];
+				const double error = std::fabs(found - truth[f][i]);
+				maxDiff = std::max(maxDiff, std::fabs(found - rowShifts[0][f][i]));
+				maxError = std::max(maxError, error);
+				sumError += error;
+			}
+		}
+		const double meanError = sumError / ((count - 1) * rows);
+		const bool ok = 0 == failed && maxDiff <= tolerance[m] && meanError <= 1.0 / upsample;//the smoothing of the row shifts isn't exact at the edges so only the mean error is checked
+		pass = pass && ok;
+		printf("%-12s %8.3f ms/frame, max |shift - kernel walk| %.4f px, shift error mean %.4f max %.4f px, %zu failed rows%s\n", names[m], best * 1000.0 / (count - 1), maxDiff, meanError, maxError, failed, ok ? "" : " (FAILED)");
+	}
+	return pass ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,242 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                                 *
+ * Copyright (c) 2017, Reagents of the University of California                    *
+ * All rights reserved.                                                            *
+ *                                                                                 *
+ * Redistribution and use in source and binary forms, with or without              *
+ * modification, are permitted provided that the following conditions are met:     *
+ *                                                                                 *
+ * 1. Redistributions of source code must retain the above copyright notice, this  *
+ *    list of conditions and the following disclaimer.                             *
+ *                                                                                 *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,    *
+ *    this list of conditions and the following disclaimer in the documentation    *
+ *    and/or other materials provided with the distribution.                       *
+ *                                                                                 *
+ * 3. Neither the name of the copyright holder nor the names of its                *
+ *    contributors may be used to endorse or promote products derived from         *
+ *    this software without specific prior written permission.                     *
+ *                                                                                 *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"     *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE  *
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE    *
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL      *
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR      *
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER      *
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,   *
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE   *
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.            *
+ *                                                                                 *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef _threadpool_h_
+#define _threadpool_h_
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <chrono>
+#include <algorithm>
+
+//@brief: persistent pool of worker threads with work stealing
+//@note: each worker owns a queue, it runs its newest task first and steals the oldest task from another queue when its own is empty
+class ThreadPool {
+public:
+	typedef std::function<void()> Task;
+
+private:
+	struct Queue {
+		std::mutex mut;
+		std::deque<Task> tasks;
+	};
+
+	std::vector< std::unique_ptr<Queue> > queues;//one per worker
+	std::vector<std::thread> threads;            //workers
+	std::atomic<size_t> queued;                  //number of tasks waiting in any queue
+	std::atomic<size_t> next;                    //queue for the next task submitted from outside the pool
+	bool stopping;                               //true once the pool is being destroyed
+	std::mutex sleepMut;                         //protects sleeping workers
+	std::condition_variable sleepCv;             //signaled when tasks are queued or the pool is stopped
+
+	//@brief: identify the pool and worker of the calling thread
+	struct Identity {
+		ThreadPool const * pool;
+		size_t index;
+	};
+	static Identity& identity() {
+		static thread_local Identity id = {NULL, 0};
+		return id;
+	}
+
+	//@brief: take a task, preferring the newest task in queue 'first' then the oldest task of every other queue
+	//@param first: queue to check first
+	//@param task: location to write task
+	//@return: true if a task was taken
+	bool take(const size_t first, Task& task) {
+		if(0 == queued.load()) return false;
+		for(size_t i = 0; i < queues.size(); i++) {
+			Queue& q = *queues[(first + i) % queues.size()];
+			std::lock_guard<std::mutex> lock(q.mut);
+			if(q.tasks.empty()) continue;
+			if(0 == i) {
+				task = std::move(q.tasks.back());
+				q.tasks.pop_back();
+			} else {
+				task = std::move(q.tasks.front());
+				q.tasks.pop_front();
+			}
+			--queued;
+			return true;
+		}
+		return false;
+	}
+
+	//@brief: worker loop
+	//@param index: index of worker
+	void work(const size_t index) {
+		identity().pool = this;
+		identity().index = index;
+		Task task;
+		while(true) {
+			if(take(index, task)) {
+				task();
+				task = Task();
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(sleepMut);
+			sleepCv.wait(lock, [&]{return stopping || queued.load() > 0;});
+			if(stopping && 0 == queued.load()) return;
+		}
+	}
+
+public:
+	//@param count: number of worker threads (0 to use one per core)
+	explicit ThreadPool(size_t count = 0) : queued(0), next(0), stopping(false) {
+		if(0 == count) count = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+		for(size_t i = 0; i < count; i++) queues.push_back(std::unique_ptr<Queue>(new Queue()));
+		for(size_t i = 0; i < count; i++) threads.push_back(std::thread(&ThreadPool::work, this, i));
+	}
+
+	//@brief: finish all queued tasks and join workers
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(sleepMut);
+			stopping = true;
+		}
+		sleepCv.notify_all();
+		for(std::thread& t : threads) t.join();
+	}
+
+	//@brief: get a pool shared by the whole program (created on first use with one worker per core)
+	static ThreadPool& Shared() {
+		static ThreadPool pool;
+		return pool;
+	}
+
+	//@brief: get the number of worker threads
+	size_t size() const {return threads.size();}
+
+	//@brief: get the index of the calling thread
+	//@return: worker index in [0, size()) or size() for threads that don't belong to this pool
+	size_t workerIndex() const {
+		const Identity& id = identity();
+		return this == id.pool ? id.index : threads.size();
+	}
+
+	//@brief: queue a task (tasks submitted from a worker go to its own queue, others are distributed round robin)
+	//@param task: task to run, exceptions must be handled by the task
+	void submit(Task task) {
+		const size_t self = workerIndex();
+		const size_t index = self < queues.size() ? self : next++ % queues.size();
+		{
+			std::lock_guard<std::mutex> lock(queues[index]->mut);
+			queues[index]->tasks.push_back(std::move(task));
+			++queued;
+		}
+		{
+			std::lock_guard<std::mutex> lock(sleepMut);//make sure a worker checking the queue count can't miss the notification
+		}
+		sleepCv.notify_one();
+	}
+
+	//@brief: run a single queued task on the calling thread if one is available
+	//@return: true if a task was run
+	bool runOne() {
+		Task task;
+		const size_t self = workerIndex();
+		if(!take(self < queues.size() ? self : 0, task)) return false;
+		task();
+		return true;
+	}
+
+	//@brief: call body(i) for every i in [begin, end) and wait for completion, the calling thread helps while waiting
+	//@param begin: first index
+	//@param end: one past last index
+	//@param body: function to call for each index
+	//@param grain: number of consecutive indices per task
+	//@note: the first exception thrown by body is rethrown once every task has finished
+	//@note: a calling thread from outside the pool only runs chunks of its own loop, so workerIndex() is unique among the
+	//       threads running body even when several outside threads call parallelFor at once (pool workers may help with any task)
+	void parallelFor(const size_t begin, const size_t end, const std::function<void(size_t)>& body, size_t grain = 1) {
+		if(end <= begin) return;
+		if(0 == grain) grain = 1;
+
+		struct State {
+			size_t begin, end, grain, chunks;
+			std::function<void(size_t)> const * body;
+			std::atomic<size_t> next;     //next chunk to claim
+			std::atomic<size_t> remaining;//chunks not yet finished
+			std::exception_ptr error;
+			std::mutex mut;
+			std::condition_variable cv;
+
+			//@brief: claim and run the next chunk
+			//@return: false if every chunk was already claimed (body isn't touched, it may no longer exist)
+			bool runChunk() {
+				const size_t c = next++;
+				if(c >= chunks) return false;
+				const size_t first = begin + c * grain;
+				const size_t last = std::min(end, first + grain);
+				try {
+					for(size_t i = first; i < last; i++) (*body)(i);
+				} catch (...) {
+					std::lock_guard<std::mutex> lock(mut);
+					if(!error) error = std::current_exception();
+				}
+				if(0 == --remaining) {
+					std::lock_guard<std::mutex> lock(mut);
+					cv.notify_all();
+				}
+				return true;
+			}
+		};
+		std::shared_ptr<State> state = std::make_shared<State>();
+		state->begin = begin;
+		state->end = end;
+		state->grain = grain;
+		state->chunks = (end - begin + grain - 1) / grain;
+		state->body = &body;
+		state->next = 0;
+		state->remaining = state->chunks;
+		for(size_t t = 1; t < state->chunks; t++) submit([state]() {state->runChunk();});//the caller takes at least one chunk itself
+
+		//run chunks of this loop, then help until every chunk has finished (chunks may be running on other threads)
+		while(state->runChunk()) {}
+		const bool worker = workerIndex() < size();
+		while(state->remaining.load() > 0) {
+			if(worker && runOne()) continue;
+			std::unique_lock<std::mutex> lock(state->mut);
+			state->cv.wait_for(lock, std::chrono::milliseconds(1), [&]{return 0 == state->remaining.load();});
+		}
+		if(state->error) std::rethrow_exception(state->error);
+	}
+};
+
+#endif//_threadpool_h_
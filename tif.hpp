@@ -42,6 +42,43 @@
 #include <limits>
 #include <vector>
 #include <numeric>
+#include <map>
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <type_traits>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <exception>
+#include <cctype>
+
+#ifdef EXTERNAL_SCAN_USE_ZLIB
+	#include <zlib.h>
+#endif
+#ifdef EXTERNAL_SCAN_USE_ZSTD
+	#include <zstd.h>
+#endif
+
+#ifdef _WIN32
+	#ifndef NOMINMAX
+		#define NOMINMAX//windows min/max definitions conflict with std
+	#endif
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+#include "threadpool.hpp"
+
+struct TifOptions;
 
 struct Tif {
 	std::uint32_t width, height;
@@ -58,8 +95,8 @@ struct Tif {
 			} _short;
 		} value;
 
-		void setValue(const std::uint32_t v) {value._long     = v; type = 0x0004;}
-		void setValue(const std::uint16_t v) {value._short.v0 = v; type = 0x0003;}
+		void setValue(const std::uint32_t v) {value._long = v; type = 0x0004;}
+		void setValue(const std::uint16_t v) {value._long = 0; value._short.v0 = v; type = 0x0003;}//clear unused bytes so they aren't written as garbage
 		IfdEntry(const std::uint16_t t, const std::uint32_t v) : tag(t), valueCount(0x0001) {setValue(v);}
 		IfdEntry(const std::uint16_t t, const std::uint16_t v) : tag(t), valueCount(0x0001) {setValue(v);}
 	};
@@ -114,38 +151,1137 @@ struct Tif {
 		for (int i = 0; i < int(height); i++) os.write(reinterpret_cast<char const*>(data)+i * rowBytes, rowBytes);
 	}
 
+	//@brief: get/set the compression and layout used by Write (defaults to uncompressed strips)
+	static TifOptions& options();
+
 	template <typename T>
-	static void Write(T const * const data, const std::uint32_t w, const std::uint32_t h, std::string fileName) {
-		//open file and write header + single ifd
-		Tif tif(w, h);
-		std::ofstream os(fileName, std::ios::out | std::ios::binary);
-		tif.writeHeader(os);
-		tif.writeIfd<T>(os, 0x00000008, true);
-		tif.writeSlice<T>(os, data);
+	static void Write(T const * const data, const std::uint32_t w, const std::uint32_t h, std::string fileName) {Write(&data, w, h, 1, fileName);}
+
+	template <typename T>
+	static void Write(T const * const * const data, const std::uint32_t w, const std::uint32_t h, const std::uint32_t slices, std::string fileName);
+
+	template <typename T> static void Write(std::vector<T>& buff, const std::uint32_t w, const std::uint32_t h, std::string fileName) {Write(buff.data(), w, h, fileName);}
+	template <typename T>	static void Write(std::vector< std::vector<T> >& buff, const std::uint32_t w, const std::uint32_t h, std::string fileName) {
+		std::vector<T const *> slicePointers(buff.size());
+		for(size_t i = 0; i < buff.size(); i++) slicePointers[i] = buff[i].data();
+		Write(slicePointers.data(), w, h, (std::uint32_t)slicePointers.size(), fileName);
+	}
+
+	private:
+		Tif(const std::uint32_t w, const std::uint32_t h) : width(w), height(h) {}
+};
+
+//@brief: supported tif compression schemes (values are the tif compression tag)
+//@note: lzw is built in, deflate requires zlib (EXTERNAL_SCAN_USE_ZLIB) and zstd requires libzstd (EXTERNAL_SCAN_USE_ZSTD)
+enum class TifCompression : std::uint16_t {
+	None    = 1,
+	Lzw     = 5,
+	Deflate = 8,
+	Zstd    = 50000
+};
+
+//@brief: check if a compression scheme was compiled in
+inline bool available(const TifCompression c) {
+	switch(c) {
+		case TifCompression::None   : return true;
+		case TifCompression::Lzw    : return true;
+#ifdef EXTERNAL_SCAN_USE_ZLIB
+		case TifCompression::Deflate: return true;
+#endif
+#ifdef EXTERNAL_SCAN_USE_ZSTD
+		case TifCompression::Zstd   : return true;
+#endif
+		default: return false;
+	}
+}
+
+//@brief: parse a compression scheme name
+//@param name: none, lzw, deflate, or zstd (case insensitive)
+//@return: compression scheme
+inline TifCompression parseTifCompression(std::string name) {
+	std::transform(name.begin(), name.end(), name.begin(), [](char c){return (char)std::tolower((unsigned char)c);});
+	TifCompression c;
+	if     ("none"    == name) c = TifCompression::None;
+	else if("lzw"     == name) c = TifCompression::Lzw;
+	else if("deflate" == name || "zip" == name) c = TifCompression::Deflate;
+	else if("zstd"    == name) c = TifCompression::Zstd;
+	else throw std::runtime_error("unknown tif compression '" + name + "' (expected none, lzw, deflate, or zstd)");
+	if(!available(c)) throw std::runtime_error("tif compression '" + name + "' isn't available in this build");
+	return c;
+}
+
+//@brief: how pages are encoded
+struct TifOptions {
+	TifCompression compression;//compression applied to every block
+	std::uint32_t tileSize;    //square tile size (multiple of 16) or 0 for strips
+	std::uint32_t levels;      //number of reduced resolution (2x2 box filtered) copies stored as sub ifds of each page
+
+	TifOptions() : compression(TifCompression::None), tileSize(0), levels(0) {}
+
+	//@brief: check that options can be written
+	void validate() const {
+		if(!available(compression)) throw std::runtime_error("tif compression isn't available in this build");
+		if(0 != tileSize % 16) throw std::runtime_error("tif tile size must be a multiple of 16");
+	}
+};
+
+namespace detail {
+	//@brief: unsigned integer with the same size as a sample
+	template <size_t N> struct UnsignedBytes;
+	template <> struct UnsignedBytes<1> {typedef std::uint8_t  type;};
+	template <> struct UnsignedBytes<2> {typedef std::uint16_t type;};
+	template <> struct UnsignedBytes<4> {typedef std::uint32_t type;};
+	template <> struct UnsignedBytes<8> {typedef std::uint64_t type;};
+
+	//@brief: replace each sample with its difference from the previous sample in the row (tif horizontal predictor)
+	template <typename T>
+	void horizontalDifference(T * const data, const size_t w, const size_t h) {
+		typedef typename UnsignedBytes<sizeof(T)>::type U;//wrap around instead of signed overflow
+		for(size_t r = 0; r < h; r++) {
+			U* const row = reinterpret_cast<U*>(data + r * w);
+			for(size_t c = w - 1; c > 0; c--) row[c] = U(row[c] - row[c-1]);
+		}
+	}
+
+	//@brief: reduce an image by 2 in each direction with a 2x2 box filter (odd edges are replicated)
+	//@param src: image to reduce (h rows of w values)
+	//@param w: width of src
+	//@param h: height of src
+	//@param dst: location to write reduced image ((w+1)/2 x (h+1)/2)
+	template <typename T>
+	void halve(T const * const src, const size_t w, const size_t h, T * const dst) {
+		const size_t wOut = (w + 1) / 2, hOut = (h + 1) / 2;
+		for(size_t r = 0; r < hOut; r++) {
+			T const * const r0 = src + (2 * r) * w;
+			T const * const r1 = src + std::min(2 * r + 1, h - 1) * w;
+			T * const out = dst + r * wOut;
+			for(size_t c = 0; c < wOut; c++) {
+				const size_t c0 = 2 * c, c1 = std::min(2 * c + 1, w - 1);
+				if(std::numeric_limits<T>::is_integer) {
+					const std::int64_t sum = std::int64_t(r0[c0]) + r0[c1] + r1[c0] + r1[c1];
+					out[c] = T((sum + 2) >> 2);//rounded (half up) mean, can't overflow T
+				} else {
+					out[c] = T((r0[c0] + r0[c1] + r1[c0] + r1[c1]) / 4);
+				}
+			}
+		}
+	}
+
+	//@brief: tif flavored lzw (msb first codes, 9 to 12 bits, width increases one code early)
+	//@param src: bytes to encode
+	//@param count: number of bytes
+	//@param dst: location to append encoded bytes
+	inline void lzwEncode(std::uint8_t const * const src, const size_t count, std::vector<char>& dst) {
+		const std::uint32_t Clear = 256, Eoi = 257, First = 258, Last = 4094;//table is reset once code 4094 would be assigned
+		const size_t HashSize = 8191;//prime larger than the 4096 codes
+		std::vector<std::uint32_t> keys(HashSize);//(prefix << 8 | byte) + 1, 0 for empty
+		std::vector<std::uint16_t> codes(HashSize);
+
+		//msb first bit packing
+		std::uint32_t bits = 9;
+		std::uint64_t acc = 0;
+		int held = 0;
+		auto put = [&](const std::uint32_t code) {
+			acc = (acc << bits) | code;
+			held += bits;
+			while(held >= 8) {
+				held -= 8;
+				dst.push_back(char(acc >> held));
+			}
+		};
+
+		std::uint32_t next = First;
+		std::fill(keys.begin(), keys.end(), 0);
+		put(Clear);
+		if(count > 0) {
+			std::uint32_t prefix = src[0];
+			for(size_t i = 1; i < count; i++) {
+				const std::uint32_t key = (prefix << 8 | src[i]) + 1;
+				size_t h = key % HashSize;
+				while(0 != keys[h] && key != keys[h]) h = h + 1 == HashSize ? 0 : h + 1;
+				if(key == keys[h]) {//extend current string
+					prefix = codes[h];
+					continue;
+				}
+				put(prefix);
+				keys[h] = key;
+				codes[h] = (std::uint16_t)next++;
+				if(Last == next) {
+					put(Clear);
+					std::fill(keys.begin(), keys.end(), 0);
+					next = First;
+					bits = 9;
+				} else if(next > (1u << bits) - 1) {
+					++bits;
+				}
+				prefix = src[i];
+			}
+			put(prefix);
+
+			//the decoder adds a table entry for the final code so the end code may need to be wider
+			if(++next > (1u << bits) - 1 && bits < 12) ++bits;
+		}
+		put(Eoi);
+		if(held > 0) dst.push_back(char(acc << (8 - held)));
+	}
+
+	//@brief: compress a block of rows
+	//@param data: rows to encode (w * h samples)
+	//@param w: samples per row
+	//@param h: number of rows
+	//@param compression: scheme to use (must not be none)
+	//@param predictor: true to apply the horizontal predictor before compression
+	//@return: encoded bytes
+	template <typename T>
+	std::vector<char> encodeBlock(T const * const data, const size_t w, const size_t h, const TifCompression compression, const bool predictor) {
+		const size_t bytes = w * h * sizeof(T);
+		std::vector<T> diff;
+		std::uint8_t const * src = reinterpret_cast<std::uint8_t const*>(data);
+		if(predictor) {
+			diff.assign(data, data + w * h);
+			horizontalDifference(diff.data(), w, h);
+			src = reinterpret_cast<std::uint8_t const*>(diff.data());
+		}
+
+		std::vector<char> out;
+		switch(compression) {
+			case TifCompression::Lzw:
+				out.reserve(bytes / 2);
+				lzwEncode(src, bytes, out);
+				break;
+
+#ifdef EXTERNAL_SCAN_USE_ZLIB
+			case TifCompression::Deflate: {
+				uLongf len = compressBound((uLong)bytes);
+				out.resize(len);
+				if(Z_OK != compress2(reinterpret_cast<Bytef*>(out.data()), &len, src, (uLong)bytes, Z_DEFAULT_COMPRESSION)) throw std::runtime_error("deflate compression failed");
+				out.resize(len);
+			} break;
+#endif
+
+#ifdef EXTERNAL_SCAN_USE_ZSTD
+			case TifCompression::Zstd: {
+				out.resize(ZSTD_compressBound(bytes));
+				const size_t len = ZSTD_compress(out.data(), out.size(), src, bytes, 3);
+				if(ZSTD_isError(len)) throw std::runtime_error(std::string("zstd compression failed: ") + ZSTD_getErrorName(len));
+				out.resize(len);
+			} break;
+#endif
+
+			default: throw std::runtime_error("unsupported tif compression");
+		}
+		return out;
+	}
+}
+
+inline TifOptions& Tif::options() {
+	static TifOptions opts;
+	return opts;
+}
+
+//@brief: builder for a tif image file directory (classic or BigTIFF)
+//@note: layout is an entry count, entries sorted by tag, an offset to the next ifd, then any values too large to hold in an entry (word aligned)
+//       classic: 2 byte count, 12 byte entries with 4 byte values, 4 byte offsets
+//       BigTIFF: 8 byte count, 20 byte entries with 8 byte values, 8 byte offsets
+class TifIfd {
+public:
+	//@param big: true for BigTIFF layout
+	explicit TifIfd(const bool big = true) : isBig(big) {}
+
+	//@brief: set a tag to an array of values (the field type is chosen from T)
+	//@param tag: tag to set (replaces existing values)
+	//@param values: values to store
+	//@param count: number of values
+	template <typename T>
+	void set(const std::uint16_t tag, T const * const values, const std::uint64_t count) {
+		if(!isBig && 8 == sizeof(T) && std::is_integral<T>::value) throw std::runtime_error("64 bit integer tags require BigTIFF");
+		Entry& e = entries[tag];
+		e.type = FieldType<T>();
+		e.count = count;
+		e.bytes.assign(reinterpret_cast<char const*>(values), reinterpret_cast<char const*>(values) + count * sizeof(T));
+	}
+	template <typename T> void set(const std::uint16_t tag, const T value) {set(tag, &value, 1);}
+	template <typename T> void set(const std::uint16_t tag, const std::vector<T>& values) {set(tag, values.data(), values.size());}
+
+	//@brief: set a tag to a string (stored as null terminated ascii)
+	void set(const std::uint16_t tag, const std::string& text) {
+		Entry& e = entries[tag];
+		e.type = 2;
+		e.count = text.size() + 1;
+		e.bytes.assign(text.c_str(), text.c_str() + e.count);
+	}
+
+	//@brief: set a tag to file offsets (long for classic, long8 for BigTIFF)
+	//@param ifds: true if the offsets point to ifds (ifd / ifd8 type)
+	void setOffsets(const std::uint16_t tag, const std::vector<std::uint64_t>& offsets, const bool ifds = false) {
+		if(isBig) {
+			set(tag, offsets);
+		} else {
+			std::vector<std::uint32_t> narrow(offsets.size());
+			for(size_t i = 0; i < offsets.size(); i++) {
+				if(offsets[i] > std::numeric_limits<std::uint32_t>::max()) throw std::runtime_error("tif exceeds 4 GB (BigTIFF is required)");
+				narrow[i] = (std::uint32_t)offsets[i];
+			}
+			set(tag, narrow);
+		}
+		if(ifds) entries[tag].type = isBig ? 18 : 13;
+	}
+
+	//@brief: get the size of the serialized ifd including values that don't fit in their entry
+	std::uint64_t size() const {
+		std::uint64_t bytes = nextPosition() + offsetBytes();
+		for(const std::pair<const std::uint16_t, Entry>& e : entries) {
+			if(e.second.bytes.size() > offsetBytes()) bytes += padded(e.second.bytes.size());
+		}
+		return bytes;
+	}
+
+	//@brief: get the position of the next ifd offset relative to the start of the ifd
+	std::uint64_t nextPosition() const {return (isBig ? 8 : 2) + entryBytes() * entries.size();}
+
+	//@brief: get the size of offsets in the file
+	std::uint64_t offsetBytes() const {return isBig ? 8 : 4;}
+
+	//@brief: serialize the ifd (with a next ifd offset of 0)
+	//@param offset: file offset the ifd will be written at (must be a multiple of 2)
+	//@param out: location to append serialized bytes
+	void serialize(const std::uint64_t offset, std::vector<char>& out) const {
+		const size_t start = out.size();
+		out.resize(start + (size_t)size(), 0);
+		char * const ifd = out.data() + start;
+		const std::uint64_t count = entries.size();
+		const std::uint16_t count16 = (std::uint16_t)count;
+		if(isBig) std::memcpy(ifd, &count, 8);
+		else std::memcpy(ifd, &count16, 2);
+		std::uint64_t extra = nextPosition() + offsetBytes();//position of next out of line value
+		char* entry = ifd + (isBig ? 8 : 2);
+		const size_t value = isBig ? 12 : 8;
+		for(const std::pair<const std::uint16_t, Entry>& e : entries) {
+			const std::uint32_t count32 = (std::uint32_t)e.second.count;
+			std::memcpy(entry    , &e.first      , 2);
+			std::memcpy(entry + 2, &e.second.type, 2);
+			if(isBig) std::memcpy(entry + 4, &e.second.count, 8);
+			else std::memcpy(entry + 4, &count32, 4);
+			if(e.second.bytes.size() <= offsetBytes()) {
+				std::copy(e.second.bytes.begin(), e.second.bytes.end(), entry + value);//left justified in the value field
+			} else {
+				const std::uint64_t valueOffset = offset + extra;
+				const std::uint32_t valueOffset32 = (std::uint32_t)valueOffset;
+				if(isBig) std::memcpy(entry + value, &valueOffset, 8);
+				else std::memcpy(entry + value, &valueOffset32, 4);
+				std::copy(e.second.bytes.begin(), e.second.bytes.end(), ifd + extra);
+				extra += padded(e.second.bytes.size());
+			}
+			entry += entryBytes();
+		}
+	}
+
+private:
+	struct Entry {
+		std::uint16_t type;     //tiff field type
+		std::uint64_t count;    //number of values
+		std::vector<char> bytes;//values in native byte order
+	};
+	std::map<std::uint16_t, Entry> entries;//tiff requires entries sorted by tag
+	bool isBig;                            //BigTIFF layout
+
+	std::uint64_t entryBytes() const {return isBig ? 20 : 12;}
+	std::uint64_t padded(const std::uint64_t bytes) const {return (bytes + offsetBytes() - 1) / offsetBytes() * offsetBytes();}
+
+	//@brief: get the tiff field type of a c++ type
+	template <typename T>
+	static std::uint16_t FieldType() {
+		static_assert(std::is_arithmetic<T>::value, "tif fields must be arithmetic types");
+		if(std::is_floating_point<T>::value) return 8 == sizeof(T) ? 12 : 11;//double : float
+		switch(sizeof(T)) {
+			case 1: return std::is_signed<T>::value ?  6 :  1;//sbyte  : byte
+			case 2: return std::is_signed<T>::value ?  8 :  3;//sshort : short
+			case 4: return std::is_signed<T>::value ?  9 :  4;//slong  : long
+			default:return std::is_signed<T>::value ? 17 : 16;//slong8 : long8
+		}
+	}
+};
+
+//@brief: streaming multi page tif writer, pages are appended as they are produced
+//@note: pages are linked as they are written so the file is a valid tif after every append
+//       memory use is bounded by the write buffer (pages larger than the buffer are written directly)
+//       pages are split into strips or tiles that are compressed in parallel on the shared thread pool
+class TifWriter {
+	std::ofstream os;          //output file
+	std::vector<char> buffer;  //bytes not yet passed to os
+	size_t capacity;           //maximum bytes to hold in buffer
+	std::uint64_t flushed;     //bytes already passed to os
+	std::uint64_t link;        //file position of the offset to update when the next ifd is written
+	std::uint64_t nPages;      //number of pages written
+	bool isBig;                //BigTIFF (64 bit offsets) instead of classic tif
+	TifOptions opts;           //compression and layout of pages
+
+	//@brief: an image (page or reduced resolution copy) ready to write
+	struct EncodedImage {
+		TifIfd ifd;                             //tags (block offsets are filled in once the layout is known)
+		bool tiled;                             //blocks are tiles instead of strips
+		std::vector< std::vector<char> > blocks;//encoded strips / tiles
+		char const * raw;                       //uncompressed strips are written straight from the page instead of blocks
+		std::vector<std::uint64_t> counts;      //bytes in each block
+		std::vector<std::uint64_t> offsets;     //file offset of each block
+		std::vector<std::uint64_t> subIfds;     //file offset of each reduced resolution copy (page only)
+		std::uint64_t ifdOffset;                //file offset of ifd
+		explicit EncodedImage(const bool big) : ifd(big), tiled(false), raw(NULL), ifdOffset(0) {}
+	};
+
+	//@brief: split an image into strips or tiles, compress them in parallel, and build its ifd
+	//@param data: image (h rows of w values)
+	//@param w: image width
+	//@param h: image height
+	//@param isReduced: true for reduced resolution copies
+	//@param im: location to write encoded image
+	template <typename T>
+	void encode(T const * const data, const std::uint32_t w, const std::uint32_t h, const bool isReduced, EncodedImage& im) const {
+		const bool compressed = TifCompression::None != opts.compression;
+		const bool predictor = compressed && std::numeric_limits<T>::is_integer;//horizontal differencing makes smooth integer images much more compressible
+		const std::uint64_t rowBytes = std::uint64_t(w) * sizeof(T);
+		im.tiled = 0 != opts.tileSize;
+		if(im.tiled) {
+			//tiles are padded to full size at the right / bottom edges (with zeros)
+			const std::uint32_t tile = opts.tileSize;
+			const std::uint32_t across = (w + tile - 1) / tile, down = (h + tile - 1) / tile;
+			im.blocks.resize(size_t(across) * down);
+			ThreadPool::Shared().parallelFor(0, im.blocks.size(), [&](const size_t i) {
+				const std::uint32_t x0 = std::uint32_t(i % across) * tile, y0 = std::uint32_t(i / across) * tile;
+				const std::uint32_t cols = std::min(tile, w - x0), rows = std::min(tile, h - y0);
+				std::vector<T> buff(size_t(tile) * tile, T(0));
+				for(std::uint32_t r = 0; r < rows; r++) std::copy(data + size_t(y0 + r) * w + x0, data + size_t(y0 + r) * w + x0 + cols, buff.data() + size_t(r) * tile);
+				if(compressed) im.blocks[i] = detail::encodeBlock(buff.data(), tile, tile, opts.compression, predictor);
+				else im.blocks[i].assign(reinterpret_cast<char const*>(buff.data()), reinterpret_cast<char const*>(buff.data() + buff.size()));
+			});
+		} else {
+			//strips of whole rows
+			const std::uint32_t rowsPerStrip = (std::uint32_t)std::max<std::uint64_t>(1, std::min<std::uint64_t>(h, StripBytes / std::max<std::uint64_t>(rowBytes, 1)));
+			const std::uint32_t strips = (h + rowsPerStrip - 1) / rowsPerStrip;
+			im.counts.resize(strips);
+			for(std::uint32_t i = 0; i < strips; i++) im.counts[i] = rowBytes * std::min(rowsPerStrip, h - i * rowsPerStrip);
+			if(compressed) {
+				im.blocks.resize(strips);
+				ThreadPool::Shared().parallelFor(0, strips, [&](const size_t i) {
+					im.blocks[i] = detail::encodeBlock(data + i * rowsPerStrip * size_t(w), w, (size_t)(im.counts[i] / rowBytes), opts.compression, predictor);
+				});
+			} else {
+				im.raw = reinterpret_cast<char const*>(data);
+			}
+			im.ifd.set(0x0116, rowsPerStrip);//rows per strip
+		}
+		if(!im.blocks.empty()) {
+			im.counts.resize(im.blocks.size());
+			for(size_t i = 0; i < im.blocks.size(); i++) im.counts[i] = im.blocks[i].size();
+		}
+		im.offsets.assign(im.counts.size(), 0);
+
+		std::uint16_t format = 4;//undefined
+		if(std::numeric_limits<T>::is_integer) format = std::numeric_limits<T>::is_signed ? 2 : 1;//signed / unsigned int
+		else if(std::numeric_limits<T>::is_iec559) format = 3;//floating point
+		if(isReduced) im.ifd.set(0x00FE, std::uint32_t(1));//new subfile type: reduced resolution
+		im.ifd.set(0x0100, w);//width
+		im.ifd.set(0x0101, h);//height
+		im.ifd.set(0x0102, std::uint16_t(CHAR_BIT * sizeof(T)));//bits per sample
+		im.ifd.set(0x0103, std::uint16_t(opts.compression));//compression
+		im.ifd.set(0x0106, std::uint16_t(1));//photometric interpretation: black is zero
+		im.ifd.set(0x0115, std::uint16_t(1));//samples per pixel
+		if(predictor) im.ifd.set(0x013D, std::uint16_t(2));//predictor: horizontal differencing
+		if(im.tiled) {
+			im.ifd.set(0x0142, opts.tileSize);//tile width
+			im.ifd.set(0x0143, opts.tileSize);//tile length
+			im.ifd.setOffsets(0x0144, im.offsets);//tile offsets (placeholder, same size)
+			im.ifd.setOffsets(0x0145, im.counts);//tile byte counts
+		} else {
+			im.ifd.setOffsets(0x0111, im.offsets);//strip offsets (placeholder, same size)
+			im.ifd.setOffsets(0x0117, im.counts);//strip byte counts
+		}
+		im.ifd.set(0x0153, format);//sample format
+	}
+
+	//@brief: queue bytes for writing
+	//@note: the file is always written in whole buffer sized chunks (except the last) so writes start at multiples of the buffer size
+	void put(char const * const data, const size_t count) {
+		size_t done = 0;
+		while(done < count) {
+			if(buffer.empty() && count - done >= capacity) {//skip the copy for whole chunks
+				const size_t direct = (count - done) / capacity * capacity;
+				os.write(data + done, direct);
+				flushed += direct;
+				done += direct;
+				continue;
+			}
+			const size_t n = std::min(capacity - buffer.size(), count - done);
+			buffer.insert(buffer.end(), data + done, data + done + n);
+			done += n;
+			if(capacity == buffer.size()) flush();
+		}
+	}
+
+	//@brief: overwrite an offset that has already been queued
+	void patch(const std::uint64_t position, const std::uint64_t value) {
+		const std::uint32_t value32 = (std::uint32_t)value;
+		char const * const bytes = isBig ? reinterpret_cast<char const*>(&value) : reinterpret_cast<char const*>(&value32);
+		const size_t count = isBig ? 8 : 4;
+		if(position >= flushed) {
+			std::memcpy(buffer.data() + (position - flushed), bytes, count);
+		} else {
+			os.seekp((std::streamoff)position);
+			os.write(bytes, count);
+			os.seekp((std::streamoff)flushed);
+		}
+	}
+
+public:
+	static const size_t DefaultBuffer = 64 * 1024 * 1024;
+	static const std::uint64_t StripBytes = 256 * 1024;//target (uncompressed) strip size, readers can load part of a page and strips are compressed in parallel
+
+	//@param fileName: file to create (overwritten if it exists)
+	//@param big: true to write BigTIFF, false for a classic tif (appends throw once the file would exceed 4 GB)
+	//@param options: compression and layout of pages
+	//@param bufferBytes: size of write buffer
+	explicit TifWriter(const std::string& fileName, const bool big = true, const TifOptions& options = TifOptions(), const size_t bufferBytes = DefaultBuffer) :
+		capacity(std::max<size_t>(bufferBytes, 64)), flushed(0), link(big ? 8 : 4), nPages(0), isBig(big), opts(options) {
+		opts.validate();
+		os.rdbuf()->pubsetbuf(NULL, 0);//buffering is done here
+		os.open(fileName, std::ios::out | std::ios::binary | std::ios::trunc);
+		if(!os) throw std::runtime_error("couldn't open " + fileName + " for writing");
+		buffer.reserve(capacity);
+
+		//header: byte order, version (42 or 43), [offset size (8), padding,] first ifd offset (0 until a page is written)
+		const union {
+			std::uint16_t i;
+			char c[2];
+		} u = {0x0102};
+		const char version = isBig ? 0x2B : 0x2A;
+		const char bigMagic[4] = {'M','M',0x00,version};
+		const char litMagic[4] = {'I','I',version,0x00};
+		put(u.c[0] == 1 ? bigMagic : litMagic, 4);
+		if(isBig) {
+			const std::uint16_t offsetSize = 8, padding = 0;
+			const std::uint64_t firstIfd = 0;
+			put(reinterpret_cast<char const*>(&offsetSize), 2);
+			put(reinterpret_cast<char const*>(&padding), 2);
+			put(reinterpret_cast<char const*>(&firstIfd), 8);
+		} else {
+			const std::uint32_t firstIfd = 0;
+			put(reinterpret_cast<char const*>(&firstIfd), 4);
+		}
+	}
+
+	TifWriter(const TifWriter&) = delete;
+	TifWriter& operator=(const TifWriter&) = delete;
+
+	~TifWriter() {
+		try {
+			close();
+		} catch (...) {
+		}
 	}
 
+	//@brief: append a page
+	//@param data: page (h rows of w values, top row first)
+	//@param w: page width
+	//@param h: page height
+	//@note: reduced resolution copies (if requested) are written as sub ifds immediately after the page
 	template <typename T>
-	static void Write(T const * const * const data, const std::uint32_t w, const std::uint32_t h, const std::uint32_t slices, std::string fileName) {
+	void append(T const * const data, const std::uint32_t w, const std::uint32_t h) {
+		if(!os.is_open()) throw std::runtime_error("can't append to a closed tif");
+
+		//build pyramid, each level is computed from the previous one
+		std::vector< std::vector<T> > reduced;
+		std::vector<std::uint32_t> widths(1, w), heights(1, h);
+		for(std::uint32_t i = 0; i < opts.levels && (widths.back() > 1 || heights.back() > 1); i++) {
+			const std::uint32_t wOut = (widths.back() + 1) / 2, hOut = (heights.back() + 1) / 2;
+			reduced.push_back(std::vector<T>(size_t(wOut) * hOut));
+			detail::halve(reduced.size() > 1 ? reduced[reduced.size() - 2].data() : data, widths.back(), heights.back(), reduced.back().data());
+			widths.push_back(wOut);
+			heights.push_back(hOut);
+		}
+
+		//encode every image of the page
+		std::vector<EncodedImage> images(1 + reduced.size(), EncodedImage(isBig));
+		for(size_t i = 0; i < images.size(); i++) encode(0 == i ? data : reduced[i-1].data(), widths[i], heights[i], 0 != i, images[i]);
+
+		//layout: page ifd, page blocks, then each sub ifd and its blocks (ifds are word aligned)
+		images[0].subIfds.assign(reduced.size(), 0);
+		if(!reduced.empty()) images[0].ifd.setOffsets(0x014A, images[0].subIfds, true);//sub ifds (placeholder, same size)
+		std::uint64_t offset = position();
+		for(EncodedImage& im : images) {
+			offset += offset % 2;
+			im.ifdOffset = offset;
+			offset += im.ifd.size();
+			for(size_t i = 0; i < im.counts.size(); i++) {
+				im.offsets[i] = offset;
+				offset += im.counts[i];
+			}
+		}
+		for(size_t i = 1; i < images.size(); i++) images[0].subIfds[i-1] = images[i].ifdOffset;
+		if(!reduced.empty()) images[0].ifd.setOffsets(0x014A, images[0].subIfds, true);
+
+		//serialize everything before writing so a classic tif past 4 GB throws without writing a partial page
+		std::vector< std::vector<char> > ifdBytes(images.size());
+		for(size_t i = 0; i < images.size(); i++) {
+			EncodedImage& im = images[i];
+			im.ifd.setOffsets(im.tiled ? 0x0144 : 0x0111, im.offsets);//tile / strip offsets
+			im.ifd.serialize(im.ifdOffset, ifdBytes[i]);
+		}
+		for(size_t i = 0; i < images.size(); i++) {
+			const EncodedImage& im = images[i];
+			if(0 != position() % 2) put("", 1);
+			put(ifdBytes[i].data(), ifdBytes[i].size());
+			if(NULL != im.raw) {
+				put(im.raw, (size_t)std::accumulate(im.counts.begin(), im.counts.end(), std::uint64_t(0)));
+			} else {
+				for(const std::vector<char>& b : im.blocks) put(b.data(), b.size());
+			}
+		}
+
+		//link the page from the previous ifd (or header) only once it is completely queued
+		patch(link, images[0].ifdOffset);
+		link = images[0].ifdOffset + images[0].ifd.nextPosition();
+		++nPages;
+		if(!os) throw std::runtime_error("failed to write tif page");
+	}
+	template <typename T> void append(const std::vector<T>& page, const std::uint32_t w, const std::uint32_t h) {append(page.data(), w, h);}
+
+	//@brief: pass buffered bytes to the file
+	void flush() {
+		if(buffer.empty()) return;
+		os.write(buffer.data(), buffer.size());
+		flushed += buffer.size();
+		buffer.clear();
+		if(!os) throw std::runtime_error("failed to write tif");
+	}
+
+	//@brief: flush and close the file (further appends throw)
+	void close() {
+		if(!os.is_open()) return;
+		flush();
+		os.close();
+		if(!os) throw std::runtime_error("failed to close tif");
+	}
+
+	//@brief: get the current file size (including buffered bytes)
+	std::uint64_t position() const {return flushed + buffer.size();}
+
+	//@brief: get the number of pages written
+	std::uint64_t pages() const {return nPages;}
+};
+
+namespace detail {
+	//@brief: undo the tif horizontal predictor (running sum of each row)
+	template <typename T>
+	void horizontalAccumulate(T * const data, const size_t w, const size_t h) {
+		typedef typename UnsignedBytes<sizeof(T)>::type U;
+		for(size_t r = 0; r < h; r++) {
+			U* const row = reinterpret_cast<U*>(data + r * w);
+			for(size_t c = 1; c < w; c++) row[c] = U(row[c] + row[c-1]);
+		}
+	}
+
+	//@brief: decode tif flavored lzw (inverse of lzwEncode, also reads libtiff output)
+	//@param src: encoded bytes
+	//@param count: number of encoded bytes
+	//@param dst: location to write decoded bytes
+	//@param capacity: number of bytes expected
+	inline void lzwDecode(std::uint8_t const * const src, const size_t count, std::uint8_t * const dst, const size_t capacity) {
+		const std::uint32_t Clear = 256, Eoi = 257, First = 258;
+		std::vector<std::uint16_t> prefix(4096), length(4096);
+		std::vector<std::uint8_t> suffix(4096), first(4096);
+		for(std::uint32_t i = 0; i < 256; i++) {
+			length[i] = 1;
+			suffix[i] = first[i] = (std::uint8_t)i;
+		}
+
+		std::uint32_t bits = 9, next = First, old = Eoi;//old == Eoi before the first code after a clear
+		std::uint64_t acc = 0;
+		int held = 0;
+		size_t in = 0, out = 0;
+		while(true) {
+			while(held < (int)bits && in < count) {
+				acc = (acc << 8) | src[in++];
+				held += 8;
+			}
+			if(held < (int)bits) break;//ran out of data without an end code
+			held -= bits;
+			const std::uint32_t code = std::uint32_t(acc >> held) & ((1u << bits) - 1);
+			if(Eoi == code) break;
+			if(Clear == code) {
+				next = First;
+				bits = 9;
+				old = Eoi;
+				continue;
+			}
+			if(code > next || (code == next && Eoi == old)) throw std::runtime_error("corrupt lzw data");
+
+			//add the entry the encoder created when it emitted the previous code
+			if(Eoi != old) {
+				if(next >= 4096) throw std::runtime_error("corrupt lzw data");
+				prefix[next] = (std::uint16_t)old;
+				length[next] = std::uint16_t(length[old] + 1);
+				first[next] = first[old];
+				suffix[next] = code == next ? first[old] : first[code];
+				if(++next + 1 >= (1u << bits) && bits < 12) ++bits;
+			}
+
+			//write string backwards by following prefixes
+			const size_t len = length[code];
+			if(out + len > capacity) throw std::runtime_error("lzw data decodes to more bytes than expected");
+			std::uint32_t c = code;
+			for(size_t i = len; i > 0; i--) {
+				dst[out + i - 1] = suffix[c];
+				c = prefix[c];
+			}
+			out += len;
+			old = code;
+		}
+		if(out != capacity) throw std::runtime_error("lzw data decodes to fewer bytes than expected");
+	}
+
+	//@brief: decompress a block of rows (inverse of encodeBlock)
+	//@param src: encoded bytes
+	//@param count: number of encoded bytes
+	//@param dst: location to write rows (w * h samples)
+	//@param w: samples per row
+	//@param h: number of rows
+	//@param compression: scheme used to encode
+	//@param predictor: true if the horizontal predictor was applied
+	template <typename T>
+	void decodeBlock(char const * const src, const size_t count, T * const dst, const size_t w, const size_t h, const TifCompression compression, const bool predictor) {
+		const size_t bytes = w * h * sizeof(T);
+		std::uint8_t * const out = reinterpret_cast<std::uint8_t*>(dst);
+		switch(compression) {
+			case TifCompression::None:
+				if(count < bytes) throw std::runtime_error("truncated tif block");
+				std::memcpy(out, src, bytes);
+				break;
+
+			case TifCompression::Lzw:
+				lzwDecode(reinterpret_cast<std::uint8_t const*>(src), count, out, bytes);
+				break;
+
+#ifdef EXTERNAL_SCAN_USE_ZLIB
+			case TifCompression::Deflate: {
+				uLongf len = (uLongf)bytes;
+				if(Z_OK != uncompress(out, &len, reinterpret_cast<Bytef const*>(src), (uLong)count) || bytes != len) throw std::runtime_error("corrupt deflate data");
+			} break;
+#endif
+
+#ifdef EXTERNAL_SCAN_USE_ZSTD
+			case TifCompression::Zstd: {
+				const size_t len = ZSTD_decompress(out, bytes, src, count);
+				if(ZSTD_isError(len) || bytes != len) throw std::runtime_error("corrupt zstd data");
+			} break;
+#endif
+
+			default: throw std::runtime_error("unsupported tif compression");
+		}
+		if(predictor) horizontalAccumulate(dst, w, h);
+	}
+}
+
+//@brief: read only memory mapping of an entire file
+class MappedFile {
+	char const * ptr;//start of mapping
+	std::uint64_t len;//size of file
+#ifdef _WIN32
+	HANDLE file, mapping;
+#endif
+
+public:
+	//@param fileName: file to map
+	explicit MappedFile(const std::string& fileName) : ptr(NULL), len(0) {
+#ifdef _WIN32
+		file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if(INVALID_HANDLE_VALUE == file) throw std::runtime_error("couldn't open " + fileName);
+		LARGE_INTEGER size;
+		GetFileSizeEx(file, &size);
+		len = (std::uint64_t)size.QuadPart;
+		mapping = 0 == len ? NULL : CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if(NULL != mapping) ptr = reinterpret_cast<char const*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+		if(NULL == ptr) {
+			if(NULL != mapping) CloseHandle(mapping);
+			CloseHandle(file);
+			throw std::runtime_error("couldn't map " + fileName);
+		}
+#else
+		const int fd = ::open(fileName.c_str(), O_RDONLY);
+		if(fd < 0) throw std::runtime_error("couldn't open " + fileName);
+		struct stat st;
+		if(0 != fstat(fd, &st) || 0 == st.st_size) {
+			::close(fd);
+			throw std::runtime_error("couldn't map " + fileName);
+		}
+		len = (std::uint64_t)st.st_size;
+		void * const p = mmap(NULL, (size_t)len, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);//the mapping keeps the file open
+		if(MAP_FAILED == p) throw std::runtime_error("couldn't map " + fileName);
+		ptr = reinterpret_cast<char const*>(p);
+#endif
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile() {
+#ifdef _WIN32
+		UnmapViewOfFile(ptr);
+		CloseHandle(mapping);
+		CloseHandle(file);
+#else
+		munmap(const_cast<char*>(ptr), (size_t)len);
+#endif
+	}
+
+	char const * data() const {return ptr;}
+	std::uint64_t size() const {return len;}
+};
+
+//@brief: memory mapped multi page tif reader (native byte order, classic or BigTIFF)
+//@note: uncompressed pages stored contiguously (e.g. everything written by Tif::Write without compression / tiles) can be viewed without copying
+//       other pages (strips or tiles, compressed with any available scheme) are decoded by read
+class TifReader {
+public:
+	//@brief: layout of a single page
+	struct Page {
+		std::uint32_t width, height;       //image size
+		std::uint16_t bits;                //bits per sample
+		std::uint16_t format;              //sample format (1 = unsigned, 2 = signed, 3 = float)
+		TifCompression compression;        //compression of each block
+		bool predictor;                    //horizontal predictor applied before compression
+		std::uint32_t blockWidth;          //tile width or image width for strips
+		std::uint32_t blockHeight;         //tile length or rows per strip
+		bool tiled;                        //blocks are tiles instead of strips
+		std::vector<std::uint64_t> offsets;//file offset of each block
+		std::vector<std::uint64_t> counts; //bytes in each block
+	};
+
+	//@param fileName: tif to map
+	explicit TifReader(const std::string& fileName) : file(fileName) {
+		const union {
+			std::uint16_t i;
+			char c[2];
+		} u = {0x0102};
+		if(file.size() < 8) throw std::runtime_error(fileName + " isn't a tif");
+		const char order = u.c[0] == 1 ? 'M' : 'I';
+		if(order != file.data()[0] || order != file.data()[1]) throw std::runtime_error(fileName + " isn't a native byte order tif");
+		const std::uint16_t version = value<std::uint16_t>(2);
+		if(42 == version) isBig = false;
+		else if(43 == version && file.size() >= 16) isBig = true;
+		else throw std::runtime_error(fileName + " isn't a tif");
+
+		//walk the ifd chain (sub ifds aren't pages)
+		std::uint64_t offset = isBig ? value<std::uint64_t>(8) : value<std::uint32_t>(4);
+		while(0 != offset) {
+			if(pageList.size() > file.size() / 8) throw std::runtime_error(fileName + " has an ifd loop");
+			offset = parseIfd(offset);
+		}
+	}
+
+	//@brief: get the number of pages
+	size_t pages() const {return pageList.size();}
+
+	//@brief: get the layout of a page
+	const Page& page(const size_t i) const {return pageList.at(i);}
+
+	//@brief: check if a page can be viewed without copying (uncompressed contiguous strips aligned for the sample type)
+	bool viewable(const size_t i) const {
+		const Page& p = page(i);
+		if(TifCompression::None != p.compression || p.tiled) return false;
+		std::uint64_t end = p.offsets.front();
+		for(size_t j = 0; j < p.offsets.size(); j++) {
+			if(p.offsets[j] != end) return false;
+			end += p.counts[j];
+		}
+		const std::uint64_t sampleBytes = (p.bits + CHAR_BIT - 1) / CHAR_BIT;
+		if(end - p.offsets.front() < std::uint64_t(p.width) * p.height * sampleBytes) return false;
+		return 0 == reinterpret_cast<std::uintptr_t>(file.data() + p.offsets.front()) % sampleBytes;
+	}
+
+	//@brief: get a zero copy view of an uncompressed page
+	//@param i: page index
+	//@return: pointer to width * height samples (valid while the reader exists)
+	template <typename T>
+	T const * view(const size_t i) const {
+		check<T>(page(i));
+		if(!viewable(i)) throw std::runtime_error("only uncompressed contiguous strips can be viewed without copying");
+		return reinterpret_cast<T const*>(file.data() + page(i).offsets.front());
+	}
+
+	//@brief: copy (and decode if needed) a page
+	//@param i: page index
+	//@param dst: location to write width * height samples
+	template <typename T>
+	void read(const size_t i, T * const dst) const {
+		const Page& p = page(i);
+		check<T>(p);
+		const std::uint32_t across = p.tiled ? (p.width + p.blockWidth - 1) / p.blockWidth : 1;
+		ThreadPool::Shared().parallelFor(0, p.offsets.size(), [&](const size_t j) {
+			const std::uint32_t x0 = p.tiled ? std::uint32_t(j % across) * p.blockWidth : 0;
+			const std::uint32_t y0 = std::uint32_t(p.tiled ? j / across : j) * p.blockHeight;
+			const std::uint32_t rows = p.tiled ? p.blockHeight : std::min(p.blockHeight, p.height - y0);//the last strip may be short
+			char const * const src = file.data() + p.offsets[j];
+			if(p.tiled) {
+				std::vector<T> tile(size_t(p.blockWidth) * p.blockHeight);
+				detail::decodeBlock(src, (size_t)p.counts[j], tile.data(), p.blockWidth, rows, p.compression, p.predictor);
+				const std::uint32_t cols = std::min(p.blockWidth, p.width - x0);
+				for(std::uint32_t r = 0; r < std::min(p.blockHeight, p.height - y0); r++) std::copy(tile.data() + size_t(r) * p.blockWidth, tile.data() + size_t(r) * p.blockWidth + cols, dst + size_t(y0 + r) * p.width + x0);
+			} else {
+				detail::decodeBlock(src, (size_t)p.counts[j], dst + size_t(y0) * p.width, p.width, rows, p.compression, p.predictor);
+			}
+		});
+	}
+
+	//@brief: copy (and decode if needed) a page
+	template <typename T>
+	std::vector<T> read(const size_t i) const {
+		std::vector<T> data(size_t(page(i).width) * page(i).height);
+		read(i, data.data());
+		return data;
+	}
+
+private:
+	MappedFile file;           //mapped tif
+	bool isBig;                //BigTIFF layout
+	std::vector<Page> pageList;//layout of each page
+
+	//@brief: read a value from the file
+	template <typename T>
+	T value(const std::uint64_t offset) const {
+		if(offset + sizeof(T) > file.size()) throw std::runtime_error("corrupt tif (offset past end of file)");
+		T v;
+		std::memcpy(&v, file.data() + offset, sizeof(T));
+		return v;
+	}
+
+	//@brief: read every value of an ifd entry as unsigned integers
+	//@param entry: file offset of entry
+	std::vector<std::uint64_t> values(const std::uint64_t entry) const {
+		const std::uint16_t type = value<std::uint16_t>(entry + 2);
+		const std::uint64_t count = isBig ? value<std::uint64_t>(entry + 4) : value<std::uint32_t>(entry + 4);
+		size_t bytes;
+		switch(type) {
+			case 1: case 6: case 7: bytes = 1; break;//byte, sbyte, undefined
+			case 3: case 8: bytes = 2; break;//short, sshort
+			case 4: case 9: case 13: bytes = 4; break;//long, slong, ifd
+			case 16: case 17: case 18: bytes = 8; break;//long8, slong8, ifd8
+			default: return std::vector<std::uint64_t>();//not needed for images
+		}
+		const std::uint64_t inlineBytes = isBig ? 8 : 4;
+		std::uint64_t offset = entry + (isBig ? 12 : 8);
+		if(count * bytes > inlineBytes) offset = isBig ? value<std::uint64_t>(offset) : value<std::uint32_t>(offset);
+		if(count > file.size() || offset + count * bytes > file.size()) throw std::runtime_error("corrupt tif (tag values past end of file)");
+		std::vector<std::uint64_t> v((size_t)count);
+		for(size_t i = 0; i < v.size(); i++) {
+			switch(bytes) {
+				case 1: v[i] = value<std::uint8_t >(offset + i    ); break;
+				case 2: v[i] = value<std::uint16_t>(offset + i * 2); break;
+				case 4: v[i] = value<std::uint32_t>(offset + i * 4); break;
+				case 8: v[i] = value<std::uint64_t>(offset + i * 8); break;
+			}
+		}
+		return v;
+	}
+
+	//@brief: parse an ifd into a page
+	//@param offset: file offset of ifd
+	//@return: offset of next ifd
+	std::uint64_t parseIfd(const std::uint64_t offset) {
+		const std::uint64_t count = isBig ? value<std::uint64_t>(offset) : value<std::uint16_t>(offset);
+		const std::uint64_t entryBytes = isBig ? 20 : 12;
+		const std::uint64_t first = offset + (isBig ? 8 : 2);
+		std::map<std::uint16_t, std::vector<std::uint64_t> > tags;
+		for(std::uint64_t i = 0; i < count; i++) tags[value<std::uint16_t>(first + i * entryBytes)] = values(first + i * entryBytes);
+		auto get = [&](const std::uint16_t tag, const std::uint64_t def) {
+			std::map<std::uint16_t, std::vector<std::uint64_t> >::const_iterator it = tags.find(tag);
+			return tags.end() == it || it->second.empty() ? def : it->second.front();
+		};
+
+		Page p;
+		p.width = (std::uint32_t)get(0x0100, 0);
+		p.height = (std::uint32_t)get(0x0101, 0);
+		p.bits = (std::uint16_t)get(0x0102, 1);
+		p.format = (std::uint16_t)get(0x0153, 1);
+		p.compression = (TifCompression)get(0x0103, 1);
+		p.predictor = 2 == get(0x013D, 1);
+		p.tiled = tags.count(0x0144) > 0;
+		p.blockWidth = p.tiled ? (std::uint32_t)get(0x0142, 0) : p.width;
+		p.blockHeight = p.tiled ? (std::uint32_t)get(0x0143, 0) : (std::uint32_t)std::min<std::uint64_t>(get(0x0116, p.height), p.height);
+		p.offsets = tags[p.tiled ? 0x0144 : 0x0111];
+		p.counts = tags[p.tiled ? 0x0145 : 0x0117];
+		if(1 != get(0x0115, 1)) throw std::runtime_error("only single channel tifs can be read");
+		if(0 == p.width || 0 == p.height || 0 == p.blockWidth || 0 == p.blockHeight) throw std::runtime_error("corrupt tif (missing image size)");
+		const std::uint64_t blocks = p.tiled ? std::uint64_t((p.width + p.blockWidth - 1) / p.blockWidth) * ((p.height + p.blockHeight - 1) / p.blockHeight) : (p.height + p.blockHeight - 1) / p.blockHeight;
+		if(blocks != p.offsets.size() || blocks != p.counts.size()) throw std::runtime_error("corrupt tif (wrong number of blocks)");
+		for(size_t i = 0; i < p.offsets.size(); i++) {
+			if(p.offsets[i] + p.counts[i] > file.size()) throw std::runtime_error("corrupt tif (image data past end of file)");
+		}
+		pageList.push_back(p);
+		return isBig ? value<std::uint64_t>(first + count * entryBytes) : value<std::uint32_t>(first + count * entryBytes);
+	}
+
+	//@brief: make sure a page holds samples of type T
+	template <typename T>
+	static void check(const Page& p) {
+		std::uint16_t format = 4;
+		if(std::numeric_limits<T>::is_integer) format = std::numeric_limits<T>::is_signed ? 2 : 1;
+		else if(std::numeric_limits<T>::is_iec559) format = 3;
+		if(CHAR_BIT * sizeof(T) != p.bits || format != p.format) throw std::runtime_error("tif page doesn't hold the requested sample type");
+		if(!available(p.compression)) throw std::runtime_error("tif page uses an unsupported compression");
+	}
+};
+
+template <typename T>
+void Tif::Write(T const * const * const data, const std::uint32_t w, const std::uint32_t h, const std::uint32_t slices, std::string fileName) {
+		//classic tifs use 32 bit offsets, switch to BigTIFF when the file won't fit
+		//compressed pages are usually smaller but lzw can expand noisy data by up to 50%, tiles are padded, and the pyramid adds up to 1/3
+		const TifOptions& opts = options();
+		const std::uint64_t tile = opts.tileSize;
+		const std::uint64_t pageBytes = (0 == tile ? std::uint64_t(w) * h : (w + tile - 1) / tile * tile * ((h + tile - 1) / tile * tile)) * sizeof(T);
+		const std::uint64_t fileBytes = 8 + std::uint64_t(slices) * (126 + pageBytes);
+		const bool simple = TifCompression::None == opts.compression && 0 == opts.tileSize && 0 == opts.levels;
+		const std::uint64_t bound = simple ? fileBytes : fileBytes * 2 + std::uint64_t(slices) * (opts.levels + 1) * 4096;
+		const bool big = bound > std::numeric_limits<std::uint32_t>::max();
+		if(big || !simple) {
+			TifWriter tif(fileName, big, opts);
+			for(std::uint32_t i = 0; i < slices; i++) tif.append(data[i], w, h);
+			tif.close();
+			return;
+		}
+
 		//open file and write header + single ifd
 		Tif tif(w, h);
-		std::ofstream os(fileName, std::ios::out | std::ios::binary);
+		std::vector<char> streamBuffer(4 * 1024 * 1024);//rows are small, collect them into large writes
+		std::ofstream os;
+		os.rdbuf()->pubsetbuf(streamBuffer.data(), streamBuffer.size());
+		os.open(fileName, std::ios::out | std::ios::binary);
+		if(!os) throw std::runtime_error("couldn't open " + fileName + " for writing");
 		tif.writeHeader(os);
 		std::uint32_t offset = 0x00000008;
 		for(std::uint32_t i = 0; i < slices; i++) {
 			offset = tif.writeIfd<T>(os, offset, i+1 == slices);
 			tif.writeSlice<T>(os, data[i]);
 		}
+		os.close();
+		if(!os) throw std::runtime_error("failed to write " + fileName);
+}
+
+//@brief: background thread that writes tifs in the order they are queued so acquisition and processing can continue during disk io
+//@note: queued images are owned by the queue (moved in, never copied), the total size of queued images is bounded so a
+//       producer that outpaces the disk blocks instead of exhausting memory (at least one image is always accepted)
+class TifWriteQueue {
+	struct Job {
+		std::function<void()> write;//writes the image
+		size_t bytes;               //memory held by the job
+		std::promise<void> done;    //completion / error
+	};
+
+	std::deque< std::unique_ptr<Job> > jobs;//waiting jobs
+	size_t active;                          //number of waiting and running jobs
+	size_t pending;                         //bytes held by waiting and running jobs
+	size_t limit;                           //maximum pending bytes before submit blocks
+	bool stopping;                          //true once the queue is being destroyed
+	std::exception_ptr error;               //first error since the last wait()
+	std::mutex mut;
+	std::condition_variable cv;             //signaled when jobs are queued or finished
+	std::thread thread;                     //writer
+
+	//@brief: writer loop
+	void work() {
+		std::unique_lock<std::mutex> lock(mut);
+		while(true) {
+			cv.wait(lock, [&]{return stopping || !jobs.empty();});
+			if(jobs.empty()) return;//stopping and drained
+			std::unique_ptr<Job> job = std::move(jobs.front());
+			jobs.pop_front();
+			lock.unlock();
+			std::exception_ptr failure = NULL;
+			try {
+				job->write();
+			} catch (...) {
+				failure = std::current_exception();
+			}
+			job->write = std::function<void()>();//release the image before reporting completion
+			if(NULL == failure) job->done.set_value();
+			else job->done.set_exception(failure);
+			lock.lock();
+			if(NULL != failure && NULL == error) error = failure;
+			pending -= job->bytes;
+			--active;
+			cv.notify_all();
+		}
 	}
 
-	template <typename T> static void Write(std::vector<T>& buff, const std::uint32_t w, const std::uint32_t h, std::string fileName) {Write(buff.data(), w, h, fileName);}
-	template <typename T>	static void Write(std::vector< std::vector<T> >& buff, const std::uint32_t w, const std::uint32_t h, std::string fileName) {
-		std::vector<T const *> slicePointers(buff.size());
-		for(size_t i = 0; i < buff.size(); i++) slicePointers[i] = buff[i].data();
-		Write(slicePointers.data(), w, h, (std::uint32_t)slicePointers.size(), fileName);
+public:
+	static const size_t DefaultLimit = size_t(1) << 30;
+
+	//@param maxBytes: maximum memory held by queued images
+	explicit TifWriteQueue(const size_t maxBytes = DefaultLimit) : active(0), pending(0), limit(maxBytes), stopping(false), thread(&TifWriteQueue::work, this) {}
+
+	TifWriteQueue(const TifWriteQueue&) = delete;
+	TifWriteQueue& operator=(const TifWriteQueue&) = delete;
+
+	//@brief: write everything still queued and stop the writer (errors are only reported through the futures)
+	~TifWriteQueue() {
+		{
+			std::lock_guard<std::mutex> lock(mut);
+			stopping = true;
+		}
+		cv.notify_all();
+		thread.join();
 	}
 
-	private:
-		Tif(const std::uint32_t w, const std::uint32_t h) : width(w), height(h) {}
+	//@brief: queue a job on the writer thread
+	//@param write: function that writes a file (it must own or outlive the data it writes)
+	//@param bytes: memory held by the job (counted against the queue limit until it finishes)
+	//@return: future that becomes ready (or holds the exception thrown by write) once the file is written
+	std::future<void> submit(std::function<void()> write, const size_t bytes) {
+		std::unique_ptr<Job> job(new Job());
+		job->write = std::move(write);
+		job->bytes = bytes;
+		std::future<void> done = job->done.get_future();
+		{
+			std::unique_lock<std::mutex> lock(mut);
+			cv.wait(lock, [&]{return 0 == pending || pending + bytes <= limit;});
+			pending += bytes;
+			++active;
+			jobs.push_back(std::move(job));
+		}
+		cv.notify_all();
+		return done;
+	}
+
+	//@brief: queue a single page tif
+	//@param page: image (moved into the queue)
+	template <typename T>
+	std::future<void> write(std::vector<T>&& page, const std::uint32_t w, const std::uint32_t h, const std::string& fileName) {
+		const size_t bytes = page.size() * sizeof(T);
+		std::shared_ptr< std::vector<T> > data = std::make_shared< std::vector<T> >(std::move(page));
+		return submit([data, w, h, fileName]{Tif::Write(*data, w, h, fileName);}, bytes);
+	}
+
+	//@brief: queue a multi page tif
+	//@param pages: images (moved into the queue)
+	template <typename T>
+	std::future<void> write(std::vector< std::vector<T> >&& pages, const std::uint32_t w, const std::uint32_t h, const std::string& fileName) {
+		size_t bytes = 0;
+		for(const std::vector<T>& p : pages) bytes += p.size() * sizeof(T);
+		std::shared_ptr< std::vector< std::vector<T> > > data = std::make_shared< std::vector< std::vector<T> > >(std::move(pages));
+		return submit([data, w, h, fileName]{Tif::Write(*data, w, h, fileName);}, bytes);
+	}
+
+	//@brief: wait for every queued tif to be written
+	//@note: rethrows (and clears) the first write error since the previous call
+	void wait() {
+		std::unique_lock<std::mutex> lock(mut);
+		cv.wait(lock, [&]{return 0 == active;});
+		if(NULL != error) {
+			std::exception_ptr e = error;
+			error = NULL;
+			std::rethrow_exception(e);
+		}
+	}
 };
 
 #endif//_tif_h_
\ No newline at end of file
@@ -0,0 +1,133 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                                 *
+ * Copyright (c) 2017, Reagents of the University of California                    *
+ * All rights reserved.                                                            *
+ *                                                                                 *
+ * Redistribution and use in source and binary forms, with or without              *
+ * modification, are permitted provided that the following conditions are met:     *
+ *                                                                                 *
+ * 1. Redistributions of source code must retain the above copyright notice, this  *
+ *    list of conditions and the following disclaimer.                             *
+ *                                                                                 *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,    *
+ *    this list of conditions and the following disclaimer in the documentation    *
+ *    and/or other materials provided with the distribution.                       *
+ *                                                                                 *
+ * 3. Neither the name of the copyright holder nor the names of its                *
+ *    contributors may be used to endorse or promote products derived from         *
+ *    this software without specific prior written permission.                     *
+ *                                                                                 *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"     *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE  *
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE    *
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL      *
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR      *
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER      *
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,   *
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE   *
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.            *
+ *                                                                                 *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef _waveform_h_
+#define _waveform_h_
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+#include "NIDAQmx.h"//only needed for types
+
+//@brief: polynomial conversion from volts to raw DAC codes (e.g. coefficients from DAQmxGetAODevScalingCoeff)
+class DacScaling {
+	std::vector<float64> coeffs;//code = c[0] + c[1] * v + c[2] * v^2 + ...
+
+public:
+	DacScaling() {}
+	explicit DacScaling(const std::vector<float64>& c) : coeffs(c) {
+		if (coeffs.empty()) throw std::runtime_error("DAC scaling requires at least one coefficient");
+	}
+
+	//@brief: convert a voltage to the nearest DAC code
+	//@param v: voltage
+	//@return: code (clamped to the 16 bit range)
+	int16 operator()(const float64 v) const {
+		float64 code = 0;
+		for (size_t i = coeffs.size(); i > 0; i--) code = code * v + coeffs[i - 1];
+		return (int16)std::max(-32768.0, std::min(32767.0, std::round(code)));
+	}
+};
+
+//@brief: scan pattern computed on the fly from a single row template
+//@note: the full pattern is height rows of [nLineInt][forward (+ reverse if snake)] passes, x repeats every row and y is constant within a row
+class ScanWaveform {
+	std::vector<float64> line;//x voltage of each point in a row
+	std::vector<float64> rowY;//y voltage of each row
+
+	struct Volts {float64 operator()(const float64 v) const {return v;}};
+
+	//@brief: write x/y values for consecutive points
+	template <typename T, typename Convert>
+	void fillImpl(uInt64 first, uInt64 count, T* x, T* y, const Convert& cx, const Convert& cy) const {
+		const uInt64 n = line.size();
+		uInt64 row = first / n, col = first % n;
+		while (count > 0) {
+			const uInt64 run = std::min(count, n - col);//points remaining in this row
+			const T vy = cy(rowY[(size_t)row]);
+			for (uInt64 i = 0; i < run; i++) {
+				*x++ = cx(line[(size_t)(col + i)]);
+				*y++ = vy;
+			}
+			count -= run;
+			col = 0;
+			++row;
+		}
+	}
+
+public:
+	//@brief: build the row template
+	//@param xPass: x voltage of each point in a single forward pass
+	//@param y: y voltage of each row
+	//@param snake: true to follow each forward pass with a reverse pass
+	//@param nLineInt: number of times each row is repeated
+	void assign(const std::vector<float64>& xPass, const std::vector<float64>& y, const bool snake, const uInt64 nLineInt) {
+		if (xPass.empty() || y.empty() || 0 == nLineInt) throw std::runtime_error("scan waveform must have at least one point");
+		line.clear();
+		line.reserve(xPass.size() * (snake ? 2 : 1) * (size_t)nLineInt);
+		for (uInt64 j = 0; j < nLineInt; ++j) {
+			line.insert(line.end(), xPass.begin(), xPass.end());
+			if (snake) line.insert(line.end(), xPass.rbegin(), xPass.rend());
+		}
+		rowY = y;
+	}
+
+	//@brief: get the number of points in each row
+	uInt64 rowPoints() const {return line.size();}
+
+	//@brief: get the number of points (per channel) in the entire scan
+	uInt64 points() const {return line.size() * rowY.size();}
+
+	//@brief: get the x/y voltage of a single point
+	float64 x(const uInt64 i) const {return line[(size_t)(i % line.size())];}
+	float64 y(const uInt64 i) const {return rowY[(size_t)(i / line.size())];}
+
+	//@brief: write voltages for consecutive points
+	//@param first: index of first point
+	//@param count: number of points
+	//@param x: location to write x voltages (count)
+	//@param y: location to write y voltages (count)
+	void fill(const uInt64 first, const uInt64 count, float64* x, float64* y) const {fillImpl(first, count, x, y, Volts(), Volts());}
+
+	//@brief: write raw DAC codes for consecutive points
+	//@param first: index of first point
+	//@param count: number of points
+	//@param x: location to write x codes (count)
+	//@param y: location to write y codes (count)
+	//@param sx: x channel voltage -> code conversion
+	//@param sy: y channel voltage -> code conversion
+	void fill(const uInt64 first, const uInt64 count, int16* x, int16* y, const DacScaling& sx, const DacScaling& sy) const {fillImpl(first, count, x, y, sx, sy);}
+};
+
+#endif//_waveform_h_